@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// libfrootspi: FrootsPiのスイッチ、LED、LCDを使うためのライブラリ
+//
+// ビルド: gcc -O2 -Wall -fPIC -shared -I../src/drivers -o libfrootspi.so frootspi.c
+//
+// 1つのハンドルを複数のスレッドで同時に使わないこと (frootspi_stop()を除く)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "frootspi.h"
+#include "frootspi_input.h"
+
+#define INPUT_PATH "/dev/frootspi_input0"
+#define LED_PATH_FORMAT "/dev/frootspi_led%u"
+#define LCD_PATH "/dev/frootspi_lcd0"
+#define MAX_LEDS 8
+// 1回のread()で読むイベントの数 (ドライバのキューのデフォルトの長さ)
+#define READ_BATCH 64
+
+struct frootspi {
+	int input_fd;
+	int stop_fd; // frootspi_stop()でpoll()を起こすためのeventfd
+	int led_fds[MAX_LEDS];
+	int lcd_fd;
+	// 最後に受け取った値 (押されたら1、不明なら-1)
+	signed char pushsw[FROOTSPI_MAX_SWITCHES];
+	signed char dipsw[FROOTSPI_MAX_SWITCHES];
+};
+
+struct frootspi *frootspi_open(void)
+{
+	struct frootspi *fs = calloc(1, sizeof(struct frootspi));
+	if (fs == NULL) {
+		return NULL;
+	}
+	for (int i = 0; i < MAX_LEDS; i++) {
+		fs->led_fds[i] = -1;
+	}
+	fs->lcd_fd = -1;
+	memset(fs->pushsw, -1, sizeof(fs->pushsw));
+	memset(fs->dipsw, -1, sizeof(fs->dipsw));
+
+	// 開いた直後に全スイッチの現在の値が届く
+	fs->input_fd = open(INPUT_PATH, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fs->input_fd < 0) {
+		goto failed_open_input;
+	}
+	fs->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fs->stop_fd < 0) {
+		goto failed_eventfd;
+	}
+	return fs;
+
+failed_eventfd:
+	close(fs->input_fd);
+failed_open_input:
+	free(fs);
+	return NULL;
+}
+
+void frootspi_close(struct frootspi *fs)
+{
+	if (fs == NULL) {
+		return;
+	}
+	for (int i = 0; i < MAX_LEDS; i++) {
+		if (fs->led_fds[i] >= 0) {
+			close(fs->led_fds[i]);
+		}
+	}
+	if (fs->lcd_fd >= 0) {
+		close(fs->lcd_fd);
+	}
+	close(fs->stop_fd);
+	close(fs->input_fd);
+	free(fs);
+}
+
+int frootspi_fd(const struct frootspi *fs)
+{
+	return fs->input_fd;
+}
+
+// ドライバのイベントを変換し、スイッチの状態を更新する
+static int convert_event(struct frootspi *fs,
+	const struct frootspi_input_event *raw, struct frootspi_event *event)
+{
+	event->time_ns = raw->time_ns;
+	event->index = raw->code;
+	switch (raw->type) {
+	case FROOTSPI_EV_DROPPED:
+		event->type = FROOTSPI_EVENT_DROPPED;
+		event->value = raw->value;
+		return 0;
+	case FROOTSPI_EV_PUSHSW:
+	case FROOTSPI_EV_DIPSW:
+		if (raw->code >= FROOTSPI_MAX_SWITCHES) {
+			return -1;
+		}
+		// 負論理なので0なら押されている
+		event->value = raw->value == 0;
+		if (raw->type == FROOTSPI_EV_PUSHSW) {
+			event->type = FROOTSPI_EVENT_PUSHSW;
+			fs->pushsw[raw->code] = event->value;
+		} else {
+			event->type = FROOTSPI_EVENT_DIPSW;
+			fs->dipsw[raw->code] = event->value;
+		}
+		return 0;
+	default:
+		// 新しいドライバが増やした種類は無視する
+		return -1;
+	}
+}
+
+int frootspi_dispatch(struct frootspi *fs, int timeout_ms,
+	frootspi_callback callback, void *arg)
+{
+	struct frootspi_input_event raw[READ_BATCH];
+
+	if (timeout_ms != 0) {
+		struct pollfd pfd = {.fd = fs->input_fd, .events = POLLIN};
+		int retval = poll(&pfd, 1, timeout_ms);
+		if (retval <= 0) {
+			return retval;
+		}
+	}
+
+	ssize_t len = read(fs->input_fd, raw, sizeof(raw));
+	if (len < 0) {
+		return errno == EAGAIN ? 0 : -1;
+	}
+
+	int num_events = len / sizeof(raw[0]);
+	for (int i = 0; i < num_events; i++) {
+		struct frootspi_event event;
+		if (convert_event(fs, &raw[i], &event) == 0 && callback) {
+			callback(&event, arg);
+		}
+	}
+	return num_events;
+}
+
+int frootspi_run(struct frootspi *fs, frootspi_callback callback, void *arg)
+{
+	struct pollfd pfds[2] = {
+		{.fd = fs->input_fd, .events = POLLIN},
+		{.fd = fs->stop_fd, .events = POLLIN},
+	};
+	uint64_t stop;
+
+	for (;;) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (pfds[1].revents & POLLIN) {
+			// 次のfrootspi_run()のためにカウンタを戻す
+			if (read(fs->stop_fd, &stop, sizeof(stop)) < 0) {
+				return -1;
+			}
+			return 0;
+		}
+		if ((pfds[0].revents & POLLIN) &&
+			frootspi_dispatch(fs, 0, callback, arg) < 0) {
+			return -1;
+		}
+	}
+}
+
+void frootspi_stop(struct frootspi *fs)
+{
+	const uint64_t one = 1;
+	// eventfdへの8バイトの書き込みは失敗しない (カウンタが溢れる場合を除く)
+	if (write(fs->stop_fd, &one, sizeof(one)) < 0) {
+		perror("frootspi_stop");
+	}
+}
+
+int frootspi_pushsw(const struct frootspi *fs, unsigned int index)
+{
+	return index < FROOTSPI_MAX_SWITCHES ? fs->pushsw[index] : -1;
+}
+
+int frootspi_dipsw(const struct frootspi *fs, unsigned int index)
+{
+	return index < FROOTSPI_MAX_SWITCHES ? fs->dipsw[index] : -1;
+}
+
+int frootspi_set_led(
+	struct frootspi *fs, unsigned int index, int on, int wait)
+{
+	if (index >= MAX_LEDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (fs->led_fds[index] < 0) {
+		char path[32];
+		snprintf(path, sizeof(path), LED_PATH_FORMAT, index);
+		fs->led_fds[index] = open(path, O_WRONLY | O_CLOEXEC);
+		if (fs->led_fds[index] < 0) {
+			return -1;
+		}
+	}
+	if (write(fs->led_fds[index], on ? "1" : "0", 1) != 1) {
+		return -1;
+	}
+	// write()はキューに入れるだけなので、反映を待つならfsync()する
+	return wait ? fsync(fs->led_fds[index]) : 0;
+}
+
+int frootspi_lcd_write(struct frootspi *fs, const char *text)
+{
+	if (fs->lcd_fd < 0) {
+		fs->lcd_fd = open(LCD_PATH, O_WRONLY | O_CLOEXEC);
+		if (fs->lcd_fd < 0) {
+			return -1;
+		}
+	}
+	const size_t len = strlen(text);
+	return write(fs->lcd_fd, text, len) == (ssize_t)len ? 0 : -1;
+}
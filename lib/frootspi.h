@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// libfrootspi: FrootsPiのスイッチ、LED、LCDを使うためのライブラリ
+//
+// デバイスファイルを開いたままにし、スイッチは/dev/frootspi_input0のイベントを
+// まとめて読むので、サンプルごとにopen()/close()したり文字列を解析したりしない
+// スイッチの値は負論理から変換済みで、押されたら(ONなら)1になる
+
+#ifndef LIBFROOTSPI_H
+#define LIBFROOTSPI_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FROOTSPI_MAX_SWITCHES 16 // プッシュスイッチ、ディップスイッチそれぞれの番号の上限
+#define FROOTSPI_SDSW_INDEX 4	 // SDスイッチはプッシュスイッチの4番
+
+enum frootspi_event_type {
+	// イベントを取りこぼした (valueは取りこぼした数)
+	// この後に全スイッチの現在の値が続く
+	FROOTSPI_EVENT_DROPPED = 0,
+	FROOTSPI_EVENT_PUSHSW = 1,
+	FROOTSPI_EVENT_DIPSW = 2,
+};
+
+struct frootspi_event {
+	int64_t time_ns; // 値の変化を検出した時刻 (CLOCK_MONOTONIC)
+	enum frootspi_event_type type;
+	unsigned int index; // /dev/frootspi_pushsw<index>など
+	int value;	    // 押されたら(ONなら)1
+};
+
+struct frootspi;
+
+typedef void (*frootspi_callback)(
+	const struct frootspi_event *event, void *arg);
+
+// /dev/frootspi_input0を開く (LEDとLCDは最初に使うときに開く)
+// 失敗したらNULLを返してerrnoを設定する
+struct frootspi *frootspi_open(void);
+void frootspi_close(struct frootspi *fs);
+
+// 自前のイベントループ(poll, epoll, asyncioなど)に登録するためのfd
+// 読めるようになったらfrootspi_dispatch(fs, 0, ...)を呼ぶ
+int frootspi_fd(const struct frootspi *fs);
+
+// 届いているイベントを読み、スイッチの状態を更新してcallbackを呼ぶ
+// timeout_msだけイベントを待つ (0なら待たない、負なら届くまで待つ)
+// 処理したイベントの数を返す (エラーなら-1とerrno)
+int frootspi_dispatch(struct frootspi *fs, int timeout_ms,
+	frootspi_callback callback, void *arg);
+
+// frootspi_stop()が呼ばれるまでイベントを待ってcallbackを呼び続ける
+// 正常に止まったら0、エラーなら-1を返す
+int frootspi_run(struct frootspi *fs, frootspi_callback callback, void *arg);
+// callbackの中や別のスレッドから呼べる
+void frootspi_stop(struct frootspi *fs);
+
+// 最後に受け取ったイベントでのスイッチの値 (押されたら1、不明なら-1)
+// SPI通信はしない
+int frootspi_pushsw(const struct frootspi *fs, unsigned int index);
+int frootspi_dipsw(const struct frootspi *fs, unsigned int index);
+
+// LEDを点灯(1)・消灯(0)する
+// waitが0以外なら、SPIの書き込みが終わるまで待つ
+int frootspi_set_led(
+	struct frootspi *fs, unsigned int index, int on, int wait);
+
+// LCDに文字列を表示する (改行で2行目に移る)
+int frootspi_lcd_write(struct frootspi *fs, const char *text);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,122 @@
+#!/usr/bin/python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# libfrootspiのPythonバインディング (ctypes)
+#
+# 使い方:
+#   from frootspi import FrootsPi
+#   with FrootsPi() as fs:
+#       fs.run(lambda event: print(event))
+#
+# libfrootspi.soは同じディレクトリか、LIBFROOTSPI環境変数のパスから読み込む
+
+import ctypes
+import os
+
+EVENT_DROPPED = 0
+EVENT_PUSHSW = 1
+EVENT_DIPSW = 2
+SDSW_INDEX = 4
+
+
+class Event(ctypes.Structure):
+    _fields_ = [
+        ('time_ns', ctypes.c_int64),
+        ('type', ctypes.c_int),
+        ('index', ctypes.c_uint),
+        ('value', ctypes.c_int),
+    ]
+
+    def __repr__(self):
+        return 'Event(time_ns={}, type={}, index={}, value={})'.format(
+            self.time_ns, self.type, self.index, self.value)
+
+
+_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.POINTER(Event), ctypes.c_void_p)
+
+
+def _load_library():
+    path = os.environ.get('LIBFROOTSPI', os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), 'libfrootspi.so'))
+    lib = ctypes.CDLL(path, use_errno=True)
+
+    lib.frootspi_open.restype = ctypes.c_void_p
+    lib.frootspi_open.argtypes = []
+    lib.frootspi_close.argtypes = [ctypes.c_void_p]
+    lib.frootspi_fd.argtypes = [ctypes.c_void_p]
+    lib.frootspi_dispatch.argtypes = [
+        ctypes.c_void_p, ctypes.c_int, _CALLBACK, ctypes.c_void_p]
+    lib.frootspi_run.argtypes = [ctypes.c_void_p, _CALLBACK, ctypes.c_void_p]
+    lib.frootspi_stop.argtypes = [ctypes.c_void_p]
+    lib.frootspi_pushsw.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.frootspi_dipsw.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.frootspi_set_led.argtypes = [
+        ctypes.c_void_p, ctypes.c_uint, ctypes.c_int, ctypes.c_int]
+    lib.frootspi_lcd_write.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    return lib
+
+
+_lib = _load_library()
+
+
+def _check(retval):
+    if retval < 0:
+        errno = ctypes.get_errno()
+        raise OSError(errno, os.strerror(errno))
+    return retval
+
+
+class FrootsPi:
+    def __init__(self):
+        self._handle = _lib.frootspi_open()
+        if not self._handle:
+            errno = ctypes.get_errno()
+            raise OSError(errno, os.strerror(errno))
+
+    def close(self):
+        if self._handle:
+            _lib.frootspi_close(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    # selectやasyncioに登録するためのfd
+    def fileno(self):
+        return _lib.frootspi_fd(self._handle)
+
+    @staticmethod
+    def _wrap(callback):
+        if callback is None:
+            return _CALLBACK()
+        return _CALLBACK(lambda event, arg: callback(event.contents))
+
+    # 届いているイベントを処理する (timeout_msだけ待つ、負なら届くまで待つ)
+    def dispatch(self, timeout_ms=0, callback=None):
+        return _check(_lib.frootspi_dispatch(
+            self._handle, timeout_ms, self._wrap(callback), None))
+
+    # stop()が呼ばれるまでイベントごとにcallback(event)を呼ぶ
+    def run(self, callback):
+        _check(_lib.frootspi_run(self._handle, self._wrap(callback), None))
+
+    def stop(self):
+        _lib.frootspi_stop(self._handle)
+
+    # 押されていたら1、離されていたら0、まだ値が届いていなければ-1
+    def pushsw(self, index):
+        return _lib.frootspi_pushsw(self._handle, index)
+
+    # ONなら1、OFFなら0、まだ値が届いていなければ-1
+    def dipsw(self, index):
+        return _lib.frootspi_dipsw(self._handle, index)
+
+    def set_led(self, index, on, wait=False):
+        _check(_lib.frootspi_set_led(
+            self._handle, index, 1 if on else 0, 1 if wait else 0))
+
+    def lcd_write(self, text):
+        _check(_lib.frootspi_lcd_write(self._handle, text.encode('utf-8')))
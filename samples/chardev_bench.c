@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// /dev/frootspi_* の open/read/close にかかる時間を計測するマイクロベンチマーク
+//
+// ビルド: gcc -O2 -Wall -o chardev_bench chardev_bench.c
+// 使い方: ./chardev_bench [-n 回数] [-p] /dev/frootspi_pushsw0
+//   -p: open/closeせず、開きっぱなしのfdにpread()する（比較用）
+//
+// ドライバ更新前後で同じコマンドを実行して、結果を比較してください
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 10000
+#define READ_BUFLEN 64
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+// 1サンプル分の open -> read -> close
+static int sample_open_read_close(const char *path)
+{
+	char buf[READ_BUFLEN];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t len = read(fd, buf, sizeof(buf));
+	close(fd);
+	return len < 0 ? -1 : 0;
+}
+
+// 1サンプル分の pread (fdは開きっぱなし)
+static int sample_pread(int fd)
+{
+	char buf[READ_BUFLEN];
+	return pread(fd, buf, sizeof(buf), 0) < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = DEFAULT_ITERATIONS;
+	int use_pread = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'p':
+			use_pread = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-p] device\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc || iterations <= 0) {
+		fprintf(stderr, "usage: %s [-n iterations] [-p] device\n",
+			argv[0]);
+		return 1;
+	}
+	const char *path = argv[optind];
+
+	long long *samples = calloc(iterations, sizeof(long long));
+	if (samples == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	int fd = -1;
+	if (use_pread) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			perror(path);
+			return 1;
+		}
+	}
+
+	long long total_start = now_ns();
+	for (int i = 0; i < iterations; i++) {
+		long long start = now_ns();
+		int retval = use_pread ? sample_pread(fd)
+				       : sample_open_read_close(path);
+		samples[i] = now_ns() - start;
+		if (retval) {
+			perror(path);
+			return 1;
+		}
+	}
+	long long total_ns = now_ns() - total_start;
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	qsort(samples, iterations, sizeof(long long), compare_ll);
+	printf("device: %s\n", path);
+	printf("mode: %s\n", use_pread ? "pread" : "open/read/close");
+	printf("iterations: %d\n", iterations);
+	printf("min_ns: %lld\n", samples[0]);
+	printf("p50_ns: %lld\n", samples[iterations / 2]);
+	printf("p99_ns: %lld\n", samples[(long long)iterations * 99 / 100]);
+	printf("max_ns: %lld\n", samples[iterations - 1]);
+	printf("mean_ns: %lld\n", total_ns / iterations);
+
+	free(samples);
+	return 0;
+}
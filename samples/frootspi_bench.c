@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// /dev/frootspi_* の読み書きのレイテンシ(パーセンタイル)とスループットを計測するベンチマーク
+//
+// ビルド: gcc -O2 -Wall -o frootspi_bench frootspi_bench.c
+// 使い方: ./frootspi_bench [-n 回数] [-P プロセス数] [-t テスト名] [-o 出力ファイル]
+//   -n: 1プロセスあたりの回数 (デフォルト 10000、lcdは1/100)
+//   -P: 同じデバイスを同時に読み書きするプロセス数 (デフォルト 1)
+//       1と指定した数の両方を計測するので、競合したときの劣化が分かる
+//   -t: pushsw, dipsw, led, led_sync, lcd, hello のいずれか (複数回指定可、デフォルト 全て)
+//   -o: 結果(JSON Lines)の出力先 (デフォルト 標準出力)
+//
+// ソフトウェアのMCP23S08とAQM0802A(mock_mcp23s08=1 mock_aqm0802a=1)でも動くので、
+// 開発用PCでリリース前後の結果を比較してから、ロボットに入れてください
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 10000
+#define LCD_ITERATION_DIVISOR 100 // LCDは1回が数msかかるので回数を減らす
+#define READ_BUFLEN 64
+#define HELLO_MESSAGE_LEN 64
+
+struct bench_test {
+	const char *name;
+	const char *path;
+	int flags; // open()のフラグ
+	// 1回分の操作 (iは何回目か)
+	int (*run)(int fd, int i);
+	int iteration_divisor;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+// スイッチの値を読む (fdは開きっぱなしでpread()する)
+static int run_read(int fd, int i)
+{
+	char buf[READ_BUFLEN];
+	(void)i; // 他のテストと同じ関数の型にするための引数
+	return pread(fd, buf, sizeof(buf), 0) <= 0 ? -1 : 0;
+}
+
+// LEDを交互に点灯・消灯する (キューに入れるだけ)
+static int run_led(int fd, int i)
+{
+	return write(fd, i % 2 ? "0" : "1", 1) != 1 ? -1 : 0;
+}
+
+// LEDを交互に点灯・消灯し、SPIの書き込みが終わるまで待つ
+static int run_led_sync(int fd, int i)
+{
+	if (run_led(fd, i)) {
+		return -1;
+	}
+	return fsync(fd);
+}
+
+// ステータス画面を1枚書き込む
+static int run_lcd(int fd, int i)
+{
+	char frame[32];
+	int len = snprintf(frame, sizeof(frame), "ID:3 RUN\nBAT%02d.%dV",
+		10 + i % 6, i % 10);
+	return write(fd, frame, len) != len ? -1 : 0;
+}
+
+// helloに書き込んだメッセージを読み戻す (ハードウェアを使わない基準値)
+// 他のプロセスのメッセージを読んでも良い
+static int run_hello(int fd, int i)
+{
+	char buf[HELLO_MESSAGE_LEN];
+	memset(buf, 'a' + i % 26, sizeof(buf));
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+		return -1;
+	}
+	return read(fd, buf, sizeof(buf)) <= 0 ? -1 : 0;
+}
+
+static const struct bench_test tests[] = {
+	{"pushsw", "/dev/frootspi_pushsw0", O_RDONLY, run_read, 1},
+	{"dipsw", "/dev/frootspi_dipsw0", O_RDONLY, run_read, 1},
+	{"led", "/dev/frootspi_led0", O_WRONLY, run_led, 1},
+	{"led_sync", "/dev/frootspi_led0", O_WRONLY, run_led_sync, 1},
+	{"lcd", "/dev/frootspi_lcd0", O_WRONLY, run_lcd,
+		LCD_ITERATION_DIVISOR},
+	{"hello", "/dev/frootspi_hello0", O_RDWR, run_hello, 1},
+};
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+// 1プロセス分の計測
+// samplesに各回のレイテンシを書き、失敗した回数を返す (開けなければ-1)
+static int bench_worker(const struct bench_test *test, int iterations,
+	long long *samples)
+{
+	int errors = 0;
+	int fd = open(test->path, test->flags);
+	if (fd < 0) {
+		return -1;
+	}
+	for (int i = 0; i < iterations; i++) {
+		long long start = now_ns();
+		if (test->run(fd, i)) {
+			errors++;
+		}
+		samples[i] = now_ns() - start;
+	}
+	close(fd);
+	return errors;
+}
+
+static long long percentile(const long long *sorted, long n, int per_mille)
+{
+	return sorted[n * per_mille / 1000 < n ? n * per_mille / 1000 : n - 1];
+}
+
+// processes個のプロセスで同時に計測し、結果を1行のJSONで出力する
+static int bench_run(FILE *out, const struct bench_test *test,
+	int iterations, int processes)
+{
+	long n = (long)iterations * processes;
+	// 子プロセスが書いたサンプルを親が集めるため、共有メモリに置く
+	size_t size = sizeof(long long) * n + sizeof(int) * processes;
+	void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	long long *samples = shared;
+	int *errors = (int *)(samples + n);
+
+	long long started = now_ns();
+	for (int p = 0; p < processes; p++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			processes = p;
+			break;
+		}
+		if (pid == 0) {
+			long long *mine = samples + (long)p * iterations;
+			errors[p] = bench_worker(test, iterations, mine);
+			_exit(0);
+		}
+	}
+	while (wait(NULL) > 0 || errno == EINTR) {
+	}
+	long long elapsed_ns = now_ns() - started;
+
+	int total_errors = 0;
+	for (int p = 0; p < processes; p++) {
+		if (errors[p] < 0) {
+			fprintf(stderr, "%s: cannot open %s\n", test->name,
+				test->path);
+			munmap(shared, size);
+			return -1;
+		}
+		total_errors += errors[p];
+	}
+
+	if (processes == 0) {
+		munmap(shared, size);
+		return -1;
+	}
+	n = (long)iterations * processes;
+	qsort(samples, n, sizeof(long long), compare_ll);
+	long long sum = 0;
+	for (long i = 0; i < n; i++) {
+		sum += samples[i];
+	}
+
+	fprintf(out,
+		"{\"test\": \"%s\", \"device\": \"%s\", \"processes\": %d, "
+		"\"iterations\": %ld, \"errors\": %d, "
+		"\"ops_per_sec\": %.1f, \"mean_ns\": %lld, \"min_ns\": %lld, "
+		"\"p50_ns\": %lld, \"p90_ns\": %lld, \"p99_ns\": %lld, "
+		"\"p999_ns\": %lld, \"max_ns\": %lld}\n",
+		test->name, test->path, processes, n, total_errors,
+		n * 1e9 / elapsed_ns, sum / n, samples[0],
+		percentile(samples, n, 500), percentile(samples, n, 900),
+		percentile(samples, n, 990), percentile(samples, n, 999),
+		samples[n - 1]);
+	fflush(out);
+	munmap(shared, size);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-n iterations] [-P processes] [-t test]... "
+		"[-o output]\n"
+		"tests: pushsw dipsw led led_sync lcd hello\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = DEFAULT_ITERATIONS;
+	int processes = 1;
+	int selected[NUM_TESTS] = {0};
+	int num_selected = 0;
+	FILE *out = stdout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:P:t:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'P':
+			processes = atoi(optarg);
+			break;
+		case 't': {
+			size_t t;
+			for (t = 0; t < NUM_TESTS; t++) {
+				if (strcmp(optarg, tests[t].name) == 0) {
+					break;
+				}
+			}
+			if (t == NUM_TESTS) {
+				usage(argv[0]);
+				return 1;
+			}
+			selected[t] = 1;
+			num_selected++;
+			break;
+		}
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations <= 0 || processes <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int failed = 0;
+	for (size_t t = 0; t < NUM_TESTS; t++) {
+		if (num_selected > 0 && !selected[t]) {
+			continue;
+		}
+		int n = iterations / tests[t].iteration_divisor;
+		if (n == 0) {
+			n = 1;
+		}
+		// 1プロセスと、指定されたプロセス数で競合させた場合
+		if (bench_run(out, &tests[t], n, 1)) {
+			failed = 1;
+			continue;
+		}
+		if (processes > 1 && bench_run(out, &tests[t], n, processes)) {
+			failed = 1;
+		}
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	return failed;
+}
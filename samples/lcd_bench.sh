@@ -0,0 +1,85 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# /dev/frootspi_lcd0 への書き込み1回あたりのI2C転送数とバスの時間を計測する
+# ソフトウェアのAQM0802A(mock_aqm0802a=1)の統計を使うので、LCDがなくても動く
+#
+# 使い方: sudo ./lcd_bench.sh [回数]
+#   事前に sudo insmod frootspi.ko mock_aqm0802a=1 でドライバを読み込むこと
+#
+# ドライバ更新前後で実行して、結果を比較してください
+#
+# 終了コードはkselftestと同じ (0: 成功、1: 失敗、4: スキップ)
+
+set -eu
+
+ITERATIONS=${1:-100}
+LCD=/dev/frootspi_lcd0
+MOCK=/sys/kernel/debug/frootspi/mock_aqm0802a
+COUNTERS="transfers bytes commands data_bytes bus_ns exec_ns busy_violations"
+KSFT_SKIP=4
+
+if [ ! -d "$MOCK" ]; then
+	echo "$MOCK not found. Load the driver with mock_aqm0802a=1." >&2
+	exit $KSFT_SKIP
+fi
+
+# ステータス画面でよく使う書き込み
+WORKLOADS=(
+	"FrootsPi\nReady"
+	"ID:3 RUN\nBAT15.2V"
+	"ID:3 RUN\nBAT15.1V"
+	"OK"
+	"Kick!!!!\nBall:Yes"
+)
+
+read_counters() {
+	for name in $COUNTERS; do
+		cat "$MOCK/$name"
+	done
+}
+
+# 表示されるはずの2行 (各行の先頭8文字、足りない分は空白)
+expected_screen() {
+	printf '%b\n' "$1" | head -2 | while IFS= read -r line; do
+		printf '%-8.8s\n' "$line"
+	done
+	if [ "$(printf '%b\n' "$1" | wc -l)" -lt 2 ]; then
+		printf '%8s\n' ""
+	fi
+}
+
+failures=0
+
+echo "workload,writes,ok,us_per_write,$(echo $COUNTERS | tr ' ' ',')"
+for text in "${WORKLOADS[@]}"; do
+	before=($(read_counters))
+	started=$(date +%s%N)
+	for ((i = 0; i < ITERATIONS; i++)); do
+		printf '%b' "$text" > "$LCD"
+	done
+	finished=$(date +%s%N)
+	after=($(read_counters))
+
+	# 最後に書いた文字列が表示されているか確認する
+	if [ "$(cat "$MOCK/screen")" = "$(expected_screen "$text")" ]; then
+		ok=1
+	else
+		ok=0
+		failures=$((failures + 1))
+	fi
+
+	row="\"${text}\",${ITERATIONS},${ok}"
+	row="${row},$(( (finished - started) / 1000 / ITERATIONS ))"
+	for ((c = 0; c < ${#before[@]}; c++)); do
+		delta=$(( after[c] - before[c] ))
+		# 書き込み1回あたり (小数点以下2桁)
+		row="${row},$(awk "BEGIN { printf \"%.2f\", $delta / $ITERATIONS }")"
+	done
+	echo "$row"
+done
+
+if [ $failures -gt 0 ]; then
+	echo "$failures workload(s) failed." >&2
+	exit 1
+fi
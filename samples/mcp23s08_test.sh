@@ -0,0 +1,134 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# プッシュスイッチ、ディップスイッチ、LEDの操作1回あたりのSPI転送数を、
+# ソフトウェアのMCP23S08(mock_mcp23s08=1)の統計から求めて確認する
+# 値が正しいことと、転送数が上限を超えていないことを確かめるので、CIで回帰を検出できる
+#
+# 使い方: sudo ./mcp23s08_test.sh [回数]
+#   事前に sudo insmod frootspi.ko mock_mcp23s08=1 でドライバを読み込むこと
+#
+# 終了コードはkselftestと同じ (0: 成功、1: 失敗、4: スキップ)
+
+set -eu
+
+ITERATIONS=${1:-100}
+MOCK=/sys/kernel/debug/frootspi/mock_mcp23s08
+PARAMS=/sys/module/frootspi/parameters
+KSFT_SKIP=4
+
+# 操作1回あたりの転送数の上限
+# スイッチの読み出しは1回のSPI転送、LEDの書き込みは非同期に1回(まとめられれば減る)
+MAX_PUSHSW_TRANSFERS=1
+MAX_DIPSW_TRANSFERS=1
+MAX_LED_TRANSFERS=1
+
+# FrootsPi基板のデフォルトのピン割当 (アドレス0)
+PUSHSW0_GPIO=1
+DIPSW0_GPIO=6
+LED0_GPIO=0
+
+if [ ! -d "$MOCK" ]; then
+	echo "$MOCK not found. Load the driver with mock_mcp23s08=1." >&2
+	exit $KSFT_SKIP
+fi
+
+# バックグラウンドのサンプリングは転送数に混ざるので、止めた状態で測る
+for param in pushsw_gestures input_record; do
+	if [ "$(cat "$PARAMS/$param")" = "Y" ]; then
+		echo "Reload the driver with $param=0." >&2
+		exit $KSFT_SKIP
+	fi
+done
+if [ "$(cat "$PARAMS/dipsw_poll_ms")" != "0" ]; then
+	echo "Reload the driver with dipsw_poll_ms=0." >&2
+	exit $KSFT_SKIP
+fi
+
+failures=0
+
+# アドレス0の入力の論理レベルを変える (スイッチは負論理なので、0で押した状態)
+set_inputs() {
+	echo "0 $1" > "$MOCK/inputs"
+}
+
+olat() {
+	sed -n 's/^0 .*olat=\(0x[0-9a-f]*\).*/\1/p' "$MOCK/inputs"
+}
+
+# 名前、回数、転送数、上限、結果を1行出力し、失敗を数える
+report() {
+	local name=$1 ops=$2 transfers=$3 limit=$4 ok=$5
+	local per_op
+	per_op=$(awk "BEGIN { printf \"%.2f\", $transfers / $ops }")
+	if [ "$ok" = 1 ] &&
+		awk "BEGIN { exit !($transfers <= $limit * $ops) }"; then
+		result=ok
+	else
+		result=FAIL
+		failures=$((failures + 1))
+	fi
+	echo "${name},${ops},${per_op},${limit},${result}"
+}
+
+# デバイスファイルをITERATIONS回読み、全て期待した値ならok=1
+read_switch() {
+	local device=$1 expected=$2
+	ok=1
+	for ((i = 0; i < ITERATIONS; i++)); do
+		if [ "$(cat "$device")" != "$expected" ]; then
+			ok=0
+		fi
+	done
+}
+
+echo "test,ops,transfers_per_op,limit,result"
+
+# プッシュスイッチ0を押した状態と離した状態で読む
+for pressed in 1 0; do
+	if [ "$pressed" = 1 ]; then
+		set_inputs $((0xff & ~(1 << PUSHSW0_GPIO)))
+	else
+		set_inputs 0xff
+	fi
+	before=$(cat "$MOCK/transfers")
+	read_switch /dev/frootspi_pushsw0 $((1 - pressed))
+	after=$(cat "$MOCK/transfers")
+	report "pushsw_pressed_${pressed}" "$ITERATIONS" \
+		$((after - before)) $MAX_PUSHSW_TRANSFERS $ok
+done
+
+# ディップスイッチ0をONとOFFにして読む
+for on in 1 0; do
+	if [ "$on" = 1 ]; then
+		set_inputs $((0xff & ~(1 << DIPSW0_GPIO)))
+	else
+		set_inputs 0xff
+	fi
+	before=$(cat "$MOCK/transfers")
+	read_switch /dev/frootspi_dipsw0 $((1 - on))
+	after=$(cat "$MOCK/transfers")
+	report "dipsw_on_${on}" "$ITERATIONS" \
+		$((after - before)) $MAX_DIPSW_TRANSFERS $ok
+done
+
+# LED0を交互に点灯・消灯し、最後にfsync()して出力ラッチを確かめる
+before=$(cat "$MOCK/transfers")
+for ((i = 0; i < ITERATIONS; i++)); do
+	printf '%d' $((i % 2)) > /dev/frootspi_led0
+done
+last=$(((ITERATIONS - 1) % 2))
+printf '%d' $last | dd of=/dev/frootspi_led0 conv=fsync status=none
+after=$(cat "$MOCK/transfers")
+if [ $(($(olat) >> LED0_GPIO & 1)) = "$last" ]; then
+	ok=1
+else
+	ok=0
+fi
+report led "$((ITERATIONS + 1))" $((after - before)) $MAX_LED_TRANSFERS $ok
+
+set_inputs 0xff
+if [ $failures -gt 0 ]; then
+	echo "$failures test(s) failed." >&2
+	exit 1
+fi
@@ -1,86 +1,59 @@
 #!/usr/bin/python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# プッシュスイッチかDIPスイッチが変わったら、LEDを点灯・消灯する
+#
+# lib/frootspi.pyを使うので、先にlib/でlibfrootspi.soをビルドしておくこと
+# デバイスファイルは開いたままで、スイッチの変化は/dev/frootspi_input0の
+# イベントとしてまとめて届く
+
+import os
+import sys
+
+sys.path.insert(0, os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), '..', 'lib'))
+
+from frootspi import FrootsPi, EVENT_PUSHSW, EVENT_DIPSW, SDSW_INDEX
+
+NUM_DIPSW = 2
+LED_INDEX = 0
+# Ctrl-Cを受け付けるため、イベントを待つ時間を区切る
+DISPATCH_TIMEOUT_MS = 100
+
+
+class SwitchesAndLed:
+    def __init__(self, fs):
+        self._fs = fs
+        self._led_on = False
+        # まだ値が届いていないDIPスイッチは-1
+        self._dipsw = [fs.dipsw(i) for i in range(NUM_DIPSW)]
+
+    # LEDの点灯・消灯をトグルする
+    def toggle_led(self):
+        self._led_on = not self._led_on
+        self._fs.set_led(LED_INDEX, self._led_on)
+        print("LED ON" if self._led_on else "LED OFF")
+
+    def on_event(self, event):
+        # プッシュスイッチは押されたときだけ (SDスイッチは除く)
+        if event.type == EVENT_PUSHSW:
+            if event.index != SDSW_INDEX and event.value == 1:
+                self.toggle_led()
+        elif event.type == EVENT_DIPSW and event.index < NUM_DIPSW:
+            # 最初に届いた値は変化として扱わない
+            prev = self._dipsw[event.index]
+            self._dipsw[event.index] = event.value
+            if prev != -1 and prev != event.value:
+                self.toggle_led()
 
-import time
-
-PUSHSW_PATH_LIST = [
-    '/dev/frootspi_pushsw0',
-    '/dev/frootspi_pushsw1',
-    '/dev/frootspi_pushsw2',
-    '/dev/frootspi_pushsw3'
-]
-DIPSW_PATH_LIST = [
-    '/dev/frootspi_dipsw0',
-    '/dev/frootspi_dipsw1',
-]
-LED_PATH = '/dev/frootspi_led0'
-
-# 指定されたプッシュスイッチが押されたらTrue
-def pushsw_has_pressed(path):
-    retval = False
-    with open(path, 'r') as f:
-        # 負論理回路のため、押されると0を返す
-        if f.readline() == "0\n":
-            retval = True
-    return retval
-
-# プッシュスイッチのうち1つでも押されたらTrue
-def any_pushsw_has_pressed():
-    for path in PUSHSW_PATH_LIST:
-        if pushsw_has_pressed(path):
-            return True
-
-    return False
-
-# 指定されたDIPスイッチの状態を1/0で返す
-def get_dipsw_state(path):
-    retval = 0
-    with open(path, 'r') as f:
-        # 負論理回路のため、ONになると0を返す
-        if f.readline() == "0\n":
-            retval = 1
-    return retval
-
-# DIPスイッチの状態が変わったらTrue
-g_dipsw_state = 0
-def dipsw_state_has_changed():
-    global g_dipsw_state
-
-    current_dipsw_state = get_dipsw_state(DIPSW_PATH_LIST[0])
-    current_dipsw_state += 2 * get_dipsw_state(DIPSW_PATH_LIST[1])
-
-    if current_dipsw_state != g_dipsw_state:
-        g_dipsw_state = current_dipsw_state
-        return True
-
-    return False
-
-# LEDを点灯・消灯する
-def turn_on_led(turn_on = False):
-    with open(LED_PATH, 'w') as f:
-        if turn_on:
-            f.write('1')
-            print("LED ON")
-        else:
-            f.write('0')
-            print("LED OFF")
-
-# LEDの点灯・消灯をトグルする
-g_led_turn_on = False
-def toggle_led():
-    global g_led_turn_on
-    g_led_turn_on = not g_led_turn_on
-    turn_on_led(g_led_turn_on)
 
 ### main ###
 if __name__ == '__main__':
     print("プッシュスイッチかDIPSWを押してね ([Ctrl-C]で終了)")
-    dipsw_state_has_changed()  # DIPSW状態の初期化のため実行
-    while 1:
-        if any_pushsw_has_pressed():
-            toggle_led()
-            time.sleep(0.1)
-        
-        if dipsw_state_has_changed():
-            toggle_led()
-
-        time.sleep(0.1)
+    with FrootsPi() as fs:
+        sample = SwitchesAndLed(fs)
+        try:
+            while True:
+                fs.dispatch(DISPATCH_TIMEOUT_MS, sample.on_event)
+        except KeyboardInterrupt:
+            pass
@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/delay.h>	   // usleep_range()
+#include <linux/i2c.h>		   // i2c_*()
+#include <linux/ktime.h>	   // ktime_get()
+#include <linux/module.h>	   // module_param()
+#include <linux/mutex.h>	   // mutex_lock()
+#include <linux/platform_device.h> // platform_device_register_simple()
+
+#include "frootspi_debugfs.h"
+
+#define MOCK_DRIVER_NAME "frootspi_aqm0802a_mock"
+#define MOCK_I2C_ADDR 0x3e // AQM0802A(ST7032i)のスレーブアドレス
+
+// ST7032iのコントロールバイト
+#define ST7032_CONTROL_CO (1 << 7) // 1なら次のバイトもコントロールバイト
+#define ST7032_CONTROL_RS (1 << 6) // 1ならデータ、0ならコマンド
+
+// 命令の実行時間 (ST7032のデータシート、fOSC = 380kHz)
+#define ST7032_EXEC_NS_CLEAR 1080000 // Clear Display, Return Home
+#define ST7032_EXEC_NS_DEFAULT 26300
+
+#define ST7032_DDRAM_SIZE 0x80
+#define ST7032_LINE_LENGTH 0x28 // 2行表示のときの1行分のDDRAM
+#define AQM0802A_COLUMNS 8	// 表示される文字数
+
+// ソフトウェアで作ったI2Cアダプタの先にST7032i(AQM0802A)のモデルをつなぎ、
+// LCDがなくてもfrootspi_lcd.cを動かし、書き換え方の違いを比較できるようにする
+// insmod frootspi.ko mock_aqm0802a=1
+static bool mock_aqm0802a;
+module_param(mock_aqm0802a, bool, 0444);
+MODULE_PARM_DESC(mock_aqm0802a, "Emulate an AQM0802A behind a software I2C "
+				"adapter (default off)");
+
+// バスの時間を求めるためのクロック (Raspberry PiのI2Cのデフォルトは100kHz)
+static unsigned int mock_i2c_hz = 100000;
+module_param(mock_i2c_hz, uint, 0644);
+MODULE_PARM_DESC(mock_i2c_hz, "Bus clock used to model I2C transfer time "
+			      "(default 100000)");
+
+// 0ならバスの時間を計算するだけで待たない
+static bool mock_i2c_realtime = true;
+module_param(mock_i2c_realtime, bool, 0644);
+MODULE_PARM_DESC(mock_i2c_realtime, "Sleep for the modeled bus time of "
+				    "every transfer (default on)");
+
+struct mock_lcd_stats {
+	atomic64_t transfers; // master_xfer()の回数
+	atomic64_t messages;
+	atomic64_t bytes; // アドレスを除いたバイト数
+	atomic64_t commands;
+	atomic64_t data_bytes;
+	atomic64_t clears;
+	atomic64_t bus_ns;  // クロックから求めたバスの占有時間の合計
+	atomic64_t exec_ns; // 命令の実行時間の合計
+	// 前の命令の実行が終わる前に次の命令が届いた回数
+	// 待ち時間を削る最適化をしたら、これが0のままであることを確認する
+	atomic64_t busy_violations;
+};
+
+// ST7032iの内部状態 (mock_lcd.lockで保護)
+struct st7032_state {
+	unsigned char ddram[ST7032_DDRAM_SIZE];
+	unsigned char address; // アドレスカウンタ
+	bool cgram;	       // 最後に設定したアドレスがCGRAM
+	bool increment;	       // エントリーモードのI/D
+	bool two_lines;	       // ファンクションセットのN
+	bool instruction_table; // ファンクションセットのIS
+	bool display_on;
+	ktime_t ready_at; // 実行中の命令が終わる時刻
+};
+
+static struct mock_lcd {
+	struct platform_device *pdev;
+	struct i2c_adapter adapter;
+	struct i2c_client *client;
+	struct mutex lock;
+	struct st7032_state st7032;
+	struct mock_lcd_stats stats;
+	struct dentry *debugfs_dir;
+} mock_lcd;
+
+// ---------- ST7032iのモデル (mock_lcd.lockを取ってから呼ぶ) ----------
+
+static void st7032_reset_locked(struct st7032_state *st)
+{
+	memset(st->ddram, ' ', sizeof(st->ddram));
+	st->address = 0;
+	st->cgram = false;
+	st->increment = true;
+	st->two_lines = false;
+	st->instruction_table = false;
+	st->display_on = false;
+	st->ready_at = 0;
+}
+
+// アドレスカウンタを1つ進める (2行表示では0x27の次が0x40になる)
+static void st7032_advance_locked(struct st7032_state *st)
+{
+	if (!st->two_lines) {
+		st->address = (st->address + (st->increment ? 1 : -1)) &
+			      (ST7032_DDRAM_SIZE - 1);
+		return;
+	}
+
+	const unsigned char line = st->address & 0x40;
+	int column = (st->address & 0x3f) + (st->increment ? 1 : -1);
+	if (column >= ST7032_LINE_LENGTH) {
+		st->address = line ^ 0x40;
+	} else if (column < 0) {
+		st->address = (line ^ 0x40) + ST7032_LINE_LENGTH - 1;
+	} else {
+		st->address = line + column;
+	}
+}
+
+// 命令を実行し、実行時間(ns)を返す
+static unsigned int st7032_command_locked(
+	struct st7032_state *st, const unsigned char cmd)
+{
+	atomic64_inc(&mock_lcd.stats.commands);
+
+	if (cmd & 0x80) {
+		// Set DDRAM address
+		st->address = cmd & 0x7f;
+		st->cgram = false;
+	} else if (cmd & 0x40) {
+		// IS=0ならSet CGRAM address
+		// IS=1ならアイコン、電源、フォロワ、コントラストの設定(表示には影響しない)
+		if (!st->instruction_table) {
+			st->address = cmd & 0x3f;
+			st->cgram = true;
+		}
+	} else if (cmd & 0x20) {
+		// Function set
+		st->two_lines = cmd & (1 << 3);
+		st->instruction_table = cmd & (1 << 0);
+	} else if (cmd & 0x10) {
+		// IS=0ならカーソルの移動(S/C=0のときだけ扱う)、IS=1なら内部発振周波数
+		if (!st->instruction_table && !(cmd & (1 << 3))) {
+			const bool saved = st->increment;
+			st->increment = cmd & (1 << 2);
+			st7032_advance_locked(st);
+			st->increment = saved;
+		}
+	} else if (cmd & 0x08) {
+		// Display ON/OFF
+		st->display_on = cmd & (1 << 2);
+	} else if (cmd & 0x04) {
+		// Entry mode set
+		st->increment = cmd & (1 << 1);
+	} else if (cmd & 0x02) {
+		// Return home
+		st->address = 0;
+		st->cgram = false;
+		return ST7032_EXEC_NS_CLEAR;
+	} else if (cmd & 0x01) {
+		// Clear display
+		memset(st->ddram, ' ', sizeof(st->ddram));
+		st->address = 0;
+		st->cgram = false;
+		st->increment = true;
+		atomic64_inc(&mock_lcd.stats.clears);
+		return ST7032_EXEC_NS_CLEAR;
+	}
+	return ST7032_EXEC_NS_DEFAULT;
+}
+
+static unsigned int st7032_data_locked(
+	struct st7032_state *st, const unsigned char data)
+{
+	atomic64_inc(&mock_lcd.stats.data_bytes);
+	// CGRAM(外字)の内容は表示の確認に使わないので捨てる
+	if (!st->cgram) {
+		st->ddram[st->address & (ST7032_DDRAM_SIZE - 1)] = data;
+	}
+	st7032_advance_locked(st);
+	return ST7032_EXEC_NS_DEFAULT;
+}
+
+// 1バイトの命令かデータを処理する
+static void st7032_write_locked(
+	struct st7032_state *st, const bool rs, const unsigned char byte)
+{
+	const ktime_t now = ktime_get();
+
+	if (ktime_before(now, st->ready_at)) {
+		atomic64_inc(&mock_lcd.stats.busy_violations);
+	}
+	const unsigned int exec_ns = rs ? st7032_data_locked(st, byte)
+					: st7032_command_locked(st, byte);
+	atomic64_add(exec_ns, &mock_lcd.stats.exec_ns);
+	st->ready_at = ktime_add_ns(now, exec_ns);
+}
+
+// 1つのメッセージを解釈する
+// コントロールバイトのCoが0になったら、残りは全てRSで指定された種類のバイト
+static void st7032_message_locked(
+	struct st7032_state *st, const u8 *buf, const u16 len)
+{
+	bool rs = false;
+	bool control = true;
+
+	for (int i = 0; i < len; i++) {
+		if (control) {
+			if (i + 1 >= len) {
+				// 後に続くバイトのないコントロールバイトは無視する
+				break;
+			}
+			control = buf[i] & ST7032_CONTROL_CO;
+			rs = buf[i] & ST7032_CONTROL_RS;
+			i++;
+		}
+		st7032_write_locked(st, rs, buf[i]);
+	}
+}
+
+// ---------- I2Cアダプタ ----------
+
+// STARTとSTOP、アドレスとデータの各バイト(ACKを含めて9ビット)の時間
+static u64 mock_bus_ns(const u16 len)
+{
+	const u64 bits = 2 + 9 * (1 + (u64)len);
+	return div_u64(bits * NSEC_PER_SEC, mock_i2c_hz ? mock_i2c_hz : 100000);
+}
+
+static int mock_master_xfer(
+	struct i2c_adapter *adapter, struct i2c_msg *msgs, int num)
+{
+	u64 bus_ns = 0;
+	int retval = num;
+
+	atomic64_inc(&mock_lcd.stats.transfers);
+	mutex_lock(&mock_lcd.lock);
+	for (int i = 0; i < num; i++) {
+		if (msgs[i].addr != MOCK_I2C_ADDR) {
+			// 誰もACKを返さない
+			retval = -ENXIO;
+			break;
+		}
+		if (msgs[i].flags & I2C_M_RD) {
+			// ST7032iは書き込み専用
+			retval = -EOPNOTSUPP;
+			break;
+		}
+		atomic64_inc(&mock_lcd.stats.messages);
+		atomic64_add(msgs[i].len, &mock_lcd.stats.bytes);
+		bus_ns += mock_bus_ns(msgs[i].len);
+		st7032_message_locked(
+			&mock_lcd.st7032, msgs[i].buf, msgs[i].len);
+	}
+	mutex_unlock(&mock_lcd.lock);
+
+	atomic64_add(bus_ns, &mock_lcd.stats.bus_ns);
+	if (mock_i2c_realtime && bus_ns >= 10 * NSEC_PER_USEC) {
+		const unsigned long us = div_u64(bus_ns, NSEC_PER_USEC);
+		usleep_range(us, us + us / 8 + 1);
+	}
+	return retval;
+}
+
+static u32 mock_functionality(struct i2c_adapter *adapter)
+{
+	// SMBusの関数はI2Cのメッセージに変換される
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm mock_algorithm = {
+	.master_xfer = mock_master_xfer,
+	.functionality = mock_functionality,
+};
+
+// ---------- debugfs (/sys/kernel/debug/frootspi/mock_aqm0802a/) ----------
+
+// ST7032の文字コードをUTF-8で出力する (半角カタカナは0xa1 ~ 0xdf)
+static void mock_put_char(struct seq_file *s, const unsigned char c)
+{
+	if (c >= 0xa1 && c <= 0xbf) {
+		seq_printf(s, "\xef\xbd%c", c);
+	} else if (c >= 0xc0 && c <= 0xdf) {
+		seq_printf(s, "\xef\xbe%c", c - 0x40);
+	} else if (c >= 0x20 && c < 0x7f) {
+		seq_putc(s, c);
+	} else {
+		seq_putc(s, ' ');
+	}
+}
+
+// 表示されている2行を出力する
+// /dev/frootspi_lcd0に書いた文字列と比べて、表示が正しいことを確認できる
+static int mock_screen_show(struct seq_file *s, void *unused)
+{
+	mutex_lock(&mock_lcd.lock);
+	for (int line = 0; line < 2; line++) {
+		for (int column = 0; column < AQM0802A_COLUMNS; column++) {
+			mock_put_char(
+				s, mock_lcd.st7032.ddram[line * 0x40 + column]);
+		}
+		seq_putc(s, '\n');
+	}
+	mutex_unlock(&mock_lcd.lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mock_screen);
+
+static void mock_create_debugfs(void)
+{
+	struct dentry *dir =
+		debugfs_create_dir("mock_aqm0802a", frootspi_debugfs_root);
+
+	mock_lcd.debugfs_dir = dir;
+	debugfs_create_file("screen", 0444, dir, NULL, &mock_screen_fops);
+	frootspi_debugfs_create_counter(
+		"transfers", dir, &mock_lcd.stats.transfers);
+	frootspi_debugfs_create_counter(
+		"messages", dir, &mock_lcd.stats.messages);
+	frootspi_debugfs_create_counter("bytes", dir, &mock_lcd.stats.bytes);
+	frootspi_debugfs_create_counter(
+		"commands", dir, &mock_lcd.stats.commands);
+	frootspi_debugfs_create_counter(
+		"data_bytes", dir, &mock_lcd.stats.data_bytes);
+	frootspi_debugfs_create_counter("clears", dir, &mock_lcd.stats.clears);
+	frootspi_debugfs_create_counter("bus_ns", dir, &mock_lcd.stats.bus_ns);
+	frootspi_debugfs_create_counter(
+		"exec_ns", dir, &mock_lcd.stats.exec_ns);
+	frootspi_debugfs_create_counter(
+		"busy_violations", dir, &mock_lcd.stats.busy_violations);
+}
+
+// ---------- 登録と削除 ----------
+
+int register_aqm0802a_mock(void)
+{
+	int retval;
+
+	if (!mock_aqm0802a) {
+		return 0;
+	}
+
+	mutex_init(&mock_lcd.lock);
+	st7032_reset_locked(&mock_lcd.st7032);
+	// probe()が走る前にscreenを読めるよう、先にdebugfsを作る
+	mock_create_debugfs();
+
+	// I2Cアダプタの親になるデバイス
+	mock_lcd.pdev = platform_device_register_simple(
+		MOCK_DRIVER_NAME, -1, NULL, 0);
+	if (IS_ERR(mock_lcd.pdev)) {
+		retval = PTR_ERR(mock_lcd.pdev);
+		printk(KERN_ERR "%s %s: platform_device_register_simple() "
+				"failed.\n",
+			MOCK_DRIVER_NAME, __func__);
+		goto failed_register_pdev;
+	}
+
+	mock_lcd.adapter.owner = THIS_MODULE;
+	mock_lcd.adapter.algo = &mock_algorithm;
+	mock_lcd.adapter.dev.parent = &mock_lcd.pdev->dev;
+	strscpy(mock_lcd.adapter.name, MOCK_DRIVER_NAME,
+		sizeof(mock_lcd.adapter.name));
+	retval = i2c_add_adapter(&mock_lcd.adapter);
+	if (retval) {
+		printk(KERN_ERR "%s %s: i2c_add_adapter() failed.\n",
+			MOCK_DRIVER_NAME, __func__);
+		goto failed_add_adapter;
+	}
+
+	// デバイスツリーの代わりにAQM0802Aを登録する
+	// ドライバが登録済みなら、probe()もこの中で呼ばれる
+	struct i2c_board_info info = {
+		I2C_BOARD_INFO("aqm0802a", MOCK_I2C_ADDR),
+	};
+	mock_lcd.client = i2c_new_device(&mock_lcd.adapter, &info);
+	if (mock_lcd.client == NULL) {
+		printk(KERN_ERR "%s %s: i2c_new_device() failed.\n",
+			MOCK_DRIVER_NAME, __func__);
+		retval = -ENODEV;
+		goto failed_new_device;
+	}
+
+	printk(KERN_INFO "%s: emulating AQM0802A on i2c-%d.\n",
+		MOCK_DRIVER_NAME, mock_lcd.adapter.nr);
+	return 0;
+
+failed_new_device:
+	i2c_del_adapter(&mock_lcd.adapter);
+failed_add_adapter:
+	platform_device_unregister(mock_lcd.pdev);
+failed_register_pdev:
+	debugfs_remove_recursive(mock_lcd.debugfs_dir);
+	return retval;
+}
+
+void unregister_aqm0802a_mock(void)
+{
+	if (!mock_aqm0802a) {
+		return;
+	}
+	// 子のI2Cデバイスも削除され、ドライバのremove()が呼ばれる
+	i2c_del_adapter(&mock_lcd.adapter);
+	platform_device_unregister(mock_lcd.pdev);
+	debugfs_remove_recursive(mock_lcd.debugfs_dir);
+	printk(KERN_INFO "%s: removed.\n", MOCK_DRIVER_NAME);
+}
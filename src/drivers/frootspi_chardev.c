@@ -0,0 +1,438 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/cdev.h>	  // cdev_*()
+#include <linux/fs.h>	  // struct file, open, release
+#include <linux/module.h> // THIS_MODULE
+#include <linux/mutex.h>  // mutex_*()
+
+#include "frootspi_chardev.h"
+#include "mcp23s08_driver.h"
+
+// 各デバイスのfile_operationsは、それぞれのファイルで定義する
+extern struct file_operations hello_fops;
+extern struct file_operations pushsw_fops;
+extern struct file_operations dipsw_fops;
+extern struct file_operations led_fops;
+extern struct file_operations lcd_fops;
+extern struct file_operations input_fops;
+// sysfsの属性は、それぞれのファイルで定義する
+extern const struct attribute_group pushsw_value_group;
+extern const struct attribute_group dipsw_value_group;
+extern const struct attribute_group led_value_group;
+extern const struct attribute_group gesture_group;
+
+// プッシュスイッチ(SDスイッチを含む)の属性
+static const struct attribute_group *pushsw_groups[] = {
+	&pushsw_value_group,
+	&gesture_group,
+	NULL,
+};
+static const struct attribute_group *dipsw_groups[] = {
+	&dipsw_value_group,
+	NULL,
+};
+static const struct attribute_group *led_groups[] = {
+	&led_value_group,
+	NULL,
+};
+
+#define FROOTSPI_CHARDEV(_name, _index, _family, _fops, _groups, _pin)        \
+	{                                                                      \
+		.name = _name, .index = _index, .family = _family,             \
+		.fops = &_fops, .groups = _groups, .default_pin = _pin,        \
+	}
+#define HELLO(i) FROOTSPI_CHARDEV("frootspi_hello", i, FROOTSPI_HELLO, \
+	hello_fops, NULL, FROOTSPI_PIN_NONE)
+#define PUSHSW(i, pin) FROOTSPI_CHARDEV("frootspi_pushsw", i, \
+	FROOTSPI_PUSHSW, pushsw_fops, pushsw_groups, pin)
+#define DIPSW(i, pin) FROOTSPI_CHARDEV("frootspi_dipsw", i, FROOTSPI_DIPSW, \
+	dipsw_fops, dipsw_groups, pin)
+#define LED(i, pin) FROOTSPI_CHARDEV("frootspi_led", i, FROOTSPI_LED, \
+	led_fops, led_groups, pin)
+
+// 全デバイスファイルのテーブル
+// テーブルの順番がマイナー番号になる
+// ピン番号はデバイスツリーで指定されなかったときのデフォルトの割当
+// FROOTSPI_PIN_NONEのデバイスは、デバイスツリーで増やしたピン用
+static struct frootspi_chardev frootspi_chardevs[] = {
+	HELLO(0),
+	HELLO(1),
+	HELLO(2),
+	PUSHSW(0, MCP23S08_PIN(0, MCP23S08_GPIO_PUSHSW0)),
+	PUSHSW(1, MCP23S08_PIN(0, MCP23S08_GPIO_PUSHSW1)),
+	PUSHSW(2, MCP23S08_PIN(0, MCP23S08_GPIO_PUSHSW2)),
+	PUSHSW(3, MCP23S08_PIN(0, MCP23S08_GPIO_PUSHSW3)),
+	// SDスイッチはエキスパンダとは独立して登録される
+	FROOTSPI_CHARDEV("frootspi_pushsw", FROOTSPI_SDSW_INDEX, FROOTSPI_SDSW,
+		pushsw_fops, pushsw_groups, FROOTSPI_GPIO_PIN_SDSW),
+	PUSHSW(5, FROOTSPI_PIN_NONE),
+	PUSHSW(6, FROOTSPI_PIN_NONE),
+	PUSHSW(7, FROOTSPI_PIN_NONE),
+	PUSHSW(8, FROOTSPI_PIN_NONE),
+	DIPSW(0, MCP23S08_PIN(0, MCP23S08_GPIO_DIPSW0)),
+	DIPSW(1, MCP23S08_PIN(0, MCP23S08_GPIO_DIPSW1)),
+	DIPSW(2, FROOTSPI_PIN_NONE),
+	DIPSW(3, FROOTSPI_PIN_NONE),
+	DIPSW(4, FROOTSPI_PIN_NONE),
+	DIPSW(5, FROOTSPI_PIN_NONE),
+	DIPSW(6, FROOTSPI_PIN_NONE),
+	DIPSW(7, FROOTSPI_PIN_NONE),
+	LED(0, MCP23S08_PIN(0, MCP23S08_GPIO_LED)),
+	LED(1, FROOTSPI_PIN_NONE),
+	LED(2, FROOTSPI_PIN_NONE),
+	LED(3, FROOTSPI_PIN_NONE),
+	LED(4, FROOTSPI_PIN_NONE),
+	LED(5, FROOTSPI_PIN_NONE),
+	LED(6, FROOTSPI_PIN_NONE),
+	LED(7, FROOTSPI_PIN_NONE),
+	FROOTSPI_CHARDEV("frootspi_lcd", 0, FROOTSPI_LCD, lcd_fops, NULL,
+		FROOTSPI_PIN_NONE),
+	FROOTSPI_CHARDEV("frootspi_input", 0, FROOTSPI_INPUT, input_fops, NULL,
+		FROOTSPI_PIN_NONE),
+};
+
+#define FROOTSPI_NUM_MINORS ARRAY_SIZE(frootspi_chardevs)
+
+static struct class *frootspi_class;
+static dev_t frootspi_devt;
+// バックエンドは並行に初期化されるので、登録と削除を排他制御する
+static DEFINE_MUTEX(frootspi_chardev_lock);
+
+int frootspi_chardev_open(struct inode *inode, struct file *filep)
+{
+	struct frootspi_chardev *chardev;
+	const unsigned int minor = MINOR(inode->i_rdev);
+
+	// cdevは登録ごとに確保するので、マイナー番号からテーブルを引く
+	// テーブルは静的なので、取り除かれた後も開いたファイルから参照できる
+	if (minor >= FROOTSPI_NUM_MINORS) {
+		return -ENODEV;
+	}
+	chardev = &frootspi_chardevs[minor];
+	// 取り除かれた後も、inodeに残ったcdevから開かれることがある
+	if (!READ_ONCE(chardev->attached)) {
+		return -ENODEV;
+	}
+
+	// ピンの割当は登録時に済ませている
+	filep->private_data = chardev;
+	atomic_inc(&chardev->stats.open_handles);
+
+	// pr_debugはdynamic debugで有効化しない限りコストがかからない
+	pr_debug("%s %s: %s%u device opened.\n", FROOTSPI_CLASS_NAME,
+		__func__, chardev->name, chardev->index);
+	return 0;
+}
+
+int frootspi_chardev_release(struct inode *inode, struct file *filep)
+{
+	struct frootspi_chardev *chardev = filep->private_data;
+	atomic_dec(&chardev->stats.open_handles);
+
+	pr_debug("%s %s: %s%u device closed.\n", FROOTSPI_CLASS_NAME,
+		__func__, chardev->name, chardev->index);
+	return 0;
+}
+
+int frootspi_chardev_get_backend(
+	struct frootspi_chardev *chardev, const bool nowait)
+{
+	if (nowait) {
+		if (!down_read_trylock(&chardev->backend_lock)) {
+			return -EAGAIN;
+		}
+	} else {
+		down_read(&chardev->backend_lock);
+	}
+	if (!chardev->attached) {
+		up_read(&chardev->backend_lock);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+void frootspi_chardev_put_backend(struct frootspi_chardev *chardev)
+{
+	up_read(&chardev->backend_lock);
+}
+
+// 眠らずに処理すべきか
+// O_NONBLOCKで開かれたか、io_uringやpreadv2(RWF_NOWAIT)がIOCB_NOWAITを指定した場合
+// io_uringは-EAGAINが返るとワーカースレッドでブロッキングで処理し直す
+bool frootspi_chardev_nowait(const struct kiocb *iocb)
+{
+	return (iocb->ki_flags & IOCB_NOWAIT) ||
+	       (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+// スイッチの値を"<value>\n"として、ファイルの位置(ki_pos)から読める分だけコピーする
+// 読み切ったら0(EOF)を返すので、続けて読むときはpread(fd, buf, n, 0)を使う
+ssize_t frootspi_chardev_read_value(
+	struct kiocb *iocb, struct iov_iter *to, const int value)
+{
+	char buffer[16];
+	const int len = scnprintf(buffer, sizeof(buffer), "%d\n", value);
+
+	if (iocb->ki_pos >= len || iov_iter_count(to) == 0) {
+		return 0;
+	}
+	const size_t copied =
+		copy_to_iter(buffer + iocb->ki_pos, len - iocb->ki_pos, to);
+	if (copied == 0) {
+		return -EFAULT;
+	}
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+// 全デバイスファイルのマイナー番号とクラスをまとめて確保する
+// 個々のデバイスファイルは、バックエンドの準備ができたときに作る
+int frootspi_chardev_init(void)
+{
+	int retval;
+
+	// 動的にメジャー番号を確保する
+	retval = alloc_chrdev_region(
+		&frootspi_devt, 0, FROOTSPI_NUM_MINORS, FROOTSPI_CLASS_NAME);
+	if (retval < 0) {
+		// 確保できなかったらエラーを返して終了
+		printk(KERN_ERR "%s %s: unable to allocate device number\n",
+			FROOTSPI_CLASS_NAME, __func__);
+		return retval;
+	}
+
+	// デバイスのクラスを登録する(/sys/class/frootspi/ を作成)
+	frootspi_class = class_create(THIS_MODULE, FROOTSPI_CLASS_NAME);
+	if (IS_ERR(frootspi_class)) {
+		retval = PTR_ERR(frootspi_class);
+		printk(KERN_ERR "%s %s: class creation failed\n",
+			FROOTSPI_CLASS_NAME, __func__);
+		goto failed_class_create;
+	}
+
+	for (int i = 0; i < FROOTSPI_NUM_MINORS; i++) {
+		frootspi_chardevs[i].devt = MKDEV(MAJOR(frootspi_devt), i);
+		init_rwsem(&frootspi_chardevs[i].backend_lock);
+	}
+
+	return 0;
+
+failed_class_create:
+	unregister_chrdev_region(frootspi_devt, FROOTSPI_NUM_MINORS);
+	return retval;
+}
+
+void frootspi_chardev_exit(void)
+{
+	// バックエンドは先に全て取り除かれている
+	class_destroy(frootspi_class);
+	unregister_chrdev_region(frootspi_devt, FROOTSPI_NUM_MINORS);
+}
+
+static void frootspi_chardev_remove(struct frootspi_chardev *chardev)
+{
+	debugfs_remove_recursive(chardev->debugfs_dir);
+	chardev->debugfs_dir = NULL;
+	// 開いているファイルがバックエンドを使い終わるのを待ってから、
+	// デバイスとcdevを取り除く。attachedの間はdeviceを参照して良い
+	// sysfsの属性はbackend_lockを取らないので、device_destroy()が
+	// 実行中の属性を待っても止まらない
+	// この後はバックエンド(drvdata)を解放しても良い
+	down_write(&chardev->backend_lock);
+	chardev->attached = false;
+	device_destroy(frootspi_class, chardev->devt);
+	chardev->device = NULL;
+	cdev_del(chardev->cdev);
+	chardev->cdev = NULL;
+	chardev->backend = NULL;
+	up_write(&chardev->backend_lock);
+}
+
+// familyのデバイスファイルをテーブルの順番に作り、backendを紐付ける
+// pinsがNULLならfamilyの全てのデバイスファイルをデフォルトのピンで作る
+// pinsがあれば先頭からnum_pins個のデバイスファイルを作る
+int frootspi_chardev_attach(enum frootspi_family family, void *backend,
+	const unsigned char *pins, const int num_pins)
+{
+	int retval = 0;
+	int num_attached = 0;
+
+	mutex_lock(&frootspi_chardev_lock);
+	for (int i = 0; i < FROOTSPI_NUM_MINORS; i++) {
+		struct frootspi_chardev *chardev = &frootspi_chardevs[i];
+		if (chardev->family != family) {
+			continue;
+		}
+		if (chardev->attached) {
+			printk(KERN_ERR "%s %s: %s%u is already attached\n",
+				FROOTSPI_CLASS_NAME, __func__, chardev->name,
+				chardev->index);
+			retval = -EBUSY;
+			goto failed_attach;
+		}
+		if (pins) {
+			if (num_attached >= num_pins) {
+				break;
+			}
+			chardev->pin = pins[num_attached];
+		} else {
+			chardev->pin = chardev->default_pin;
+		}
+
+		// file_operationを登録するので、ここでドライバの機能が決まる
+		// 前のcdevは開いたままのinodeが参照しているかもしれないので、
+		// 登録ごとに新しく確保する
+		chardev->cdev = cdev_alloc();
+		if (chardev->cdev == NULL) {
+			printk(KERN_ERR "%s %s: cdev_alloc() failed\n",
+				FROOTSPI_CLASS_NAME, __func__);
+			retval = -ENOMEM;
+			goto failed_attach;
+		}
+		chardev->cdev->ops = chardev->fops;
+		chardev->cdev->owner = THIS_MODULE;
+		// sysfsの属性はデバイスを作った時点でバックエンドを使うので先に紐付け、
+		// attachedはデバイスファイルが使えるようになってから立てる
+		// attachedであれば、deviceは有効なポインタになっている
+		down_write(&chardev->backend_lock);
+		chardev->backend = backend;
+		retval = cdev_add(chardev->cdev, chardev->devt, 1);
+		if (retval < 0) {
+			printk(KERN_ERR "%s %s: %s%u: chardev registration "
+					"failed\n",
+				FROOTSPI_CLASS_NAME, __func__, chardev->name,
+				chardev->index);
+			chardev->backend = NULL;
+			up_write(&chardev->backend_lock);
+			kobject_put(&chardev->cdev->kobj);
+			chardev->cdev = NULL;
+			goto failed_attach;
+		}
+		// sysfsの属性からテーブルの要素を引けるよう、drvdataにする
+		chardev->device = device_create_with_groups(frootspi_class,
+			NULL, chardev->devt, chardev, chardev->groups, "%s%u",
+			chardev->name, chardev->index);
+		if (IS_ERR(chardev->device)) {
+			retval = PTR_ERR(chardev->device);
+			printk(KERN_ERR "%s %s: %s%u: device_create() failed "
+					"(%d)\n",
+				FROOTSPI_CLASS_NAME, __func__, chardev->name,
+				chardev->index, retval);
+			chardev->device = NULL;
+			cdev_del(chardev->cdev);
+			chardev->cdev = NULL;
+			chardev->backend = NULL;
+			up_write(&chardev->backend_lock);
+			goto failed_attach;
+		}
+		chardev->attached = true;
+		up_write(&chardev->backend_lock);
+		chardev->debugfs_dir = frootspi_debugfs_create_chardev_stats(
+			chardev->name, chardev->index, &chardev->stats);
+		num_attached++;
+	}
+	if (pins && num_attached < num_pins) {
+		printk(KERN_ERR "%s %s: too many pins (%d) for family %d\n",
+			FROOTSPI_CLASS_NAME, __func__, num_pins, family);
+		retval = -EINVAL;
+		goto failed_attach;
+	}
+	mutex_unlock(&frootspi_chardev_lock);
+	return 0;
+
+failed_attach:
+	// このfamilyで作ったデバイスファイルだけを取り除く
+	for (int i = 0; i < FROOTSPI_NUM_MINORS; i++) {
+		struct frootspi_chardev *chardev = &frootspi_chardevs[i];
+		if (chardev->family == family && chardev->attached &&
+			chardev->backend == backend) {
+			frootspi_chardev_remove(chardev);
+		}
+	}
+	mutex_unlock(&frootspi_chardev_lock);
+	return retval;
+}
+
+void frootspi_chardev_detach(enum frootspi_family family)
+{
+	mutex_lock(&frootspi_chardev_lock);
+	for (int i = 0; i < FROOTSPI_NUM_MINORS; i++) {
+		struct frootspi_chardev *chardev = &frootspi_chardevs[i];
+		if (chardev->family == family && chardev->attached) {
+			frootspi_chardev_remove(chardev);
+		}
+	}
+	mutex_unlock(&frootspi_chardev_lock);
+}
+
+// テーブルのデフォルトのピン割当をpinsにコピーし、ピンの数を返す
+// デバイスツリーでピン割当が指定されなかったときに使う
+int frootspi_chardev_default_pins(
+	enum frootspi_family family, unsigned char *pins, const int max_pins)
+{
+	int num_pins = 0;
+	for (int i = 0; i < FROOTSPI_NUM_MINORS; i++) {
+		const struct frootspi_chardev *chardev = &frootspi_chardevs[i];
+		if (chardev->family != family ||
+			chardev->default_pin == FROOTSPI_PIN_NONE) {
+			continue;
+		}
+		if (num_pins >= max_pins) {
+			break;
+		}
+		pins[num_pins++] = chardev->default_pin;
+	}
+	return num_pins;
+}
+
+// /sys/class/frootspi/<name><index>/<attr> をpoll()しているプロセスを起こす
+void frootspi_chardev_notify(
+	const char *name, const unsigned int index, const char *attr)
+{
+	mutex_lock(&frootspi_chardev_lock);
+	for (int i = 0; i < FROOTSPI_NUM_MINORS; i++) {
+		struct frootspi_chardev *chardev = &frootspi_chardevs[i];
+		if (chardev->attached && chardev->index == index &&
+			strcmp(chardev->name, name) == 0) {
+			sysfs_notify(&chardev->device->kobj, NULL, attr);
+		}
+	}
+	mutex_unlock(&frootspi_chardev_lock);
+}
+
+// 登録されているデバイスファイルのバックエンドを使う間、登録と削除を止める
+void frootspi_chardev_table_lock(void)
+{
+	mutex_lock(&frootspi_chardev_lock);
+}
+
+void frootspi_chardev_table_unlock(void)
+{
+	mutex_unlock(&frootspi_chardev_lock);
+}
+
+// 登録されているfamilyのデバイスファイルのピン番号と番号(index)を集め、数を返す
+// backendがNULLでなければ、バックエンドも返す
+// frootspi_chardev_table_lock()を取ってから呼ぶ
+int frootspi_chardev_collect_locked(enum frootspi_family family,
+	void **backend, unsigned char *pins, unsigned char *indexes,
+	const int max_pins)
+{
+	int num_pins = 0;
+	for (int i = 0; i < FROOTSPI_NUM_MINORS; i++) {
+		const struct frootspi_chardev *chardev = &frootspi_chardevs[i];
+		if (chardev->family != family || !chardev->attached) {
+			continue;
+		}
+		if (num_pins >= max_pins) {
+			break;
+		}
+		if (backend) {
+			*backend = chardev->backend;
+		}
+		pins[num_pins] = chardev->pin;
+		indexes[num_pins] = chardev->index;
+		num_pins++;
+	}
+	return num_pins;
+}
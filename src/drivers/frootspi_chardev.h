@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef FROOTSPI_CHARDEV_H
+#define FROOTSPI_CHARDEV_H
+
+#include <linux/cdev.h> // struct cdev
+#include <linux/fs.h>	// struct file_operations
+#include <linux/rwsem.h> // struct rw_semaphore
+#include <linux/uio.h>	// struct iov_iter
+
+#include "frootspi_debugfs.h"
+
+#define FROOTSPI_CLASS_NAME "frootspi" // /sys/class/frootspi/
+#define FROOTSPI_PIN_NONE 0xff	       // デフォルトのピン割当がない
+#define FROOTSPI_GPIO_PIN_SDSW 23      // ラズパイのGPIO23(SDスイッチ)
+#define FROOTSPI_SDSW_INDEX 4	       // SDスイッチは/dev/frootspi_pushsw4
+#define FROOTSPI_VALUE_LEN 2	       // スイッチの値("0\n"または"1\n")の長さ
+
+// デバイスファイルの種類
+// 同じ種類のデバイスファイルは、1つのバックエンドがまとめて登録する
+enum frootspi_family {
+	FROOTSPI_HELLO,
+	FROOTSPI_PUSHSW, // MCP23S08のプッシュスイッチ
+	FROOTSPI_SDSW,	 // ラズパイのGPIO23のSDスイッチ
+	FROOTSPI_DIPSW,
+	FROOTSPI_LED,
+	FROOTSPI_LCD,
+	FROOTSPI_INPUT, // 全スイッチのイベント (frootspi_input.c)
+};
+
+// マイナー番号1つ分のデバイスファイル
+// マイナー番号はfrootspi_chardev.cのテーブルの順番で決まる
+struct frootspi_chardev {
+	// 静的な定義
+	const char *name; // /dev/<name><index>
+	unsigned int index;
+	enum frootspi_family family;
+	const struct file_operations *fops;
+	// /sys/class/frootspi/<name><index>/ に作る属性 (NULLなら無し)
+	const struct attribute_group **groups;
+	// デバイスツリーでピン割当が指定されなかったときのピン番号
+	unsigned char default_pin;
+	// 実行時の状態
+	dev_t devt;
+	// バックエンドのピン番号
+	// MCP23S08ならアドレス * 8 + GPIO番号、SDスイッチならラズパイのGPIO番号
+	unsigned char pin;
+	// 登録ごとに確保する
+	// 取り除いた後も、開かれているinodeが参照している間は解放されない
+	struct cdev *cdev;
+	struct device *device; // /sys/class/frootspi/<name><index>
+	// attachedとbackendを保護する
+	// 開いているファイルはバックエンドを使う間だけ読み込み側を取るので、
+	// 取り除くときは使い終わるのを待ち、その後の操作は-ENODEVになる
+	struct rw_semaphore backend_lock;
+	bool attached;
+	void *backend; // MCP23S08のdrvdata、LCDのdev_infoなど
+	struct frootspi_chardev_stats stats;
+	struct dentry *debugfs_dir;
+};
+
+int frootspi_chardev_init(void);
+void frootspi_chardev_exit(void);
+int frootspi_chardev_attach(enum frootspi_family family, void *backend,
+	const unsigned char *pins, const int num_pins);
+void frootspi_chardev_detach(enum frootspi_family family);
+int frootspi_chardev_default_pins(
+	enum frootspi_family family, unsigned char *pins, const int max_pins);
+void frootspi_chardev_notify(
+	const char *name, const unsigned int index, const char *attr);
+void frootspi_chardev_table_lock(void);
+void frootspi_chardev_table_unlock(void);
+int frootspi_chardev_collect_locked(enum frootspi_family family,
+	void **backend, unsigned char *pins, unsigned char *indexes,
+	const int max_pins);
+
+// 各デバイスのfile_operationsで共通に使うopen/release
+int frootspi_chardev_open(struct inode *inode, struct file *filep);
+int frootspi_chardev_release(struct inode *inode, struct file *filep);
+// 開いているファイルからバックエンドを使う間、取り除かれないようにする
+// 取り除かれた後なら-ENODEV、nowaitで待てなければ-EAGAINを返す
+// 成功したら、使い終わった後にfrootspi_chardev_put_backend()を呼ぶ
+int frootspi_chardev_get_backend(
+	struct frootspi_chardev *chardev, const bool nowait);
+void frootspi_chardev_put_backend(struct frootspi_chardev *chardev);
+// 各デバイスのread_iter/write_iterで共通に使う
+bool frootspi_chardev_nowait(const struct kiocb *iocb);
+ssize_t frootspi_chardev_read_value(
+	struct kiocb *iocb, struct iov_iter *to, const int value);
+
+#endif
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/fs.h>	    // struct file
+#include <linux/math64.h>   // div_u64()
+#include <linux/seq_file.h> // seq_*()
+
+#include "frootspi_debugfs.h"
+
+#define DEBUGFS_DIR_NAME "frootspi"
+
+struct dentry *frootspi_debugfs_root;
+struct dentry *frootspi_debugfs_chardev_dir;
+
+int frootspi_debugfs_init(void)
+{
+	// debugfsが無効なカーネルではエラーが返るが、
+	// 以降のdebugfs_*()はエラーを無視してくれるのでドライバは動作を続けられる
+	frootspi_debugfs_root = debugfs_create_dir(DEBUGFS_DIR_NAME, NULL);
+	if (IS_ERR(frootspi_debugfs_root)) {
+		printk(KERN_WARNING "%s %s: debugfs is not available.\n",
+			DEBUGFS_DIR_NAME, __func__);
+	}
+	frootspi_debugfs_chardev_dir =
+		debugfs_create_dir("chardev", frootspi_debugfs_root);
+	return 0;
+}
+
+void frootspi_debugfs_exit(void)
+{
+	debugfs_remove_recursive(frootspi_debugfs_root);
+	frootspi_debugfs_root = NULL;
+	frootspi_debugfs_chardev_dir = NULL;
+}
+
+// ヒストグラムにサンプルを追加する
+// 複数のプロセスから同時に呼ばれるので、全てatomicに更新する
+void frootspi_hist_add(struct frootspi_hist *hist, const ktime_t delta)
+{
+	s64 ns = ktime_to_ns(delta);
+	if (ns < 0) {
+		ns = 0;
+	}
+
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int bucket = us ? fls64(us) : 0;
+	if (bucket >= FROOTSPI_HIST_BUCKETS) {
+		bucket = FROOTSPI_HIST_BUCKETS - 1;
+	}
+
+	atomic64_inc(&hist->buckets[bucket]);
+	atomic64_inc(&hist->count);
+	atomic64_add(ns, &hist->sum_ns);
+
+	s64 max = atomic64_read(&hist->max_ns);
+	while (ns > max) {
+		s64 old = atomic64_cmpxchg(&hist->max_ns, max, ns);
+		if (old == max) {
+			break;
+		}
+		max = old;
+	}
+}
+
+static int hist_show(struct seq_file *s, void *unused)
+{
+	struct frootspi_hist *hist = s->private;
+	u64 count = atomic64_read(&hist->count);
+	u64 sum_ns = atomic64_read(&hist->sum_ns);
+
+	seq_printf(s, "count: %llu\n", count);
+	seq_printf(s, "avg_ns: %llu\n", count ? div64_u64(sum_ns, count) : 0);
+	seq_printf(s, "max_ns: %lld\n", atomic64_read(&hist->max_ns));
+	seq_puts(s, "usecs : count\n");
+	for (int i = 0; i < FROOTSPI_HIST_BUCKETS; i++) {
+		u64 low = i ? 1ULL << (i - 1) : 0;
+		s64 n = atomic64_read(&hist->buckets[i]);
+		if (i == FROOTSPI_HIST_BUCKETS - 1) {
+			seq_printf(s, "%llu -> inf : %lld\n", low, n);
+		} else {
+			seq_printf(s, "%llu -> %llu : %lld\n", low, 1ULL << i,
+				n);
+		}
+	}
+	return 0;
+}
+
+static int hist_open(struct inode *inode, struct file *filep)
+{
+	return single_open(filep, hist_show, inode->i_private);
+}
+
+// 何か書き込まれたらヒストグラムをリセットする
+static ssize_t hist_write(struct file *filep, const char __user *buf,
+	size_t count, loff_t *f_pos)
+{
+	struct seq_file *s = filep->private_data;
+	struct frootspi_hist *hist = s->private;
+
+	for (int i = 0; i < FROOTSPI_HIST_BUCKETS; i++) {
+		atomic64_set(&hist->buckets[i], 0);
+	}
+	atomic64_set(&hist->count, 0);
+	atomic64_set(&hist->sum_ns, 0);
+	atomic64_set(&hist->max_ns, 0);
+
+	return count;
+}
+
+static const struct file_operations hist_fops = {
+	.owner = THIS_MODULE,
+	.open = hist_open,
+	.read = seq_read,
+	.write = hist_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void frootspi_debugfs_create_hist(const char *name, struct dentry *parent,
+	struct frootspi_hist *hist)
+{
+	debugfs_create_file(name, 0644, parent, hist, &hist_fops);
+}
+
+static int counter_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *)data);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(counter_fops, counter_get, NULL, "%llu\n");
+
+// 読み出し専用のカウンタを作成する
+void frootspi_debugfs_create_counter(
+	const char *name, struct dentry *parent, atomic64_t *counter)
+{
+	debugfs_create_file_unsafe(name, 0444, parent, counter, &counter_fops);
+}
+
+// /sys/kernel/debug/frootspi/chardev/{device_name}{minor}/ に
+// キャラクタデバイスの統計を作成する
+// 削除するときは返り値をdebugfs_remove_recursive()に渡す
+struct dentry *frootspi_debugfs_create_chardev_stats(const char *device_name,
+	const unsigned int minor, struct frootspi_chardev_stats *stats)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s%u", device_name, minor);
+
+	struct dentry *dir =
+		debugfs_create_dir(name, frootspi_debugfs_chardev_dir);
+	frootspi_debugfs_create_counter("reads", dir, &stats->reads);
+	frootspi_debugfs_create_counter("writes", dir, &stats->writes);
+	debugfs_create_atomic_t(
+		"open_handles", 0444, dir, &stats->open_handles);
+	return dir;
+}
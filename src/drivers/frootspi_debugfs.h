@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef FROOTSPI_DEBUGFS_H
+#define FROOTSPI_DEBUGFS_H
+
+#include <linux/atomic.h>  // atomic64_t
+#include <linux/debugfs.h> // debugfs_*()
+#include <linux/ktime.h>   // ktime_t
+
+// レイテンシのヒストグラムのビン数
+// ビン0は1us未満、ビンiは[2^(i-1), 2^i) us、最後のビンはそれ以上
+#define FROOTSPI_HIST_BUCKETS 20
+
+struct frootspi_hist {
+	atomic64_t buckets[FROOTSPI_HIST_BUCKETS];
+	atomic64_t count;
+	atomic64_t sum_ns;
+	atomic64_t max_ns;
+};
+
+// キャラクタデバイス(マイナー番号)ごとの統計
+struct frootspi_chardev_stats {
+	atomic64_t reads;
+	atomic64_t writes;
+	atomic_t open_handles;
+};
+
+// /sys/kernel/debug/frootspi/
+extern struct dentry *frootspi_debugfs_root;
+// /sys/kernel/debug/frootspi/chardev/
+extern struct dentry *frootspi_debugfs_chardev_dir;
+
+int frootspi_debugfs_init(void);
+void frootspi_debugfs_exit(void);
+
+void frootspi_hist_add(struct frootspi_hist *hist, const ktime_t delta);
+void frootspi_debugfs_create_hist(const char *name, struct dentry *parent,
+	struct frootspi_hist *hist);
+void frootspi_debugfs_create_counter(
+	const char *name, struct dentry *parent, atomic64_t *counter);
+struct dentry *frootspi_debugfs_create_chardev_stats(const char *device_name,
+	const unsigned int minor, struct frootspi_chardev_stats *stats);
+
+#endif
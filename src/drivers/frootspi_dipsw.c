@@ -1,182 +1,127 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include <linux/cdev.h>	   // cdev_*()
+#include <linux/device.h>  // DEVICE_ATTR_RO()
 #include <linux/fs.h>	   // struct file, open, release
-#include <linux/uaccess.h> // copy_to_user()
+#include <linux/uio.h>	   // struct iov_iter
 
+#include "frootspi_chardev.h"
+#include "frootspi_input.h"
 #include "mcp23s08_driver.h"
 
-#define DIPSW_MAX_BUFLEN 64 // copy_to_user用のバッファサイズ
-#define DIPSW_BASE_MINOR 0
-#define DIPSW_MAX_MINORS 2
 #define DIPSW_DEVICE_NAME "frootspi_dipsw"
 
-static struct class *dipsw_class;
-static int dipsw_major;
-struct dipsw_device_info {
-	// ここはある程度自由に定義できる
-	struct cdev cdev;
-	unsigned int device_major;
-	unsigned int device_minor;
-	unsigned char target_gpio_num;
-};
-static struct dipsw_device_info stored_device_info[DIPSW_MAX_MINORS];
-
-extern int mcp23s08_read_gpio(const unsigned char gpio_num);
+extern int frootspi_input_cached_value(
+	const unsigned short type, const unsigned short code);
+extern int frootspi_input_replay_value(
+	const unsigned short type, const unsigned short code);
 
-static int dipsw_open(struct inode *inode, struct file *filep)
+// 記録を再生している間は、再生した値を返す
+// 失敗した場合は-1を返す
+static int dipsw_get_value(struct frootspi_chardev *chardev)
 {
-	struct dipsw_device_info *dev_info;
-	// container_of(メンバーへのポインタ, 構造体の型, 構造体メンバの名前)
-	dev_info = container_of(inode->i_cdev, struct dipsw_device_info, cdev);
-
-	dev_info->device_major = MAJOR(inode->i_rdev);
-	dev_info->device_minor = MINOR(inode->i_rdev);
-
-	switch (dev_info->device_minor) {
-	case 0:
-		dev_info->target_gpio_num = MCP23S08_GPIO_DIPSW0;
-		break;
-	case 1:
-		dev_info->target_gpio_num = MCP23S08_GPIO_DIPSW1;
-		break;
-	default:
-		dev_info->target_gpio_num = 0;
+	const int replayed =
+		frootspi_input_replay_value(FROOTSPI_EV_DIPSW, chardev->index);
+	if (replayed >= 0) {
+		return replayed;
 	}
-
-	filep->private_data = dev_info;
-
-	printk(KERN_DEBUG "%s %s: dipsw%d device opened.\n", DIPSW_DEVICE_NAME,
-		__func__, dev_info->device_minor);
-
-	return 0;
+	return mcp23s08_read_gpio(chardev->backend, chardev->pin);
 }
 
-static int dipsw_release(struct inode *inode, struct file *filep)
+// SPI通信せずに値を返す (わからなければ-EAGAIN)
+static int dipsw_get_value_nowait(struct frootspi_chardev *chardev)
 {
-	// デバイスによっては何もしなかったりする
-	// kfree(filep->private_data);
-
-	printk(KERN_DEBUG "%s %s: device closed.\n", DIPSW_DEVICE_NAME,
-		__func__);
-	return 0;
+	const int replayed =
+		frootspi_input_replay_value(FROOTSPI_EV_DIPSW, chardev->index);
+	if (replayed >= 0) {
+		return replayed;
+	}
+	const int value =
+		mcp23s08_read_gpio_nowait(chardev->backend, chardev->pin);
+	if (value >= 0) {
+		return value;
+	}
+	return frootspi_input_cached_value(FROOTSPI_EV_DIPSW, chardev->index);
 }
 
-static ssize_t dipsw_read(
-	struct file *filep, char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t dipsw_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct dipsw_device_info *dev_info = filep->private_data;
-	// オフセットがあったら正常終了する
-	// 短い文字列しかコピーしないので、これで問題なし
-	// 長い文字列をコピーするばあいは、オフセットが重要
-	if (*f_pos > 0) {
+	struct frootspi_chardev *chardev = iocb->ki_filp->private_data;
+	int gpio_value;
+	atomic64_inc(&chardev->stats.reads);
+
+	// 読み切った後はSPI通信せずにEOFを返す
+	if (iocb->ki_pos >= FROOTSPI_VALUE_LEN) {
 		return 0; // EOF
 	}
 
-	int gpio_value = mcp23s08_read_gpio(dev_info->target_gpio_num);
-	if (gpio_value < 0) {
-		printk(KERN_ERR "%s %s: mcp23s08_read_gpio() failed.\n",
-			DIPSW_DEVICE_NAME, __func__);
-		return 0;
+	// 読んでいる間にエキスパンダが取り除かれないようにする
+	const bool nowait = frootspi_chardev_nowait(iocb);
+	int retval = frootspi_chardev_get_backend(chardev, nowait);
+	if (retval) {
+		return retval;
 	}
-
-	unsigned char buffer[DIPSW_MAX_BUFLEN];
-	sprintf(buffer, "%d\n", gpio_value);
-
-	count = strlen(buffer);
-
-	// dipswドライバがもつテキスト情報をユーザ空間へコピーする
-	// copy_to_userで、buf宛に、dev_info->bufferのデータを、countバイトコピーする
-	// コピーできなかったバイト数が返り値で渡される
-	if (copy_to_user((void *)buf, &buffer, count)) {
-		printk(KERN_ERR "%s %s: copy_to_user() failed.\n",
+	if (nowait) {
+		gpio_value = dipsw_get_value_nowait(chardev);
+	} else {
+		gpio_value = dipsw_get_value(chardev);
+	}
+	frootspi_chardev_put_backend(chardev);
+	if (gpio_value == -EAGAIN) {
+		return -EAGAIN;
+	}
+	if (gpio_value < 0) {
+		printk_ratelimited(KERN_ERR "%s %s: mcp23s08_read_gpio() "
+					    "failed.\n",
 			DIPSW_DEVICE_NAME, __func__);
-		return -1;
+		// EOF(0)と区別できるよう、エラーを返す
+		return -EIO;
 	}
-	*f_pos += count;
 
-	return count;
+	return frootspi_chardev_read_value(iocb, to, gpio_value);
 }
 
-static struct file_operations dipsw_fops = {
-	.open = dipsw_open,
-	.release = dipsw_release,
-	.read = dipsw_read,
+// frootspi_chardev.cのテーブルから参照される
+struct file_operations dipsw_fops = {
+	.open = frootspi_chardev_open,
+	.release = frootspi_chardev_release,
+	.read_iter = dipsw_read_iter,
 };
 
-int register_dipsw_dev(void)
+// /sys/class/frootspi/frootspi_dipsw*/value
+// 値の変化はスイッチを読んでいるfrootspi_input.cがsysfs_notify()する
+static ssize_t value_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int retval;
-	dev_t dev;
-
-	// 動的にメジャー番号を確保する
-	retval = alloc_chrdev_region(
-		&dev, DIPSW_BASE_MINOR, DIPSW_MAX_MINORS, DIPSW_DEVICE_NAME);
-	if (retval < 0) {
-		// 確保できなかったらエラーを返して終了
-		printk(KERN_ERR "%s %s: unable to allocate device number\n",
-			DIPSW_DEVICE_NAME, __func__);
-		return retval;
-	}
-
-	// デバイスのクラスを登録する(/sys/class/***/ を作成)
-	// ドライバが動いてる最中はクラスを保持するため、クラスはグローバル変数である
-	dipsw_class = class_create(THIS_MODULE, DIPSW_DEVICE_NAME);
-	if (IS_ERR(dipsw_class)) {
-		// 登録できなかったらエラー処理に移動する
-		retval = PTR_ERR(dipsw_class);
-		printk(KERN_ERR "%s %s: class creation failed\n",
-			DIPSW_DEVICE_NAME, __func__);
-		goto failed_class_create;
+	struct frootspi_chardev *chardev = dev_get_drvdata(dev);
+	int gpio_value = dipsw_get_value(chardev);
+	if (gpio_value < 0) {
+		return -EIO;
 	}
+	return scnprintf(buf, PAGE_SIZE, "%d\n", gpio_value);
+}
+static DEVICE_ATTR_RO(value);
 
-	// マイナー番号ごとに(デバイスの数だけ)、ドライバの登録をする
-	dipsw_major = MAJOR(dev);
-	for (int i = 0; i < DIPSW_MAX_MINORS; i++) {
-		// ドライバの初期化する
-		// file_operationを登録するので、ここでドライバの機能が決まる
-		cdev_init(&stored_device_info[i].cdev, &dipsw_fops);
-		stored_device_info[i].cdev.owner = THIS_MODULE;
-
-		// ドライバをカーネルへ登録する
-		// 同じドライバを複数作成するときは、cdev_add(*,*,
-		// 3)みたいに末尾の数値を増やす
-		// 今回はドライバごとにメモリを確保したいので、cdev_add()自体を複数回実行する
-		retval = cdev_add(&stored_device_info[i].cdev,
-			MKDEV(dipsw_major, DIPSW_BASE_MINOR + i), 1);
-		if (retval < 0) {
-			// 登録できなかったらエラー処理へ移動する
-			printk(KERN_ERR
-				"%s: minor=%d: chardev registration failed\n",
-				DIPSW_DEVICE_NAME, DIPSW_BASE_MINOR + i);
-			goto failed_cdev_add;
-		}
-
-		// ドライバによっては、ここでエラー検出してたりしてなかったりする
-		device_create(dipsw_class, NULL,
-			MKDEV(dipsw_major, DIPSW_BASE_MINOR + i), NULL, "%s%u",
-			DIPSW_DEVICE_NAME, i);
-	}
+static struct attribute *dipsw_value_attrs[] = {
+	&dev_attr_value.attr,
+	NULL,
+};
 
-	return 0;
+// frootspi_chardev.cのテーブルから参照される
+const struct attribute_group dipsw_value_group = {
+	.attrs = dipsw_value_attrs,
+};
 
-failed_cdev_add:
-	class_destroy(dipsw_class);
-failed_class_create:
-	unregister_chrdev_region(
-		MKDEV(dipsw_major, DIPSW_BASE_MINOR), DIPSW_MAX_MINORS);
-	return retval;
+// pinsはMCP23S08のピン番号(アドレス * 8 + GPIO番号)
+// pins[i]が/dev/frootspi_dipsw{i}に対応する
+int register_dipsw_dev(struct mcp23s08_drvdata *expander,
+	const unsigned char *pins, const int num_pins)
+{
+	return frootspi_chardev_attach(
+		FROOTSPI_DIPSW, expander, pins, num_pins);
 }
 
 void unregister_dipsw_dev(void)
 {
-	// 基本的にはregister_dipsw_devの逆の手順でメモリを開放していく
-	for (int i = 0; i < DIPSW_MAX_MINORS; i++) {
-		device_destroy(
-			dipsw_class, MKDEV(dipsw_major, DIPSW_BASE_MINOR + i));
-		cdev_del(&stored_device_info[i].cdev);
-	}
-	class_destroy(dipsw_class);
-	unregister_chrdev_region(
-		MKDEV(dipsw_major, DIPSW_BASE_MINOR), DIPSW_MAX_MINORS);
-}
\ No newline at end of file
+	frootspi_chardev_detach(FROOTSPI_DIPSW);
+}
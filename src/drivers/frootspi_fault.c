@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// CONFIG_FAULT_INJECTION_DEBUG_FSが有効なカーネルでだけビルドする (Kbuild)
+
+#include <linux/delay.h>  // udelay(), usleep_range()
+#include <linux/random.h> // prandom_u32()
+
+#include "frootspi_fault.h"
+
+// これより短い遅延はタイマーを使わずにビジーウェイトする
+#define FAULT_UDELAY_MAX_US 10
+
+void frootspi_fault_init(struct frootspi_fault *fault, struct dentry *parent)
+{
+	struct dentry *dir;
+
+	// probabilityが0なので、設定するまでは何も起きない
+	fault->error = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	fault->delay = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	fault->corrupt = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	fault->delay_us = 1000;
+
+	// debugfsが使えなくても障害注入が無効になるだけなので、エラーは無視する
+	fault_create_debugfs_attr("fail_error", parent, &fault->error);
+	dir = fault_create_debugfs_attr("fail_delay", parent, &fault->delay);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u32("delay_us", 0600, dir, &fault->delay_us);
+	}
+	fault_create_debugfs_attr("fail_corrupt", parent, &fault->corrupt);
+}
+
+int frootspi_fault_inject(struct frootspi_fault *fault, const size_t size)
+{
+	if (should_fail(&fault->delay, size)) {
+		const u32 delay_us = READ_ONCE(fault->delay_us);
+		if (delay_us <= FAULT_UDELAY_MAX_US) {
+			udelay(delay_us);
+		} else {
+			usleep_range(delay_us, delay_us);
+		}
+	}
+	if (should_fail(&fault->error, size)) {
+		return -EIO;
+	}
+	return 0;
+}
+
+void frootspi_fault_corrupt(
+	struct frootspi_fault *fault, unsigned char *buf, const int len)
+{
+	if (len > 0 && should_fail(&fault->corrupt, len)) {
+		buf[prandom_u32() % len] ^= 1 << (prandom_u32() % 8);
+	}
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef FROOTSPI_FAULT_H
+#define FROOTSPI_FAULT_H
+
+#include <linux/debugfs.h>	// struct dentry
+#include <linux/fault-inject.h> // struct fault_attr
+
+// SPI、I2Cの通信への障害注入
+// カーネルの障害注入フレームワーク(Documentation/fault-injection/)を使い、
+// <debugfsのディレクトリ>/fail_{error,delay,corrupt}/ の
+// probability, interval, timesなどで発生させる頻度を設定する
+struct frootspi_fault {
+#if IS_ENABLED(CONFIG_FAULT_INJECTION_DEBUG_FS)
+	struct fault_attr error;   // 通信せずに-EIOを返す
+	struct fault_attr delay;   // 通信の前にdelay_usだけ待つ
+	struct fault_attr corrupt; // 受信した(I2Cは送信する)1バイトの1ビットを反転する
+	u32 delay_us;
+#endif
+};
+
+#if IS_ENABLED(CONFIG_FAULT_INJECTION_DEBUG_FS)
+void frootspi_fault_init(struct frootspi_fault *fault, struct dentry *parent);
+// 通信の前に呼び、注入するエラー(なければ0)を返す
+// 遅延を注入する場合は、この中で待つので、スリープできる状況で呼ぶこと
+int frootspi_fault_inject(struct frootspi_fault *fault, const size_t size);
+// bufのlenバイトのうち1ビットを反転する
+void frootspi_fault_corrupt(
+	struct frootspi_fault *fault, unsigned char *buf, const int len);
+#else
+static inline void frootspi_fault_init(
+	struct frootspi_fault *fault, struct dentry *parent)
+{
+}
+static inline int frootspi_fault_inject(
+	struct frootspi_fault *fault, const size_t size)
+{
+	return 0;
+}
+static inline void frootspi_fault_corrupt(
+	struct frootspi_fault *fault, unsigned char *buf, const int len)
+{
+}
+#endif
+
+#endif
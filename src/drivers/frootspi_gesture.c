@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/device.h>    // DEVICE_ATTR_RO()
+#include <linux/ktime.h>     // ktime_*()
+#include <linux/module.h>    // module_param()
+#include <linux/spinlock.h>  // spin_lock()
+#include <linux/workqueue.h> // delayed_work
+
+#include "frootspi_chardev.h"
+
+#define GESTURE_MAX_SWITCHES 16 // /dev/frootspi_pushsw<index>のindexの上限
+
+// スイッチの値の変化(エッジ)から、押下回数・押していた時間・ジェスチャを求める
+// 結果は /sys/class/frootspi/frootspi_pushsw*/ に公開し、
+// 変化したらsysfs_notify()でpoll()しているプロセスを起こす
+// 判定のために誰も開いていなくてもSPIでスイッチを読み続けるので、
+// アイドル中の通信が増えないよう、デフォルトでは無効にする
+static bool pushsw_gestures;
+module_param(pushsw_gestures, bool, 0444);
+MODULE_PARM_DESC(pushsw_gestures, "Track push switch presses and gestures "
+				  "in sysfs (default off)");
+
+// この時間以上押し続けたら長押し
+static unsigned int gesture_long_ms = 800;
+module_param(gesture_long_ms, uint, 0644);
+MODULE_PARM_DESC(gesture_long_ms, "Long press threshold in ms (default 800)");
+
+// 離してからこの時間以内に再び押したらダブル押し
+static unsigned int gesture_double_ms = 300;
+module_param(gesture_double_ms, uint, 0644);
+MODULE_PARM_DESC(gesture_double_ms, "Max gap in ms between the presses of a "
+				    "double press (default 300)");
+
+enum gesture_type {
+	GESTURE_NONE,
+	GESTURE_SHORT,
+	GESTURE_LONG,
+	GESTURE_DOUBLE,
+	GESTURE_NUM_TYPES,
+};
+
+static const char *const gesture_names[GESTURE_NUM_TYPES] = {
+	"none", "short", "long", "double"};
+
+// sysfs_notify()するファイル
+#define GESTURE_NOTIFY_PRESS (1 << 0)
+#define GESTURE_NOTIFY_RELEASE (1 << 1)
+#define GESTURE_NOTIFY_GESTURE (1 << 2)
+
+// スイッチ1つ分の状態 (gesture_lockで保護)
+struct gesture_state {
+	int value; // 最後の値 (負論理なので押されたら0、-1 = 未取得)
+	u64 presses;
+	u64 releases;
+	ktime_t last_press;
+	ktime_t last_release;
+	s64 last_hold_us; // 最後に押していた時間
+	enum gesture_type gesture; // 最後に判定したジェスチャ
+	u64 gesture_counts[GESTURE_NUM_TYPES];
+	// 短押しの後、ダブル押しの2回目を待っている
+	bool pending_short;
+	// 今回の押下は判定済み (長押しまたはダブル押しの2回目)
+	bool classified;
+	unsigned int notify; // GESTURE_NOTIFY_*
+	// 長押しとダブル押しの待ち時間が過ぎたら判定する
+	struct delayed_work timeout_work;
+};
+
+static struct gesture_state gestures[GESTURE_MAX_SWITCHES];
+static DEFINE_SPINLOCK(gesture_lock);
+// sysfs_notify()はデバイスファイルのテーブルを探すので、
+// スイッチを読んでいる文脈から切り離して呼ぶ
+static struct work_struct gesture_notify_work;
+
+// gesture_lockを取ってから呼ぶ
+static void gesture_classify_locked(
+	struct gesture_state *g, const enum gesture_type type)
+{
+	g->gesture = type;
+	g->gesture_counts[type]++;
+	g->classified = true;
+	g->pending_short = false;
+	g->notify |= GESTURE_NOTIFY_GESTURE;
+}
+
+static void gesture_notify(struct work_struct *work)
+{
+	unsigned int notify[GESTURE_MAX_SWITCHES];
+
+	spin_lock(&gesture_lock);
+	for (int i = 0; i < GESTURE_MAX_SWITCHES; i++) {
+		notify[i] = gestures[i].notify;
+		gestures[i].notify = 0;
+	}
+	spin_unlock(&gesture_lock);
+
+	for (int i = 0; i < GESTURE_MAX_SWITCHES; i++) {
+		if (notify[i] & GESTURE_NOTIFY_PRESS) {
+			frootspi_chardev_notify(
+				"frootspi_pushsw", i, "press_count");
+		}
+		if (notify[i] & GESTURE_NOTIFY_RELEASE) {
+			frootspi_chardev_notify(
+				"frootspi_pushsw", i, "release_count");
+		}
+		if (notify[i] & GESTURE_NOTIFY_GESTURE) {
+			frootspi_chardev_notify(
+				"frootspi_pushsw", i, "gesture");
+		}
+	}
+}
+
+static void gesture_timeout(struct work_struct *work)
+{
+	struct gesture_state *g = container_of(
+		to_delayed_work(work), struct gesture_state, timeout_work);
+	const ktime_t now = ktime_get();
+
+	spin_lock(&gesture_lock);
+	if (g->value == 0 && !g->classified &&
+		ktime_ms_delta(now, g->last_press) >= gesture_long_ms) {
+		// 離されるのを待たずに長押しと判定する
+		gesture_classify_locked(g, GESTURE_LONG);
+	} else if (g->value == 1 && g->pending_short &&
+		   ktime_ms_delta(now, g->last_release) >= gesture_double_ms) {
+		// 2回目が来なかったので短押し
+		gesture_classify_locked(g, GESTURE_SHORT);
+	}
+	const bool notify = g->notify != 0;
+	spin_unlock(&gesture_lock);
+
+	if (notify) {
+		schedule_work(&gesture_notify_work);
+	}
+}
+
+// /dev/frootspi_pushsw<index>の値が変わったときに呼ばれる
+// valueは負論理 (押されたら0)
+void frootspi_gesture_report(
+	const unsigned int index, const int value, const ktime_t now)
+{
+	unsigned long timeout_ms = 0;
+	bool schedule_timeout = false;
+
+	if (!pushsw_gestures || index >= GESTURE_MAX_SWITCHES) {
+		return;
+	}
+
+	struct gesture_state *g = &gestures[index];
+	spin_lock(&gesture_lock);
+	const int prev = g->value;
+	g->value = value;
+	// 最初の値は基準にするだけで、エッジとして数えない
+	if (prev < 0 || prev == value) {
+		spin_unlock(&gesture_lock);
+		return;
+	}
+
+	if (value == 0) {
+		// 押された
+		g->presses++;
+		g->last_press = now;
+		g->notify |= GESTURE_NOTIFY_PRESS;
+		if (g->pending_short &&
+			ktime_ms_delta(now, g->last_release) <=
+				gesture_double_ms) {
+			gesture_classify_locked(g, GESTURE_DOUBLE);
+		} else {
+			g->classified = false;
+			g->pending_short = false;
+			timeout_ms = gesture_long_ms;
+			schedule_timeout = true;
+		}
+	} else {
+		// 離された
+		g->releases++;
+		g->last_release = now;
+		g->last_hold_us = ktime_us_delta(now, g->last_press);
+		g->notify |= GESTURE_NOTIFY_RELEASE;
+		if (!g->classified) {
+			if (g->last_hold_us >= gesture_long_ms * 1000LL) {
+				gesture_classify_locked(g, GESTURE_LONG);
+			} else {
+				// ダブル押しの2回目を待ってから短押しと判定する
+				g->pending_short = true;
+				timeout_ms = gesture_double_ms;
+				schedule_timeout = true;
+			}
+		}
+	}
+	spin_unlock(&gesture_lock);
+
+	if (schedule_timeout) {
+		mod_delayed_work(system_wq, &g->timeout_work,
+			msecs_to_jiffies(timeout_ms));
+	}
+	schedule_work(&gesture_notify_work);
+}
+
+void frootspi_gesture_init(void)
+{
+	INIT_WORK(&gesture_notify_work, gesture_notify);
+	for (int i = 0; i < GESTURE_MAX_SWITCHES; i++) {
+		gestures[i].value = -1;
+		INIT_DELAYED_WORK(&gestures[i].timeout_work, gesture_timeout);
+	}
+}
+
+void frootspi_gesture_exit(void)
+{
+	for (int i = 0; i < GESTURE_MAX_SWITCHES; i++) {
+		cancel_delayed_work_sync(&gestures[i].timeout_work);
+	}
+	cancel_work_sync(&gesture_notify_work);
+}
+
+// スイッチを読み続ける必要があるか
+bool frootspi_gesture_enabled(void)
+{
+	return pushsw_gestures;
+}
+
+// ---------- sysfs (/sys/class/frootspi/frootspi_pushsw*/) ----------
+
+static struct gesture_state *gesture_from_dev(struct device *dev)
+{
+	struct frootspi_chardev *chardev = dev_get_drvdata(dev);
+	if (chardev->index >= GESTURE_MAX_SWITCHES) {
+		return NULL;
+	}
+	return &gestures[chardev->index];
+}
+
+// u64のメンバを1つ表示するshow関数を作る
+#define GESTURE_SHOW_U64(_name, _expr)                                         \
+	static ssize_t _name##_show(                                           \
+		struct device *dev, struct device_attribute *attr, char *buf)  \
+	{                                                                      \
+		struct gesture_state *g = gesture_from_dev(dev);               \
+		u64 value;                                                     \
+		if (g == NULL) {                                               \
+			return -ENODEV;                                        \
+		}                                                              \
+		spin_lock(&gesture_lock);                                      \
+		value = (_expr);                                               \
+		spin_unlock(&gesture_lock);                                    \
+		return scnprintf(buf, PAGE_SIZE, "%llu\n", value);             \
+	}                                                                      \
+	static DEVICE_ATTR_RO(_name)
+
+GESTURE_SHOW_U64(press_count, g->presses);
+GESTURE_SHOW_U64(release_count, g->releases);
+GESTURE_SHOW_U64(last_press_ns, ktime_to_ns(g->last_press));
+GESTURE_SHOW_U64(last_release_ns, ktime_to_ns(g->last_release));
+GESTURE_SHOW_U64(hold_us, g->last_hold_us);
+GESTURE_SHOW_U64(short_count, g->gesture_counts[GESTURE_SHORT]);
+GESTURE_SHOW_U64(long_count, g->gesture_counts[GESTURE_LONG]);
+GESTURE_SHOW_U64(double_count, g->gesture_counts[GESTURE_DOUBLE]);
+
+static ssize_t gesture_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gesture_state *g = gesture_from_dev(dev);
+	enum gesture_type type;
+	if (g == NULL) {
+		return -ENODEV;
+	}
+	spin_lock(&gesture_lock);
+	type = g->gesture;
+	spin_unlock(&gesture_lock);
+	return scnprintf(buf, PAGE_SIZE, "%s\n", gesture_names[type]);
+}
+static DEVICE_ATTR_RO(gesture);
+
+static struct attribute *gesture_attrs[] = {
+	&dev_attr_press_count.attr,
+	&dev_attr_release_count.attr,
+	&dev_attr_last_press_ns.attr,
+	&dev_attr_last_release_ns.attr,
+	&dev_attr_hold_us.attr,
+	&dev_attr_gesture.attr,
+	&dev_attr_short_count.attr,
+	&dev_attr_long_count.attr,
+	&dev_attr_double_count.attr,
+	NULL,
+};
+
+// frootspi_chardev.cのテーブルから参照される
+const struct attribute_group gesture_group = {
+	.attrs = gesture_attrs,
+};
@@ -1,182 +1,336 @@
 // SPDX-License-Identifier: GPL-2.0
 
-#include <linux/cdev.h>	   // cdev_*()
-#include <linux/fs.h>	   // struct file, open, release
-#include <linux/uaccess.h> // copy_to_user()
+#include <linux/cdev.h>	    // cdev_*()
+#include <linux/fs.h>	    // struct file, open, release
+#include <linux/log2.h>	    // roundup_pow_of_two()
+#include <linux/mm.h>	    // struct vm_area_struct
+#include <linux/module.h>   // module_param()
+#include <linux/mutex.h>    // mutex_*()
+#include <linux/poll.h>	    // poll_wait()
+#include <linux/uio.h>	    // struct iov_iter
+#include <linux/vmalloc.h>  // vmalloc_user(), remap_vmalloc_range()
+#include <linux/wait.h>	    // wait_event_interruptible()
+
+#include "frootspi_chardev.h"
+#include "frootspi_hello.h"
 
-#define HELLO_BASE_MINOR 0
 #define HELLO_MAX_MINORS 3
 #define HELLO_DEVICE_NAME "frootspi_hello"
-#define HELLO_NUM_BUFFER 256
-
-static struct class *hello_class;
-static int hello_major;
-struct hello_device_info {
-	// ここはある程度自由に定義できる
-	struct cdev cdev;
-	unsigned int device_major;
-	unsigned int device_minor;
-	unsigned char buffer[HELLO_NUM_BUFFER];
+// head - tail がu32で溢れないよう、リングの大きさに上限を設ける
+#define HELLO_MAX_RING_SIZE (16 * 1024 * 1024)
+
+// マイナー番号ごとのリングのバイト数 (2のべき乗に切り上げる)
+static unsigned int hello_ring_size = 65536;
+module_param(hello_ring_size, uint, 0444);
+MODULE_PARM_DESC(hello_ring_size, "Ring buffer bytes per /dev/frootspi_hello* "
+				  "(default 65536)");
+
+// 書く側と読む側がそれぞれ1つのリング (single-producer/single-consumer)
+// 書く側どうし、読む側どうしはmutexで1つにするが、
+// 書く側と読む側はロックを共有せず、headとtailのacquire/releaseだけで同期する
+struct hello_ring {
+	// 先頭ページがstruct frootspi_hello_ring、その後にデータ領域
+	// mmap()できるようvmalloc_user()で確保する
+	struct frootspi_hello_ring *ctrl;
+	unsigned char *data;
+	// ctrl->sizeはユーザ空間から書き換えられるので、ドライバはこちらを使う
+	u32 size;
+	struct mutex read_lock;
+	struct mutex write_lock;
+	wait_queue_head_t read_wait;  // データが書かれるのを待つ
+	wait_queue_head_t write_wait; // 空きができるのを待つ
+	// 書き込み用に開かれている数
+	// 0で空ならread()はEOFを返す
+	atomic_t writers;
 };
-static struct hello_device_info stored_device_info[HELLO_MAX_MINORS];
 
-static int hello_open(struct inode *inode, struct file *filep)
+static struct hello_ring hello_rings[HELLO_MAX_MINORS];
+
+// 溜まっているバイト数
+// mmap()したプロセスがheadやtailを壊しても、sizeを超えないようにする
+static u32 hello_ring_used(struct hello_ring *ring)
 {
-	struct hello_device_info *dev_info;
-	// container_of(メンバーへのポインタ, 構造体の型, 構造体メンバの名前)
-	dev_info = container_of(inode->i_cdev, struct hello_device_info, cdev);
+	const u32 head = smp_load_acquire(&ring->ctrl->head);
+	const u32 tail = smp_load_acquire(&ring->ctrl->tail);
+	return min(head - tail, ring->size);
+}
 
-	// ここに何かしらのエラー処理がいるかも
+static u32 hello_ring_space(struct hello_ring *ring)
+{
+	return ring->size - hello_ring_used(ring);
+}
 
-	dev_info->device_major = MAJOR(inode->i_rdev);
-	dev_info->device_minor = MINOR(inode->i_rdev);
+// 読む側: 溜まっている分をtoにコピーし、tailを進める
+// 折り返している場合は2回に分けてコピーする
+static size_t hello_ring_read(struct hello_ring *ring, struct iov_iter *to)
+{
+	const u32 tail = READ_ONCE(ring->ctrl->tail);
+	const u32 offset = tail & (ring->size - 1);
+	const size_t len = min_t(size_t, iov_iter_count(to),
+		hello_ring_used(ring));
+	const size_t first = min_t(size_t, len, ring->size - offset);
 
-	filep->private_data = dev_info;
+	size_t copied = copy_to_iter(ring->data + offset, first, to);
+	if (copied == first && len > first) {
+		copied += copy_to_iter(ring->data, len - first, to);
+	}
+	// データを読み終えてからtailを公開する
+	smp_store_release(&ring->ctrl->tail, tail + copied);
+	return copied;
+}
+
+// 書く側: 空いている分だけfromからコピーし、headを進める
+static size_t hello_ring_write(struct hello_ring *ring, struct iov_iter *from)
+{
+	const u32 head = READ_ONCE(ring->ctrl->head);
+	const u32 offset = head & (ring->size - 1);
+	const size_t len = min_t(size_t, iov_iter_count(from),
+		hello_ring_space(ring));
+	const size_t first = min_t(size_t, len, ring->size - offset);
 
-	printk(KERN_DEBUG "%s %s: hello device opend.\n", HELLO_DEVICE_NAME,
-		__func__);
+	size_t copied = copy_from_iter(ring->data + offset, first, from);
+	if (copied == first && len > first) {
+		copied += copy_from_iter(ring->data, len - first, from);
+	}
+	// データを書き終えてからheadを公開する
+	smp_store_release(&ring->ctrl->head, head + copied);
+	return copied;
+}
+
+// 読む側、書く側をそれぞれ1つにする (O_NONBLOCK、IOCB_NOWAITなら待たずに-EAGAIN)
+static int hello_lock(struct kiocb *iocb, struct mutex *lock)
+{
+	if (frootspi_chardev_nowait(iocb)) {
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	}
+	return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
 
+static bool hello_readable(struct hello_ring *ring)
+{
+	return hello_ring_used(ring) > 0 || atomic_read(&ring->writers) == 0;
+}
+
+static int hello_open(struct inode *inode, struct file *filep)
+{
+	int retval = frootspi_chardev_open(inode, filep);
+	if (retval) {
+		return retval;
+	}
+	struct frootspi_chardev *chardev = filep->private_data;
+	// パイプと同じくファイルの位置を持たない (pread()やlseek()はESPIPE)
+	stream_open(inode, filep);
+	if (filep->f_mode & FMODE_WRITE) {
+		atomic_inc(&hello_rings[chardev->index].writers);
+	}
 	return 0;
 }
 
 static int hello_release(struct inode *inode, struct file *filep)
 {
-	// デバイスによっては何もしなかったりする
-	// kfree(filep->private_data);
-	printk(KERN_DEBUG "%s %s: hello device closed.\n", HELLO_DEVICE_NAME,
-		__func__);
+	struct frootspi_chardev *chardev = filep->private_data;
+	struct hello_ring *ring = &hello_rings[chardev->index];
 
-	return 0;
+	// 最後の書く側が閉じたら、待っている読む側にEOFを返す
+	if ((filep->f_mode & FMODE_WRITE) &&
+		atomic_dec_and_test(&ring->writers)) {
+		wake_up_interruptible_poll(&ring->read_wait, EPOLLHUP);
+	}
+	return frootspi_chardev_release(inode, filep);
 }
 
-static ssize_t hello_read(
-	struct file *filep, char __user *buf, size_t count, loff_t *f_pos)
+// 溜まっている分を最大countバイト読み出す
+// 空なら書かれるまで待ち (O_NONBLOCK、IOCB_NOWAITなら-EAGAIN)、
+// 空で書き込み用に開いているファイルがなければEOF(0)を返す
+static ssize_t hello_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct hello_device_info *dev_info = filep->private_data;
-	printk(KERN_DEBUG "%s %s: helo_read, major:%d, minor:%d\n",
-		HELLO_DEVICE_NAME, __func__, dev_info->device_major,
-		dev_info->device_minor);
+	struct frootspi_chardev *chardev = iocb->ki_filp->private_data;
+	struct hello_ring *ring = &hello_rings[chardev->index];
+	ssize_t retval;
+	atomic64_inc(&chardev->stats.reads);
+
+	if (iov_iter_count(to) == 0) {
+		return 0;
+	}
+	retval = hello_lock(iocb, &ring->read_lock);
+	if (retval) {
+		return retval;
+	}
+
+	while (hello_ring_used(ring) == 0) {
+		if (atomic_read(&ring->writers) == 0) {
+			retval = 0;
+			goto out;
+		}
+		if (frootspi_chardev_nowait(iocb)) {
+			retval = -EAGAIN;
+			goto out;
+		}
+		if (wait_event_interruptible(
+			    ring->read_wait, hello_readable(ring))) {
+			retval = -ERESTARTSYS;
+			goto out;
+		}
+	}
 
-	// オフセットがあったら正常終了する
-	// 短い文字列しかコピーしないので、これで問題なし
-	// 長い文字列をコピーするばあいは、オフセットが重要
-	if (*f_pos > 0) {
-		return 0; // EOF
+	retval = hello_ring_read(ring, to);
+	if (retval == 0) {
+		retval = -EFAULT;
+		goto out;
 	}
+	wake_up_interruptible_poll(&ring->write_wait, EPOLLOUT | EPOLLWRNORM);
 
-	// readするサイズに変更する
-	// nバイトだけreadする、という使い方を想定していない
-	count = strlen(dev_info->buffer);
+out:
+	mutex_unlock(&ring->read_lock);
+	return retval;
+}
+
+// パイプと同じく、全て書き込むまで空きを待つ
+// O_NONBLOCK、IOCB_NOWAITなら空いている分だけ書き、全く空いていなければ-EAGAIN
+// 途中でシグナルを受けたら、それまでに書き込めたバイト数を返す
+static ssize_t hello_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct frootspi_chardev *chardev = iocb->ki_filp->private_data;
+	struct hello_ring *ring = &hello_rings[chardev->index];
+	const bool nowait = frootspi_chardev_nowait(iocb);
+	ssize_t written = 0;
+	int retval;
+	atomic64_inc(&chardev->stats.writes);
 
-	// helloドライバがもつテキスト情報をユーザ空間へコピーする
-	// copy_to_userで、buf宛に、dev_info->bufferのデータを、countバイトコピーする
-	// コピーできなかったバイト数が返り値で渡される
-	if (copy_to_user((void *)buf, dev_info->buffer, count)) {
-		printk(KERN_ERR "%s %s: copy_to_user() failed.\n",
-			HELLO_DEVICE_NAME, __func__);
-		return -1;
+	if (iov_iter_count(from) == 0) {
+		return 0;
+	}
+	retval = hello_lock(iocb, &ring->write_lock);
+	if (retval) {
+		return retval;
 	}
-	*f_pos += count;
-	return count;
+
+	while (iov_iter_count(from) > 0) {
+		if (hello_ring_space(ring) == 0) {
+			if (nowait) {
+				retval = -EAGAIN;
+				break;
+			}
+			if (wait_event_interruptible(ring->write_wait,
+				    hello_ring_space(ring) > 0)) {
+				retval = -ERESTARTSYS;
+				break;
+			}
+		}
+		const size_t copied = hello_ring_write(ring, from);
+		if (copied == 0) {
+			retval = -EFAULT;
+			break;
+		}
+		written += copied;
+		wake_up_interruptible_poll(
+			&ring->read_wait, EPOLLIN | EPOLLRDNORM);
+	}
+
+	mutex_unlock(&ring->write_lock);
+	return written ? written : retval;
 }
 
-static ssize_t hello_write(
-	struct file *filep, const char __user *buf, size_t count, loff_t *f_pos)
+static __poll_t hello_poll(struct file *filep, poll_table *wait)
 {
-	struct hello_device_info *dev_info = filep->private_data;
-	printk("%s %s: hello_write, major:%d, minor:%d\n", HELLO_DEVICE_NAME,
-		__func__, dev_info->device_major, dev_info->device_minor);
+	struct frootspi_chardev *chardev = filep->private_data;
+	struct hello_ring *ring = &hello_rings[chardev->index];
+	__poll_t mask = 0;
 
-	if (copy_from_user(dev_info->buffer, buf, count) != 0) {
-		printk(KERN_ERR "%s %s: copy_from_user() failed.\n",
-			HELLO_DEVICE_NAME, __func__);
-		return -1;
+	poll_wait(filep, &ring->read_wait, wait);
+	poll_wait(filep, &ring->write_wait, wait);
+	if (filep->f_mode & FMODE_READ) {
+		if (hello_ring_used(ring) > 0) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		} else if (atomic_read(&ring->writers) == 0) {
+			mask |= EPOLLHUP;
+		}
+	}
+	if ((filep->f_mode & FMODE_WRITE) && hello_ring_space(ring) > 0) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
 	}
+	return mask;
+}
+
+// 先頭ページ(struct frootspi_hello_ring)とデータ領域をそのまま見せる
+// 読み書きだけならread()、write()と同じリングをコピーなしで使える
+static int hello_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct frootspi_chardev *chardev = filep->private_data;
+	struct hello_ring *ring = &hello_rings[chardev->index];
 
-	return count;
+	// 範囲外ならremap_vmalloc_range()が-EINVALを返す
+	return remap_vmalloc_range(vma, ring->ctrl, vma->vm_pgoff);
 }
 
-static struct file_operations hello_fops = {
+// mmap()でheadやtailを進めたプロセスが、待っている相手を起こすために呼ぶ
+static int hello_fsync(struct file *filep, loff_t start, loff_t end,
+	int datasync)
+{
+	struct frootspi_chardev *chardev = filep->private_data;
+	struct hello_ring *ring = &hello_rings[chardev->index];
+
+	wake_up_interruptible_poll(&ring->read_wait, EPOLLIN | EPOLLRDNORM);
+	wake_up_interruptible_poll(&ring->write_wait, EPOLLOUT | EPOLLWRNORM);
+	return 0;
+}
+
+// frootspi_chardev.cのテーブルから参照される
+struct file_operations hello_fops = {
 	.open = hello_open,
 	.release = hello_release,
-	.read = hello_read,
-	.write = hello_write,
+	.llseek = no_llseek,
+	.read_iter = hello_read_iter,
+	.write_iter = hello_write_iter,
+	.poll = hello_poll,
+	.mmap = hello_mmap,
+	.fsync = hello_fsync,
 };
 
-int register_hello_dev(void)
+static void hello_free_rings(void)
 {
-	int retval;
-	dev_t dev;
-
-	// 動的にメジャー番号を確保する
-	retval = alloc_chrdev_region(
-		&dev, HELLO_BASE_MINOR, HELLO_MAX_MINORS, HELLO_DEVICE_NAME);
-	if (retval < 0) {
-		// 確保できなかったらエラーを返して終了
-		printk(KERN_ERR "%s %s: unable to allocate device number\n",
-			HELLO_DEVICE_NAME, __func__);
-		return retval;
+	for (int i = 0; i < HELLO_MAX_MINORS; i++) {
+		vfree(hello_rings[i].ctrl);
+		hello_rings[i].ctrl = NULL;
 	}
+}
 
-	// デバイスのクラスを登録する(/sys/class/***/ を作成)
-	// ドライバが動いてる最中はクラスを保持するため、クラスはグローバル変数である
-	hello_class = class_create(THIS_MODULE, HELLO_DEVICE_NAME);
-	if (IS_ERR(hello_class)) {
-		// 登録できなかったらエラー処理に移動する
-		retval = PTR_ERR(hello_class);
-		printk(KERN_ERR "%s %s: class creation failed\n",
-			HELLO_DEVICE_NAME, __func__);
-		goto failed_class_create;
-	}
+int register_hello_dev(void)
+{
+	const u32 size = roundup_pow_of_two(clamp_t(unsigned int,
+		hello_ring_size, PAGE_SIZE, HELLO_MAX_RING_SIZE));
 
-	// マイナー番号ごとに(デバイスの数だけ)、ドライバの登録をする
-	hello_major = MAJOR(dev);
 	for (int i = 0; i < HELLO_MAX_MINORS; i++) {
-		// ドライバの初期化する
-		// file_operationを登録するので、ここでドライバの機能が決まる
-		cdev_init(&stored_device_info[i].cdev, &hello_fops);
-		stored_device_info[i].cdev.owner = THIS_MODULE;
-
-		// ドライバをカーネルへ登録する
-		// 同じドライバを複数作成するときは、cdev_add(*,*,
-		// 3)みたいに末尾の数値を増やす
-		// 今回はドライバごとにメモリを確保したいので、cdev_add()自体を複数回実行する
-		retval = cdev_add(&stored_device_info[i].cdev,
-			MKDEV(hello_major, HELLO_BASE_MINOR + i), 1);
-		if (retval < 0) {
-			// 登録できなかったらエラー処理へ移動する
-			printk(KERN_ERR "%s %s: minor=%d: chardev registration "
-					"failed\n",
-				HELLO_DEVICE_NAME, __func__,
-				HELLO_BASE_MINOR + i);
-			goto failed_cdev_add;
+		struct hello_ring *ring = &hello_rings[i];
+		// vmalloc_user()はゼロで埋めるので、headとtailは0から始まる
+		ring->ctrl = vmalloc_user(PAGE_SIZE + size);
+		if (!ring->ctrl) {
+			printk(KERN_ERR "%s %s: vmalloc_user() failed.\n",
+				HELLO_DEVICE_NAME, __func__);
+			hello_free_rings();
+			return -ENOMEM;
 		}
-
-		// ドライバによっては、ここでエラー検出してたりしてなかったりする
-		device_create(hello_class, NULL,
-			MKDEV(hello_major, HELLO_BASE_MINOR + i), NULL, "%s%u",
-			HELLO_DEVICE_NAME, i);
+		ring->data = (unsigned char *)ring->ctrl + PAGE_SIZE;
+		ring->size = size;
+		ring->ctrl->size = size;
+		ring->ctrl->data_offset = PAGE_SIZE;
+		mutex_init(&ring->read_lock);
+		mutex_init(&ring->write_lock);
+		init_waitqueue_head(&ring->read_wait);
+		init_waitqueue_head(&ring->write_wait);
+		atomic_set(&ring->writers, 0);
 	}
 
-	return 0;
-
-failed_cdev_add:
-	class_destroy(hello_class);
-failed_class_create:
-	unregister_chrdev_region(
-		MKDEV(hello_major, HELLO_BASE_MINOR), HELLO_MAX_MINORS);
+	// helloはバックエンドがないので、すぐにデバイスファイルを作る
+	int retval = frootspi_chardev_attach(FROOTSPI_HELLO, NULL, NULL, 0);
+	if (retval) {
+		hello_free_rings();
+	}
 	return retval;
 }
 
 void unregister_hello_dev(void)
 {
-	// 基本的にはregister_hello_devの逆の手順でメモリを開放していく
-	for (int i = 0; i < HELLO_MAX_MINORS; i++) {
-		device_destroy(
-			hello_class, MKDEV(hello_major, HELLO_BASE_MINOR + i));
-		cdev_del(&stored_device_info[i].cdev);
-	}
-	class_destroy(hello_class);
-	unregister_chrdev_region(
-		MKDEV(hello_major, HELLO_BASE_MINOR), HELLO_MAX_MINORS);
-}
\ No newline at end of file
+	frootspi_chardev_detach(FROOTSPI_HELLO);
+	hello_free_rings();
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef FROOTSPI_HELLO_H
+#define FROOTSPI_HELLO_H
+
+// ユーザ空間のプログラムからもincludeできるよう、linux/types.hだけを使う
+#include <linux/types.h> // __u32
+
+// /dev/frootspi_hello<n> をmmap()したときの先頭ページ
+// データ領域はdata_offsetバイト目から始まり、sizeバイトのリングになっている
+//
+// headとtailは折り返さずに増え続けるカウンタで、
+// 溜まっているバイト数は head - tail、書き込み位置は head & (size - 1)
+// 書く側だけがheadを、読む側だけがtailを進める
+// 相手の値はacquireで読み、自分の値はデータをコピーした後にreleaseで書くこと
+//
+// mmap()で読み書きした後は、fsync()で待っている相手を起こす
+struct frootspi_hello_ring {
+	__u32 head;	   // 書き込んだバイト数
+	__u32 tail;	   // 読み出したバイト数
+	__u32 size;	   // データ領域のバイト数 (2のべき乗)
+	__u32 data_offset; // mmap()した先頭からデータ領域までのバイト数
+};
+
+#endif
@@ -0,0 +1,626 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/fs.h>	     // struct file, open, release
+#include <linux/kfifo.h>     // kfifo_*()
+#include <linux/list.h>	     // list_*()
+#include <linux/module.h>    // module_param()
+#include <linux/poll.h>	     // poll_wait()
+#include <linux/slab.h>	     // kzalloc()
+#include <linux/spinlock.h>  // spin_lock()
+#include <linux/uaccess.h>   // copy_to_user()
+#include <linux/workqueue.h> // delayed_work
+
+#include "frootspi_chardev.h"
+#include "frootspi_debugfs.h"
+#include "frootspi_input.h"
+#include "mcp23s08_driver.h"
+
+#define INPUT_DEVICE_NAME "frootspi_input"
+#define INPUT_MAX_CODES 16 // 種類ごとのデバイスファイル番号の上限
+#define INPUT_NUM_TYPES (FROOTSPI_EV_DIPSW + 1)
+// 取りこぼしの後に全スイッチの値を入れ直せる長さ
+#define INPUT_MIN_QUEUE_LEN (INPUT_MAX_CODES * 2)
+#define INPUT_READ_BATCH 16 // 1回のcopy_to_user()で渡すイベントの数
+
+extern void frootspi_gesture_report(
+	const unsigned int index, const int value, const ktime_t now);
+extern void frootspi_gesture_init(void);
+extern void frootspi_gesture_exit(void);
+extern bool frootspi_gesture_enabled(void);
+extern int frootspi_sdsw_get_value(void);
+extern int frootspi_record_init(struct dentry *parent);
+extern void frootspi_record_exit(void);
+extern void frootspi_record_event(const struct frootspi_input_event *ev);
+extern bool frootspi_record_enabled(void);
+extern bool frootspi_record_replaying(void);
+
+// スイッチを読む間隔
+static unsigned int input_poll_ms = 10;
+module_param(input_poll_ms, uint, 0444);
+MODULE_PARM_DESC(input_poll_ms, "Switch sampling interval in ms for "
+				"/dev/frootspi_input0 (default 10)");
+
+// open()ごとのイベントキューの長さ (2のべき乗に切り上げる)
+static unsigned int input_queue_len = 64;
+module_param(input_queue_len, uint, 0444);
+MODULE_PARM_DESC(input_queue_len, "Events queued per open file of "
+				  "/dev/frootspi_input0 (default 64)");
+
+// /dev/frootspi_input0 を誰も開いていないときに、DIPスイッチを読む間隔
+// /sys/class/frootspi/frootspi_dipsw*/value のsysfs_notify()に使う
+// 0(デフォルト)なら、開かれている間だけ読む
+// 誰も使っていないのにSPI通信し続けないよう、定期的な読み出しは指定したときだけ
+static unsigned int dipsw_poll_ms;
+module_param(dipsw_poll_ms, uint, 0444);
+MODULE_PARM_DESC(dipsw_poll_ms, "Dip switch sampling interval in ms while "
+				"/dev/frootspi_input0 is closed (default 0 = "
+				"never)");
+
+// open()ごとのイベントキュー
+// 読むのが遅いクライアントのキューが溢れても、他のクライアントには影響しない
+struct input_client {
+	struct list_head node;
+	struct frootspi_chardev *chardev;
+	DECLARE_KFIFO_PTR(fifo, struct frootspi_input_event);
+	// キューが一杯で捨てたイベントの数
+	// キューを読み切った後にFROOTSPI_EV_DROPPEDとして渡す
+	unsigned int dropped;
+};
+
+// /sys/kernel/debug/frootspi/input/
+struct input_stats {
+	atomic64_t samples; // スイッチを読んだ回数
+	atomic64_t events;  // 値の変化の数 (クライアントの数によらない)
+	atomic64_t dropped; // キューが一杯で捨てたイベントの数
+};
+
+static void input_sample(struct work_struct *work);
+
+// 全クライアントで共有するサンプラー
+// クライアントが1つ以上ある間だけ、input_poll_msごとにスイッチを読む
+// 有効にした場合は、誰も開いていなくても
+// ジェスチャの判定やsysfs_notify()のために読み続ける
+// (pushsw_gestures, dipsw_poll_ms)
+// 1回の読み出しを全クライアントのキューに配るので、
+// クライアントが増えてもSPI通信の回数は変わらない
+static DECLARE_DELAYED_WORK(input_sample_work, input_sample);
+static DECLARE_WAIT_QUEUE_HEAD(input_wait);
+// input_clientsとinput_stateを保護する
+static DEFINE_SPINLOCK(input_lock);
+static LIST_HEAD(input_clients);
+// 最後に読んだ値 (-1 = まだ読んでいない)
+static s8 input_state[INPUT_NUM_TYPES][INPUT_MAX_CODES];
+// クライアントの数とサンプラーの開始・停止を保護する
+static DEFINE_MUTEX(input_open_lock);
+static u32 num_clients;
+
+static ktime_t last_dipsw_sample;
+// 他のサブシステムから直接イベントを受け取れる状態か
+// 取り除くときに、配っている途中のイベントを待てるようmutexで保護する
+static DEFINE_MUTEX(input_ready_lock);
+static bool input_ready;
+
+static struct input_stats stats;
+static struct frootspi_hist sample_hist;
+static struct dentry *input_debugfs_dir;
+
+// 読んだ値を全スイッチ分clientのキューに入れる (input_lockを取ってから呼ぶ)
+static void input_queue_snapshot_locked(
+	struct input_client *client, const ktime_t now)
+{
+	for (int type = FROOTSPI_EV_PUSHSW; type < INPUT_NUM_TYPES; type++) {
+		for (int code = 0; code < INPUT_MAX_CODES; code++) {
+			if (input_state[type][code] < 0) {
+				continue;
+			}
+			const struct frootspi_input_event ev = {
+				.time_ns = ktime_to_ns(now),
+				.type = type,
+				.code = code,
+				.value = input_state[type][code],
+			};
+			if (!kfifo_put(&client->fifo, ev)) {
+				client->dropped++;
+			}
+		}
+	}
+}
+
+// 値が変わっていれば、全クライアントのキューにイベントを入れる
+// 値が変わったらtrueを返す
+// 記録を再生している間は、replayedがtrueのもの(再生した値)だけを配る
+static bool input_report(const unsigned short type, const unsigned short code,
+	const int value, const ktime_t now, const bool replayed)
+{
+	struct input_client *client;
+	bool changed = false;
+
+	if (type >= INPUT_NUM_TYPES || code >= INPUT_MAX_CODES) {
+		return false;
+	}
+
+	const struct frootspi_input_event ev = {
+		.time_ns = ktime_to_ns(now),
+		.type = type,
+		.code = code,
+		.value = value,
+	};
+	spin_lock(&input_lock);
+	if (frootspi_record_replaying() == replayed &&
+		input_state[type][code] != value) {
+		input_state[type][code] = value;
+		changed = true;
+		frootspi_record_event(&ev);
+		list_for_each_entry(client, &input_clients, node)
+		{
+			if (!kfifo_put(&client->fifo, ev)) {
+				client->dropped++;
+				atomic64_inc(&stats.dropped);
+			}
+		}
+	}
+	spin_unlock(&input_lock);
+
+	if (changed) {
+		atomic64_inc(&stats.events);
+		wake_up_interruptible(&input_wait);
+		if (type == FROOTSPI_EV_PUSHSW) {
+			frootspi_gesture_report(code, value, now);
+		}
+	}
+	return changed;
+}
+
+// 誰も開いていなくても読み続けるか
+static bool input_idle_sampling(void)
+{
+	return frootspi_gesture_enabled() || dipsw_poll_ms > 0 ||
+	       frootspi_record_enabled();
+}
+
+static bool input_keep_sampling(void)
+{
+	return READ_ONCE(num_clients) > 0 || input_idle_sampling();
+}
+
+// /sys/class/frootspi/<name><code>/value をpoll()しているプロセスを起こす
+static void input_notify(const unsigned short type, const unsigned short code)
+{
+	frootspi_chardev_notify(type == FROOTSPI_EV_DIPSW ? "frootspi_dipsw" :
+							    "frootspi_pushsw",
+		code, "value");
+}
+
+static void input_sample(struct work_struct *work)
+{
+	void *expander = NULL;
+	unsigned char pins[INPUT_MAX_CODES * 2];
+	unsigned char codes[INPUT_MAX_CODES * 2];
+	int values[INPUT_MAX_CODES * 2];
+	// 値が変わったスイッチ (sysfs_notify()はテーブルのロックを外してから呼ぶ)
+	unsigned short changed_types[INPUT_MAX_CODES * 3];
+	unsigned short changed_codes[INPUT_MAX_CODES * 3];
+	int num_changed = 0;
+	const ktime_t started = ktime_get();
+	int num_pins;
+
+	// デバイスファイルの登録・削除と排他制御して、バックエンドを使う
+	frootspi_chardev_table_lock();
+
+	// MCP23S08のプッシュスイッチとDIPスイッチをまとめて読む
+	// チップごとに1回のSPI通信で済む
+	// DIPスイッチはめったに変わらないので、クライアントがいなければ
+	// dipsw_poll_msごとに読む
+	const int num_pushsw = frootspi_chardev_collect_locked(
+		FROOTSPI_PUSHSW, &expander, pins, codes, INPUT_MAX_CODES);
+	num_pins = num_pushsw;
+	const bool dipsw_due = dipsw_poll_ms > 0 &&
+			       ktime_ms_delta(started, last_dipsw_sample) >=
+				       dipsw_poll_ms;
+	// 記録している間は、DIPスイッチの変化も記録できるよう毎回読む
+	if (READ_ONCE(num_clients) > 0 || frootspi_record_enabled() ||
+		dipsw_due) {
+		last_dipsw_sample = started;
+		num_pins += frootspi_chardev_collect_locked(FROOTSPI_DIPSW,
+			&expander, &pins[num_pushsw], &codes[num_pushsw],
+			INPUT_MAX_CODES);
+	}
+	// 記録を再生している間は、読んでも配らないのでSPI通信しない
+	if (num_pins > 0 && !frootspi_record_replaying() &&
+		mcp23s08_read_gpios(expander, pins, num_pins, values) == 0) {
+		for (int i = 0; i < num_pins; i++) {
+			const unsigned short type = i < num_pushsw ?
+							    FROOTSPI_EV_PUSHSW :
+							    FROOTSPI_EV_DIPSW;
+			if (input_report(type, codes[i], values[i], started,
+				    false)) {
+				changed_types[num_changed] = type;
+				changed_codes[num_changed++] = codes[i];
+			}
+		}
+	}
+
+	// SDスイッチはラズパイのGPIOなので、バスの通信はない
+	// 割り込みを使っている場合は確定した値を読むだけで、変化は割り込みから届く
+	const int num_sdsw = frootspi_chardev_collect_locked(
+		FROOTSPI_SDSW, NULL, pins, codes, INPUT_MAX_CODES);
+	for (int i = 0; i < num_sdsw; i++) {
+		if (input_report(FROOTSPI_EV_PUSHSW, codes[i],
+			    frootspi_sdsw_get_value(), started, false)) {
+			changed_types[num_changed] = FROOTSPI_EV_PUSHSW;
+			changed_codes[num_changed++] = codes[i];
+		}
+	}
+
+	frootspi_chardev_table_unlock();
+
+	for (int i = 0; i < num_changed; i++) {
+		input_notify(changed_types[i], changed_codes[i]);
+	}
+
+	atomic64_inc(&stats.samples);
+	frootspi_hist_add(&sample_hist, ktime_sub(ktime_get(), started));
+
+	// 誰も使っていなければ止まる
+	// (記録をやめたときなど) 止まった後に古い値を配らないよう、値を消す
+	if (input_keep_sampling()) {
+		schedule_delayed_work(
+			&input_sample_work, msecs_to_jiffies(input_poll_ms));
+	} else {
+		spin_lock(&input_lock);
+		memset(input_state, -1, sizeof(input_state));
+		spin_unlock(&input_lock);
+	}
+}
+
+// 割り込みなどで確定した値の変化を、スイッチを読む周期を待たずに配る
+// nowは変化を検出した時刻
+void frootspi_input_report_event(const unsigned short type,
+	const unsigned short code, const int value, const ktime_t now)
+{
+	bool changed = false;
+
+	mutex_lock(&input_ready_lock);
+	if (input_ready) {
+		changed = input_report(type, code, value, now, false);
+	}
+	mutex_unlock(&input_ready_lock);
+
+	if (changed) {
+		input_notify(type, code);
+	}
+}
+
+// 記録したイベントを再生する (frootspi_record.cの再生スレッドから呼ぶ)
+// スイッチを読んだときと同じように配り、ジェスチャも判定する
+void frootspi_input_replay_event(const unsigned short type,
+	const unsigned short code, const int value, const ktime_t now)
+{
+	bool changed = false;
+
+	mutex_lock(&input_ready_lock);
+	if (input_ready) {
+		changed = input_report(type, code, value, now, true);
+	}
+	mutex_unlock(&input_ready_lock);
+
+	if (changed) {
+		input_notify(type, code);
+	}
+}
+
+// 再生を終えるときに、再生した値を消す
+// この後に読んだスイッチの値は、変化したものとして配られる
+void frootspi_input_replay_reset(void)
+{
+	spin_lock(&input_lock);
+	memset(input_state, -1, sizeof(input_state));
+	spin_unlock(&input_lock);
+}
+
+// 記録を再生している間は、再生した値を返す
+// /dev/frootspi_{pushsw,dipsw}* の読み出しに使い、SPI通信しない
+// 再生していないか、まだ再生していないスイッチなら-ENODATAを返す
+int frootspi_input_replay_value(
+	const unsigned short type, const unsigned short code)
+{
+	int value = -ENODATA;
+
+	if (type >= INPUT_NUM_TYPES || code >= INPUT_MAX_CODES ||
+		!frootspi_record_replaying()) {
+		return -ENODATA;
+	}
+	spin_lock(&input_lock);
+	if (input_state[type][code] >= 0) {
+		value = input_state[type][code];
+	}
+	spin_unlock(&input_lock);
+	return value;
+}
+
+// サンプラーが読み続けている間は、最後に読んだ値を返す
+// 値はinput_poll_ms(DIPスイッチは誰も開いていなければdipsw_poll_ms)より古くならない
+// 読み続けていないか、まだ読んでいなければ-EAGAINを返す
+int frootspi_input_cached_value(
+	const unsigned short type, const unsigned short code)
+{
+	int value = -EAGAIN;
+
+	if (type >= INPUT_NUM_TYPES || code >= INPUT_MAX_CODES ||
+		!READ_ONCE(input_ready) || !input_keep_sampling()) {
+		return -EAGAIN;
+	}
+	// DIPスイッチはジェスチャのためだけに読み続けているときは読まない
+	if (type == FROOTSPI_EV_DIPSW && READ_ONCE(num_clients) == 0 &&
+		dipsw_poll_ms == 0) {
+		return -EAGAIN;
+	}
+	spin_lock(&input_lock);
+	if (input_state[type][code] >= 0) {
+		value = input_state[type][code];
+	}
+	spin_unlock(&input_lock);
+	return value;
+}
+
+// 割り込みなどで値の変化がわかったときに、次の周期を待たずに読む
+void frootspi_input_kick(void)
+{
+	if (input_keep_sampling()) {
+		mod_delayed_work(system_wq, &input_sample_work, 0);
+	}
+}
+
+// 記録を始めたときに、その時点で読んでいる全スイッチの値を記録する
+void frootspi_input_record_state(void)
+{
+	const ktime_t now = ktime_get();
+
+	spin_lock(&input_lock);
+	for (int type = FROOTSPI_EV_PUSHSW; type < INPUT_NUM_TYPES; type++) {
+		for (int code = 0; code < INPUT_MAX_CODES; code++) {
+			if (input_state[type][code] < 0) {
+				continue;
+			}
+			const struct frootspi_input_event ev = {
+				.time_ns = ktime_to_ns(now),
+				.type = type,
+				.code = code,
+				.value = input_state[type][code],
+			};
+			frootspi_record_event(&ev);
+		}
+	}
+	spin_unlock(&input_lock);
+
+	frootspi_input_kick();
+}
+
+static bool input_has_events(struct input_client *client)
+{
+	return !kfifo_is_empty(&client->fifo) || READ_ONCE(client->dropped);
+}
+
+static int input_open(struct inode *inode, struct file *filep)
+{
+	struct input_client *client;
+	int retval = frootspi_chardev_open(inode, filep);
+	if (retval) {
+		return retval;
+	}
+
+	client = kzalloc(sizeof(struct input_client), GFP_KERNEL);
+	if (client == NULL) {
+		retval = -ENOMEM;
+		goto failed_alloc;
+	}
+	client->chardev = filep->private_data;
+	retval = kfifo_alloc(&client->fifo,
+		max_t(unsigned int, input_queue_len, INPUT_MIN_QUEUE_LEN),
+		GFP_KERNEL);
+	if (retval) {
+		goto failed_kfifo_alloc;
+	}
+
+	mutex_lock(&input_open_lock);
+	spin_lock(&input_lock);
+	// サンプリング中なら、新しいクライアントには現在の値を先に渡す
+	input_queue_snapshot_locked(client, ktime_get());
+	list_add_tail(&client->node, &input_clients);
+	spin_unlock(&input_lock);
+	// 既に読み続けていれば、すぐに次の周期を始めてDIPスイッチも読む
+	if (num_clients++ == 0) {
+		mod_delayed_work(system_wq, &input_sample_work, 0);
+	}
+	mutex_unlock(&input_open_lock);
+
+	filep->private_data = client;
+	return 0;
+
+failed_kfifo_alloc:
+	kfree(client);
+failed_alloc:
+	frootspi_chardev_release(inode, filep);
+	return retval;
+}
+
+static int input_release(struct inode *inode, struct file *filep)
+{
+	struct input_client *client = filep->private_data;
+
+	mutex_lock(&input_open_lock);
+	spin_lock(&input_lock);
+	list_del(&client->node);
+	spin_unlock(&input_lock);
+	if (--num_clients == 0) {
+		// 誰も読んでいない間はSPI通信しない
+		// 読まなくなったスイッチは、次に開かれたときの
+		// 最初の読み出しで値を配る
+		if (!input_idle_sampling()) {
+			cancel_delayed_work_sync(&input_sample_work);
+			spin_lock(&input_lock);
+			memset(input_state, -1, sizeof(input_state));
+			spin_unlock(&input_lock);
+		} else if (dipsw_poll_ms == 0 && !frootspi_record_enabled()) {
+			spin_lock(&input_lock);
+			memset(input_state[FROOTSPI_EV_DIPSW], -1,
+				sizeof(input_state[FROOTSPI_EV_DIPSW]));
+			spin_unlock(&input_lock);
+		}
+	}
+	mutex_unlock(&input_open_lock);
+
+	filep->private_data = client->chardev;
+	kfifo_free(&client->fifo);
+	kfree(client);
+	return frootspi_chardev_release(inode, filep);
+}
+
+// キューのイベントをtoにコピーし、コピーしたバイト数を返す
+static ssize_t input_copy_events(
+	struct input_client *client, struct iov_iter *to, const size_t count)
+{
+	struct frootspi_input_event events[INPUT_READ_BATCH];
+	const size_t event_size = sizeof(struct frootspi_input_event);
+	size_t copied = 0;
+
+	while (copied + event_size <= count) {
+		const unsigned int max = min_t(size_t,
+			(count - copied) / event_size, INPUT_READ_BATCH);
+		spin_lock(&input_lock);
+		unsigned int n = kfifo_out(&client->fifo, events, max);
+		// キューを読み切ってから取りこぼしを伝え、
+		// 続けて全スイッチの現在の値を入れ直す
+		if (n < max && client->dropped) {
+			const ktime_t now = ktime_get();
+			events[n].time_ns = ktime_to_ns(now);
+			events[n].type = FROOTSPI_EV_DROPPED;
+			events[n].code = 0;
+			events[n].value = client->dropped;
+			n++;
+			client->dropped = 0;
+			input_queue_snapshot_locked(client, now);
+		}
+		spin_unlock(&input_lock);
+		if (n == 0) {
+			break;
+		}
+
+		if (copy_to_iter(events, n * event_size, to) !=
+			n * event_size) {
+			printk(KERN_ERR "%s %s: copy_to_iter() failed.\n",
+				INPUT_DEVICE_NAME, __func__);
+			return copied ? copied : -EFAULT;
+		}
+		copied += n * event_size;
+	}
+	return copied;
+}
+
+// struct frootspi_input_event の整数倍の長さだけ読み出す
+// キューが空ならイベントが来るまで待つ (O_NONBLOCK、IOCB_NOWAITなら-EAGAIN)
+// readv()やio_uringで複数のバッファを渡されても、イベントの途中では区切らない
+static ssize_t input_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct input_client *client = iocb->ki_filp->private_data;
+	const size_t count = iov_iter_count(to);
+	ssize_t copied = 0;
+
+	atomic64_inc(&client->chardev->stats.reads);
+	if (count < sizeof(struct frootspi_input_event)) {
+		return -EINVAL;
+	}
+
+	// 同じファイルを複数のスレッドで読んでいると、起きたときには
+	// 他のスレッドに読まれて空になっていることがあるので、待ち直す
+	while (copied == 0) {
+		if (!input_has_events(client)) {
+			if (frootspi_chardev_nowait(iocb)) {
+				return -EAGAIN;
+			}
+			if (wait_event_interruptible(
+				    input_wait, input_has_events(client))) {
+				return -ERESTARTSYS;
+			}
+		}
+		copied = input_copy_events(client, to, count);
+	}
+
+	return copied;
+}
+
+static __poll_t input_poll(struct file *filep, poll_table *wait)
+{
+	struct input_client *client = filep->private_data;
+
+	poll_wait(filep, &input_wait, wait);
+	return input_has_events(client) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+// frootspi_chardev.cのテーブルから参照される
+struct file_operations input_fops = {
+	.open = input_open,
+	.release = input_release,
+	.read_iter = input_read_iter,
+	.poll = input_poll,
+};
+
+// スイッチのイベントを配るデバイスファイルを作る
+// スイッチのバックエンドはサンプリングのたびにデバイスファイルのテーブルから探すので、
+// エキスパンダより先に登録しても良い
+int register_input_dev(void)
+{
+	memset(input_state, -1, sizeof(input_state));
+	frootspi_gesture_init();
+
+	input_debugfs_dir = debugfs_create_dir("input", frootspi_debugfs_root);
+	frootspi_debugfs_create_counter(
+		"samples", input_debugfs_dir, &stats.samples);
+	frootspi_debugfs_create_counter(
+		"events", input_debugfs_dir, &stats.events);
+	frootspi_debugfs_create_counter(
+		"dropped", input_debugfs_dir, &stats.dropped);
+	frootspi_debugfs_create_hist(
+		"sample_latency", input_debugfs_dir, &sample_hist);
+	debugfs_create_u32("clients", 0444, input_debugfs_dir, &num_clients);
+
+	int retval = frootspi_record_init(input_debugfs_dir);
+	if (retval) {
+		goto failed_record_init;
+	}
+	retval = frootspi_chardev_attach(FROOTSPI_INPUT, NULL, NULL, 0);
+	if (retval) {
+		goto failed_chardev_attach;
+	}
+
+	mutex_lock(&input_ready_lock);
+	input_ready = true;
+	mutex_unlock(&input_ready_lock);
+
+	// ジェスチャやsysfsのために、誰も開いていなくても読み始める
+	if (input_idle_sampling()) {
+		schedule_delayed_work(&input_sample_work, 0);
+	}
+	return 0;
+
+failed_chardev_attach:
+	frootspi_record_exit();
+	// input_recordで記録を始めていれば、サンプラーが動いている
+	cancel_delayed_work_sync(&input_sample_work);
+failed_record_init:
+	debugfs_remove_recursive(input_debugfs_dir);
+	return retval;
+}
+
+void unregister_input_dev(void)
+{
+	mutex_lock(&input_ready_lock);
+	input_ready = false;
+	mutex_unlock(&input_ready_lock);
+	frootspi_chardev_detach(FROOTSPI_INPUT);
+	// 再生スレッドを止めてから、サンプラーを止める
+	frootspi_record_exit();
+	cancel_delayed_work_sync(&input_sample_work);
+	frootspi_gesture_exit();
+	debugfs_remove_recursive(input_debugfs_dir);
+}
@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef FROOTSPI_INPUT_H
+#define FROOTSPI_INPUT_H
+
+// ユーザ空間のプログラムからもincludeできるよう、linux/types.hだけを使う
+#include <linux/types.h> // __s64, __u16
+
+// /dev/frootspi_input0 から読み出すイベント
+// read()はこの構造体の整数倍の長さを返す
+struct frootspi_input_event {
+	__s64 time_ns; // 値の変化を検出した時刻 (CLOCK_MONOTONIC)
+	__u16 type;    // FROOTSPI_EV_*
+	__u16 code;    // デバイスファイルの番号 (/dev/frootspi_pushsw<code>など)
+	// スイッチの値 (負論理なので押されたら0)
+	// FROOTSPI_EV_DROPPEDのときは取りこぼしたイベントの数
+	__s32 value;
+};
+
+// キューが溢れてイベントを取りこぼした
+// この後に全てのスイッチの現在の値が続くので、状態を取り直すこと
+#define FROOTSPI_EV_DROPPED 0
+#define FROOTSPI_EV_PUSHSW 1 // /dev/frootspi_pushsw<code> (SDスイッチを含む)
+#define FROOTSPI_EV_DIPSW 2  // /dev/frootspi_dipsw<code>
+
+#endif
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <kunit/test.h> // KUNIT_EXPECT_*()
+
+#include "mcp23s08_driver.h"
+
+// ソフトウェアのMCP23S08(mock_mcp23s08=1)に対して、プッシュスイッチ、
+// ディップスイッチ、LEDを操作し、値と操作1回あたりのSPI転送数を確かめる
+// insmod frootspi.ko mock_mcp23s08=1 で読み込むと実行される
+// バックグラウンドのサンプリング(pushsw_gestures、input_record、dipsw_poll_ms)は
+// 転送数に混ざるので、無効のまま実行すること
+
+#define FROOTSPI_KUNIT_ITERATIONS 100
+
+// 操作1回あたりの転送数の上限
+// スイッチの読み出しは1回のSPI転送、LEDの書き込みは非同期に1回(まとめられれば減る)
+#define FROOTSPI_KUNIT_MAX_PUSHSW_TRANSFERS 1
+#define FROOTSPI_KUNIT_MAX_DIPSW_TRANSFERS 1
+#define FROOTSPI_KUNIT_MAX_LED_TRANSFERS 1
+
+// FrootsPi基板のデフォルトのピン割当 (アドレス0)
+#define FROOTSPI_KUNIT_ADDR 0
+#define FROOTSPI_KUNIT_PUSHSW0_PIN \
+	MCP23S08_PIN(FROOTSPI_KUNIT_ADDR, MCP23S08_GPIO_PUSHSW0)
+#define FROOTSPI_KUNIT_DIPSW0_PIN \
+	MCP23S08_PIN(FROOTSPI_KUNIT_ADDR, MCP23S08_GPIO_DIPSW0)
+#define FROOTSPI_KUNIT_LED_PIN \
+	MCP23S08_PIN(FROOTSPI_KUNIT_ADDR, MCP23S08_GPIO_LED)
+
+// 入力は全て離した状態(スイッチは負論理なので1)
+#define FROOTSPI_KUNIT_INPUTS_IDLE 0xff
+
+extern struct mcp23s08_drvdata *mcp23s08_mock_drvdata(void);
+extern u64 mcp23s08_mock_transfers(void);
+extern int mcp23s08_mock_set_inputs(const int addr, const unsigned char inputs);
+extern int mcp23s08_mock_olat(const int addr);
+
+static int frootspi_kunit_init(struct kunit *test)
+{
+	struct mcp23s08_drvdata *data = mcp23s08_mock_drvdata();
+	if (data == NULL) {
+		kunit_skip(test, "load the driver with mock_mcp23s08=1");
+	}
+	test->priv = data;
+	return mcp23s08_mock_set_inputs(
+		FROOTSPI_KUNIT_ADDR, FROOTSPI_KUNIT_INPUTS_IDLE);
+}
+
+static void frootspi_kunit_exit(struct kunit *test)
+{
+	mcp23s08_mock_set_inputs(
+		FROOTSPI_KUNIT_ADDR, FROOTSPI_KUNIT_INPUTS_IDLE);
+}
+
+// pinをFROOTSPI_KUNIT_ITERATIONS回読み、全てexpectedであることと、
+// 転送数が上限を超えないことを確かめる
+static void frootspi_kunit_read_switch(struct kunit *test,
+	const unsigned char pin, const int expected, const int max_transfers)
+{
+	struct mcp23s08_drvdata *data = test->priv;
+	const u64 before = mcp23s08_mock_transfers();
+
+	for (int i = 0; i < FROOTSPI_KUNIT_ITERATIONS; i++) {
+		KUNIT_EXPECT_EQ(test, mcp23s08_read_gpio(data, pin), expected);
+	}
+	const u64 transfers = mcp23s08_mock_transfers() - before;
+	KUNIT_EXPECT_LE(test, transfers,
+		(u64)FROOTSPI_KUNIT_ITERATIONS * max_transfers);
+}
+
+// プッシュスイッチ0を押した状態と離した状態で読む
+static void frootspi_kunit_pushsw(struct kunit *test)
+{
+	KUNIT_ASSERT_EQ(test, mcp23s08_mock_set_inputs(FROOTSPI_KUNIT_ADDR,
+			FROOTSPI_KUNIT_INPUTS_IDLE &
+			~(1 << MCP23S08_GPIO_PUSHSW0)), 0);
+	frootspi_kunit_read_switch(test, FROOTSPI_KUNIT_PUSHSW0_PIN, 0,
+		FROOTSPI_KUNIT_MAX_PUSHSW_TRANSFERS);
+
+	KUNIT_ASSERT_EQ(test, mcp23s08_mock_set_inputs(FROOTSPI_KUNIT_ADDR,
+			FROOTSPI_KUNIT_INPUTS_IDLE), 0);
+	frootspi_kunit_read_switch(test, FROOTSPI_KUNIT_PUSHSW0_PIN, 1,
+		FROOTSPI_KUNIT_MAX_PUSHSW_TRANSFERS);
+}
+
+// ディップスイッチ0をONとOFFにして読む
+static void frootspi_kunit_dipsw(struct kunit *test)
+{
+	KUNIT_ASSERT_EQ(test, mcp23s08_mock_set_inputs(FROOTSPI_KUNIT_ADDR,
+			FROOTSPI_KUNIT_INPUTS_IDLE &
+			~(1 << MCP23S08_GPIO_DIPSW0)), 0);
+	frootspi_kunit_read_switch(test, FROOTSPI_KUNIT_DIPSW0_PIN, 0,
+		FROOTSPI_KUNIT_MAX_DIPSW_TRANSFERS);
+
+	KUNIT_ASSERT_EQ(test, mcp23s08_mock_set_inputs(FROOTSPI_KUNIT_ADDR,
+			FROOTSPI_KUNIT_INPUTS_IDLE), 0);
+	frootspi_kunit_read_switch(test, FROOTSPI_KUNIT_DIPSW0_PIN, 1,
+		FROOTSPI_KUNIT_MAX_DIPSW_TRANSFERS);
+}
+
+// LEDを交互に点灯・消灯し、フェンスの後に出力ラッチを確かめる
+static void frootspi_kunit_led(struct kunit *test)
+{
+	struct mcp23s08_drvdata *data = test->priv;
+	const int last = (FROOTSPI_KUNIT_ITERATIONS - 1) % 2;
+	const u64 before = mcp23s08_mock_transfers();
+
+	for (int i = 0; i < FROOTSPI_KUNIT_ITERATIONS; i++) {
+		KUNIT_EXPECT_EQ(test,
+			mcp23s08_write_gpio(data, FROOTSPI_KUNIT_LED_PIN,
+				i % 2, false),
+			0);
+	}
+	KUNIT_EXPECT_EQ(test, mcp23s08_fence(data), 0);
+	const u64 transfers = mcp23s08_mock_transfers() - before;
+	KUNIT_EXPECT_LE(test, transfers,
+		(u64)FROOTSPI_KUNIT_ITERATIONS *
+			FROOTSPI_KUNIT_MAX_LED_TRANSFERS);
+
+	const int olat = mcp23s08_mock_olat(FROOTSPI_KUNIT_ADDR);
+	KUNIT_ASSERT_GE(test, olat, 0);
+	KUNIT_EXPECT_EQ(test, olat >> MCP23S08_GPIO_LED & 1, last);
+}
+
+static struct kunit_case frootspi_kunit_cases[] = {
+	KUNIT_CASE(frootspi_kunit_pushsw),
+	KUNIT_CASE(frootspi_kunit_dipsw),
+	KUNIT_CASE(frootspi_kunit_led),
+	{},
+};
+
+static struct kunit_suite frootspi_kunit_suite = {
+	.name = "frootspi_mcp23s08",
+	.init = frootspi_kunit_init,
+	.exit = frootspi_kunit_exit,
+	.test_cases = frootspi_kunit_cases,
+};
+kunit_test_suites(&frootspi_kunit_suite);
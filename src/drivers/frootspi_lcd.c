@@ -4,17 +4,68 @@
 #include <linux/delay.h>   // usleep();
 #include <linux/fs.h>	   // struct file, open, release
 #include <linux/i2c.h>	   // i2c_*()
+#include <linux/ktime.h>   // ktime_get()
+#include <linux/mod_devicetable.h> // struct of_device_id
 #include <linux/module.h>  // MODULE_DEVICE_TABLE()
-#include <linux/uaccess.h> // copy_to_user()
+#include <linux/uio.h>	   // struct iov_iter
+
+#include "frootspi_chardev.h"
+#include "frootspi_debugfs.h"
+#include "frootspi_fault.h"
+#include "frootspi_retry.h"
+#include "frootspi_selftest.h"
+#include "frootspi_trace.h"
 
 #define I2C_DRIVER_NAME "frootspi_aqm0802a_driver"
 #define WAIT_TIME_USEC_MIN 27
 #define WAIT_TIME_USEC_MAX 100
-#define LCD_BASE_MINOR 0
-#define LCD_MAX_MINORS 1
 #define LCD_DEVICE_NAME "frootspi_lcd"
+// 1回のwrite()で受け付ける最大のバイト数
+#define LCD_MAX_TEXT_LEN 252
+// i2c_smbus_write_byte_data()1回のビット数 (アドレス、コントロール、データ)
+// 各バイトは8ビットとACKの9クロック
+#define AQM0802A_BITS_PER_WRITE (3 * 9)
+
+// I2Cの書き込みが失敗したときのリトライ (mcp23s08_driver.cのspi_retry_*と同じ)
+static unsigned int i2c_retry_deadline_us = 2000;
+module_param(i2c_retry_deadline_us, uint, 0644);
+MODULE_PARM_DESC(i2c_retry_deadline_us, "Give up retrying an AQM0802A write "
+					"after this many us (default 2000, "
+					"0 = no retry)");
+
+static unsigned int i2c_retry_backoff_us = 50;
+module_param(i2c_retry_backoff_us, uint, 0644);
+MODULE_PARM_DESC(i2c_retry_backoff_us, "First AQM0802A retry backoff in us "
+				       "(default 50)");
+
+static unsigned int i2c_retry_backoff_max_us = 500;
+module_param(i2c_retry_backoff_max_us, uint, 0644);
+MODULE_PARM_DESC(i2c_retry_backoff_max_us, "AQM0802A retry backoff cap in us "
+					   "(default 500)");
+
+// リトライしても失敗した書き込みがこの回数続いたら、LCDを初期化し直して
+// 最後の画面を書き直す
+static unsigned int i2c_reinit_threshold = 3;
+module_param(i2c_reinit_threshold, uint, 0644);
+MODULE_PARM_DESC(i2c_reinit_threshold, "Re-initialize the AQM0802A after this "
+				       "many failed writes in a row "
+				       "(default 3, 0 = never)");
+
+// probe()時に画面の書き換えを繰り返し、レイテンシを計測する回数
+// 結果は/sys/bus/i2c/devices/<デバイス>/selftest/に公開する (0なら計測しない)
+static unsigned int selftest_lcd_frames;
+module_param(selftest_lcd_frames, uint, 0444);
+MODULE_PARM_DESC(selftest_lcd_frames, "AQM0802A screen refreshes timed at "
+				      "probe (default 0 = off)");
 
 // ---------- I2Cドライバ用 ----------
+// デバイスツリーのcompatibleと対応するデバイスドライバを探すテーブル
+static const struct of_device_id aqm0802a_of_match[] = {
+	{.compatible = "frootspi,aqm0802a"},
+	{},
+};
+MODULE_DEVICE_TABLE(of, aqm0802a_of_match);
+
 // デバイスを識別するテーブル { "name", "好きなデータ"}を追加する
 // カーネルはこの"name"をもとに対応するデバイスドライバを探す
 static struct i2c_device_id aqm0802a_id_table[] = {
@@ -23,172 +74,197 @@ static struct i2c_device_id aqm0802a_id_table[] = {
 };
 MODULE_DEVICE_TABLE(i2c, aqm0802a_id_table);
 
-// I2Cドライバの設定に使われる構造体
-static struct i2c_board_info aqm0802a_info = {I2C_BOARD_INFO("aqm0802a", 0x3e)};
-
-// I2Cクライアント
-// 生成・削除するためにグローバル変数として記憶する
-static struct i2c_client *aqm0802a_client = NULL;
-
 // ---------- I2Cドライバ、キャラクタデバイス共用 ----------
+// 通信の統計 (/sys/kernel/debug/frootspi/aqm0802a/)
+struct aqm0802a_stats {
+	atomic64_t bytes;
+	atomic64_t frames;
+	atomic64_t errors; // I2C書き込みの失敗 (リトライを含む)
+	atomic64_t retries;
+	atomic64_t failures; // リトライしても失敗した書き込み
+	atomic64_t reinits;  // LCDを初期化し直した回数
+	atomic64_t i2c_write_ns; // I2C書き込みにかかった時間の累計
+};
+
 struct lcd_device_info {
 	// ここはある程度自由に定義できる
-	struct cdev cdev;
-	struct class *device_class;
-	unsigned int device_major;
-	unsigned int device_minor;
 	struct i2c_client *client;
 	struct mutex my_mutex;
+	// レイテンシ計測用 (/sys/kernel/debug/frootspi/aqm0802a/)
+	struct dentry *debugfs_dir;
+	struct frootspi_hist xfer_hist;
+	struct aqm0802a_stats stats;
+	// /sys/kernel/debug/frootspi/aqm0802a/fail_*/
+	struct frootspi_fault fault;
+	struct frootspi_selftest *selftest; // 自己診断しなければNULL
+	// 最後に書き込もうとした画面 (my_mutexで保護)
+	// 初期化し直した後に書き直す
+	char screen[LCD_MAX_TEXT_LEN + 3];
+	// リトライしても失敗した書き込みが続いた数
+	// i2c_reinit_thresholdに達したらreinit_workで初期化し直す
+	atomic_t consecutive_failures;
+	bool reinit_enabled; // probe()が終わってから、remove()まで
+	bool reinit_running;
+	struct work_struct reinit_work;
 };
 
+extern void frootspi_report_init_time(
+	const char *name, const ktime_t started, const int retval);
+
 // キャラクタデバイスで使うAQM0802Aの関数は前方宣言する
 static int aqm0802a_write_lines(struct i2c_client *client, char *text);
 
-static int lcd_open(struct inode *inode, struct file *filep)
+// 1回のwrite()を1画面として書き込む
+// 書き込み中は他の書き込みを待たせるので、画面に混ざらない
+static ssize_t lcd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+	struct frootspi_chardev *chardev = iocb->ki_filp->private_data;
 	struct lcd_device_info *dev_info;
-	// container_of(メンバーへのポインタ, 構造体の型, 構造体メンバの名前)
-	dev_info = container_of(inode->i_cdev, struct lcd_device_info, cdev);
+	struct i2c_client *client;
+	const size_t count = iov_iter_count(from);
+	const bool nowait = frootspi_chardev_nowait(iocb);
 
-	if (dev_info == NULL || dev_info->client == NULL) {
-		printk(KERN_ERR
-			"%s %s: dev_info or dev_info->client is NULL.\n",
-			LCD_DEVICE_NAME, __func__);
-	}
+	// 3バイト文字の途中で終わっても終端より先を読まないよう、余裕を持たせる
+	// 初期化しないと文字化けする
+	unsigned char text_buffer[LCD_MAX_TEXT_LEN + 3] = {0};
 
-	// ここに何かしらのエラー処理がいるかも
+	atomic64_inc(&chardev->stats.writes);
+	if (count == 0) {
+		return 0;
+	}
+	// 途中で切ると別の画面になってしまうので、入り切らなければ書き込まない
+	if (count > LCD_MAX_TEXT_LEN) {
+		return -EINVAL;
+	}
 
-	dev_info->device_minor = MINOR(inode->i_rdev);
-	filep->private_data = dev_info;
+	// 書いている間にLCDが取り除かれないようにする
+	ssize_t retval = frootspi_chardev_get_backend(chardev, nowait);
+	if (retval) {
+		return retval;
+	}
+	dev_info = chardev->backend;
+	client = dev_info->client;
+
+	// 他の書き込みが終わるのを待つ (O_NONBLOCK、IOCB_NOWAITなら-EAGAIN)
+	if (nowait) {
+		if (!mutex_trylock(&dev_info->my_mutex)) {
+			retval = -EAGAIN;
+			goto out;
+		}
+	} else if (mutex_lock_interruptible(&dev_info->my_mutex)) {
+		retval = -ERESTARTSYS;
+		goto out;
+	}
 
-	printk(KERN_DEBUG "%s %s: lcd device opend.\n", LCD_DEVICE_NAME,
-		__func__);
-	return 0;
+	retval = count;
+	if (copy_from_iter(text_buffer, count, from) != count) {
+		printk(KERN_ERR "%s %s: copy_from_iter() failed.\n",
+			LCD_DEVICE_NAME, __func__);
+		retval = -EFAULT;
+	} else {
+		memcpy(dev_info->screen, text_buffer, sizeof(text_buffer));
+		// リトライしても書き込めなければ、画面は途中まで
+		if (aqm0802a_write_lines(client, text_buffer)) {
+			retval = -EIO;
+		}
+	}
+	mutex_unlock(&dev_info->my_mutex);
+out:
+	frootspi_chardev_put_backend(chardev);
+	return retval;
 }
 
-static int lcd_release(struct inode *inode, struct file *filep)
-{
-	// デバイスによっては何もしなかったりする
-	// kfree(filep->private_data);
-	printk(KERN_DEBUG "%s %s: lcd device closed.\n", LCD_DEVICE_NAME,
-		__func__);
+// frootspi_chardev.cのテーブルから参照される
+struct file_operations lcd_fops = {
+	.open = frootspi_chardev_open,
+	.release = frootspi_chardev_release,
+	.write_iter = lcd_write_iter,
+};
 
-	return 0;
-}
+#define CONTROL_COMMAND_BYTE 0x00
+#define CONTROL_DATA_BYTE 0x40
 
-static ssize_t lcd_write(
-	struct file *filep, const char __user *buf, size_t count, loff_t *f_pos)
+// 書き込みの結果を数え、失敗が続いたらLCDの初期化し直しを予約する
+static void aqm0802a_count_result(
+	struct lcd_device_info *dev_info, const int retval)
 {
-	struct lcd_device_info *dev_info = filep->private_data;
-	struct i2c_client *client = dev_info->client;
-
-	unsigned char text_buffer[255] = {0}; // 初期化しないと文字化けする
-
-	if (copy_from_user(text_buffer, buf, count) != 0) {
-		printk(KERN_ERR "%s %s: copy_from_user() failed.\n",
-			LCD_DEVICE_NAME, __func__);
-		return -1;
+	if (retval == 0) {
+		atomic_set(&dev_info->consecutive_failures, 0);
+		return;
+	}
+	atomic64_inc(&dev_info->stats.failures);
+	// 初期化し直している最中の失敗で、もう一度予約しない
+	if (!READ_ONCE(dev_info->reinit_enabled) ||
+		READ_ONCE(dev_info->reinit_running)) {
+		return;
+	}
+	const unsigned int threshold = READ_ONCE(i2c_reinit_threshold);
+	if (threshold > 0 &&
+		atomic_inc_return(&dev_info->consecutive_failures) >=
+			threshold) {
+		atomic_set(&dev_info->consecutive_failures, 0);
+		schedule_work(&dev_info->reinit_work);
 	}
-
-	// 1行書き込む
-	aqm0802a_write_lines(client, text_buffer);
-
-	return count;
 }
 
-static struct file_operations lcd_fops = {
-	.open = lcd_open,
-	.release = lcd_release,
-	.write = lcd_write,
-};
-
-static int register_lcd_dev(struct lcd_device_info *dev_info)
+// コントロールバイトとデータの2バイトを書き込む
+// 失敗したら、i2c_retry_deadline_usまでリトライする
+static int aqm0802a_write_byte_data(struct i2c_client *client,
+	const unsigned char control, const unsigned char data)
 {
+	struct lcd_device_info *dev_info = i2c_get_clientdata(client);
+	struct frootspi_retry retry;
 	int retval;
-	dev_t dev;
 
-	// 動的にメジャー番号を確保する
-	retval = alloc_chrdev_region(
-		&dev, LCD_BASE_MINOR, LCD_MAX_MINORS, LCD_DEVICE_NAME);
-	if (retval < 0) {
-		// 確保できなかったらエラーを返して終了
-		printk(KERN_ERR "%s %s: unable to allocate device number\n",
-			LCD_DEVICE_NAME, __func__);
-		return retval;
+	frootspi_retry_start(&retry, READ_ONCE(i2c_retry_deadline_us),
+		READ_ONCE(i2c_retry_backoff_us),
+		READ_ONCE(i2c_retry_backoff_max_us));
+	for (;;) {
+		unsigned char value = data;
+		frootspi_fault_corrupt(&dev_info->fault, &value, 1);
+		ktime_t xfer_started = ktime_get();
+		retval = frootspi_fault_inject(&dev_info->fault, 2);
+		if (retval == 0) {
+			retval = i2c_smbus_write_byte_data(
+				client, control, value);
+		}
+		ktime_t xfer = ktime_sub(ktime_get(), xfer_started);
+		frootspi_hist_add(&dev_info->xfer_hist, xfer);
+		atomic64_add(ktime_to_ns(xfer), &dev_info->stats.i2c_write_ns);
+		if (control == CONTROL_COMMAND_BYTE) {
+			trace_frootspi_aqm0802a_command(
+				value, retval, ktime_to_ns(xfer));
+		} else {
+			trace_frootspi_aqm0802a_data(
+				value, retval, ktime_to_ns(xfer));
+		}
+		if (retval == 0) {
+			break;
+		}
+		atomic64_inc(&dev_info->stats.errors);
+		if (!frootspi_retry_backoff(&retry)) {
+			break;
+		}
+		atomic64_inc(&dev_info->stats.retries);
 	}
+	aqm0802a_count_result(dev_info, retval);
 
-	// マイナー番号ごとに(デバイスの数だけ)、ドライバの登録をする
-	dev_info->device_major = MAJOR(dev);
-
-	// デバイスのクラスを登録する(/sys/class/***/ を作成)
-	// ドライバが動いてる最中はクラスを保持するため、クラスはグローバル変数である
-	dev_info->device_class = class_create(THIS_MODULE, LCD_DEVICE_NAME);
-	if (IS_ERR(dev_info->device_class)) {
-		// 登録できなかったらエラー処理に移動する
-		retval = PTR_ERR(dev_info->device_class);
-		printk(KERN_ERR "%s %s: class creation failed\n",
-			LCD_DEVICE_NAME, __func__);
-		goto failed_class_create;
-	}
-	// ドライバの初期化する
-	// file_operationを登録するので、ここでドライバの機能が決まる
-	cdev_init(&dev_info->cdev, &lcd_fops);
-	dev_info->cdev.owner = THIS_MODULE;
-
-	// ドライバをカーネルへ登録する
-	// 同じドライバを複数作成するときは、cdev_add(*,*,
-	// 3)みたいに末尾の数値を増やす
-	// 今回はドライバごとにメモリを確保したいので、cdev_add()自体を複数回実行する
-	retval = cdev_add(&dev_info->cdev,
-		MKDEV(dev_info->device_major, LCD_BASE_MINOR), 1);
 	if (retval < 0) {
-		// 登録できなかったらエラー処理へ移動する
-		printk(KERN_ERR "%s %s: minor=%d: chardev registration "
-				"failed\n",
-			LCD_DEVICE_NAME, __func__, LCD_BASE_MINOR);
-		goto failed_cdev_add;
+		printk_ratelimited(KERN_ERR "%s %s: write_byte_data 0x%x "
+					    "failed. error: %d\n",
+			I2C_DRIVER_NAME, __func__, data, retval);
+		return -1;
 	}
-
-	// ドライバによっては、ここでエラー検出してたりしてなかったりする
-	device_create(dev_info->device_class, NULL,
-		MKDEV(dev_info->device_major, LCD_BASE_MINOR), NULL, "%s%u",
-		LCD_DEVICE_NAME, LCD_BASE_MINOR);
-
+	// コントロールバイトとデータの2バイト
+	atomic64_add(2, &dev_info->stats.bytes);
+	usleep_range(WAIT_TIME_USEC_MIN, WAIT_TIME_USEC_MAX);
 	return 0;
-
-failed_cdev_add:
-	class_destroy(dev_info->device_class);
-failed_class_create:
-	unregister_chrdev_region(
-		MKDEV(dev_info->device_major, LCD_BASE_MINOR), LCD_MAX_MINORS);
-	return retval;
-}
-
-void unregister_lcd_dev(struct lcd_device_info *dev_info)
-{
-	// 基本的にはregister_lcd_devの逆の手順でメモリを開放していく
-	device_destroy(dev_info->device_class,
-		MKDEV(dev_info->device_major, LCD_BASE_MINOR));
-	cdev_del(&dev_info->cdev);
-	class_destroy(dev_info->device_class);
-	unregister_chrdev_region(
-		MKDEV(dev_info->device_major, LCD_BASE_MINOR), LCD_MAX_MINORS);
 }
 
 static int aqm0802a_write_command_byte(
 	struct i2c_client *client, const unsigned char data)
 {
-	const unsigned char CONTROL_COMMAND_BYTE = 0x00;
-	int retval =
-		i2c_smbus_write_byte_data(client, CONTROL_COMMAND_BYTE, data);
-	if (retval < 0) {
-		printk(KERN_ERR
-			"%s %s: write_byte_data 0x%x failed. error: %d\n",
-			I2C_DRIVER_NAME, __func__, data, retval);
-		return -1;
-	}
-	usleep_range(WAIT_TIME_USEC_MIN, WAIT_TIME_USEC_MAX);
-	return 0;
+	return aqm0802a_write_byte_data(client, CONTROL_COMMAND_BYTE, data);
 }
 
 static int aqm0802a_set_function(struct i2c_client *client,
@@ -316,16 +392,7 @@ static int aqm0802a_set_address(
 static int aqm0802a_write_data_byte(
 	struct i2c_client *client, const unsigned char data)
 {
-	const unsigned char CONTROL_DATA_BYTE = 0x40;
-	int retval = i2c_smbus_write_byte_data(client, CONTROL_DATA_BYTE, data);
-	if (retval < 0) {
-		printk(KERN_ERR
-			"%s %s: write_byte_data 0x%x failed. error: %d\n",
-			I2C_DRIVER_NAME, __func__, data, retval);
-		return -1;
-	}
-	usleep_range(WAIT_TIME_USEC_MIN, WAIT_TIME_USEC_MAX);
-	return 0;
+	return aqm0802a_write_byte_data(client, CONTROL_DATA_BYTE, data);
 }
 
 static int aqm0802a_write_lines(struct i2c_client *client, char *text)
@@ -335,9 +402,14 @@ static int aqm0802a_write_lines(struct i2c_client *client, char *text)
 	// textの中に改行コードが含まれていたら、書き込む行を変える
 	// アスキーコードと半角カタカナに対応。それ以外の文字は空白になる
 	// 2バイトや4バイト文字を入力されるとバグるので注意
+	// リトライしても書き込めなかったら、残りは書かずに-1を返す
+	struct lcd_device_info *dev_info = i2c_get_clientdata(client);
+	atomic64_inc(&dev_info->stats.frames);
 
-	aqm0802a_clear_display(client);
-	aqm0802a_set_address(client, 0x00);
+	if (aqm0802a_clear_display(client) ||
+		aqm0802a_set_address(client, 0x00)) {
+		return -1;
+	}
 
 	// 入力された文字のバイト数だけ繰り返す
 	size_t text_size = strlen(text);
@@ -345,7 +417,9 @@ static int aqm0802a_write_lines(struct i2c_client *client, char *text)
 		unsigned char converted_char = 0xa0; // 空白
 
 		if (text[i] == 0x0a) { // 改行
-			aqm0802a_set_address(client, 0x40);
+			if (aqm0802a_set_address(client, 0x40)) {
+				return -1;
+			}
 			continue;
 		}
 
@@ -361,7 +435,9 @@ static int aqm0802a_write_lines(struct i2c_client *client, char *text)
 			i += 2; // 3バイト文字なので、その分インクリメントする
 		}
 
-		aqm0802a_write_data_byte(client, converted_char);
+		if (aqm0802a_write_data_byte(client, converted_char)) {
+			return -1;
+		}
 	}
 
 	return 0;
@@ -395,6 +471,72 @@ static int aqm0802a_init_device(struct i2c_client *client)
 	return 0;
 }
 
+// 2行とも埋まる画面をselftest_lcd_frames回書き込み、1画面ごとのレイテンシを
+// sysfsに公開する。書き込みは失敗しても続くので、エラーは統計の差分で数える
+static void aqm0802a_selftest(struct i2c_client *client)
+{
+	struct lcd_device_info *dev_info = i2c_get_clientdata(client);
+	const u32 frames = min_t(
+		u32, selftest_lcd_frames, FROOTSPI_SELFTEST_MAX_ROUNDS);
+	struct i2c_timings timings;
+	char text[] = "SELFTEST\n01234567";
+
+	if (frames == 0) {
+		return;
+	}
+	u64 *samples = kmalloc_array(frames, sizeof(u64), GFP_KERNEL);
+	if (samples == NULL) {
+		printk(KERN_ERR "%s %s: kmalloc_array() failed.\n",
+			I2C_DRIVER_NAME, __func__);
+		return;
+	}
+
+	const s64 bytes = atomic64_read(&dev_info->stats.bytes);
+	const s64 errors = atomic64_read(&dev_info->stats.errors);
+	const s64 i2c_write_ns = atomic64_read(&dev_info->stats.i2c_write_ns);
+	for (u32 i = 0; i < frames; i++) {
+		const ktime_t started = ktime_get();
+		aqm0802a_write_lines(client, text);
+		samples[i] = ktime_to_ns(ktime_sub(ktime_get(), started));
+	}
+
+	// デバイスツリーのclock-frequency (なければ100kHz)
+	i2c_parse_fw_timings(&client->adapter->dev, &timings, true);
+	// 書き込み1回につき統計のbytesは2増える
+	const u64 writes = (atomic64_read(&dev_info->stats.bytes) - bytes) / 2;
+	dev_info->selftest = frootspi_selftest_publish(&client->dev,
+		I2C_DRIVER_NAME, samples, frames,
+		atomic64_read(&dev_info->stats.errors) - errors,
+		timings.bus_freq_hz, writes * AQM0802A_BITS_PER_WRITE,
+		atomic64_read(&dev_info->stats.i2c_write_ns) - i2c_write_ns);
+	kfree(samples);
+}
+
+// リトライしても失敗する書き込みが続いたときに、LCDを初期化し直す
+// 電源の瞬断などでリセットされていると何も表示されないので、最後の画面を書き直す
+static void aqm0802a_reinit_work(struct work_struct *work)
+{
+	struct lcd_device_info *dev_info =
+		container_of(work, struct lcd_device_info, reinit_work);
+	struct i2c_client *client = dev_info->client;
+
+	atomic64_inc(&dev_info->stats.reinits);
+	printk_ratelimited(KERN_WARNING "%s %s: re-initializing after "
+					"repeated failures.\n",
+		I2C_DRIVER_NAME, __func__);
+
+	mutex_lock(&dev_info->my_mutex);
+	WRITE_ONCE(dev_info->reinit_running, true);
+	aqm0802a_init_device(client);
+	if (aqm0802a_write_lines(client, dev_info->screen)) {
+		printk_ratelimited(KERN_ERR "%s %s: re-initialization "
+					    "failed.\n",
+			I2C_DRIVER_NAME, __func__);
+	}
+	WRITE_ONCE(dev_info->reinit_running, false);
+	mutex_unlock(&dev_info->my_mutex);
+}
+
 static int aqm0802a_probe(
 	struct i2c_client *client, const struct i2c_device_id *id)
 {
@@ -403,6 +545,7 @@ static int aqm0802a_probe(
 		I2C_DRIVER_NAME, id->name, (int)(id->driver_data),
 		client->addr);
 
+	ktime_t probe_started = ktime_get();
 	struct lcd_device_info *dev_info;
 	dev_info = kzalloc(sizeof(struct lcd_device_info), GFP_KERNEL);
 	if (dev_info == NULL) {
@@ -413,20 +556,60 @@ static int aqm0802a_probe(
 	dev_info->client = client;
 	i2c_set_clientdata(client, dev_info);
 	mutex_init(&dev_info->my_mutex);
+	INIT_WORK(&dev_info->reinit_work, aqm0802a_reinit_work);
+
+	// レイテンシのヒストグラムをdebugfsに公開する
+	dev_info->debugfs_dir =
+		debugfs_create_dir("aqm0802a", frootspi_debugfs_root);
+	frootspi_debugfs_create_hist(
+		"xfer_latency", dev_info->debugfs_dir, &dev_info->xfer_hist);
+	frootspi_debugfs_create_counter(
+		"bytes", dev_info->debugfs_dir, &dev_info->stats.bytes);
+	frootspi_debugfs_create_counter(
+		"frames", dev_info->debugfs_dir, &dev_info->stats.frames);
+	frootspi_debugfs_create_counter(
+		"errors", dev_info->debugfs_dir, &dev_info->stats.errors);
+	frootspi_debugfs_create_counter(
+		"retries", dev_info->debugfs_dir, &dev_info->stats.retries);
+	frootspi_debugfs_create_counter(
+		"failures", dev_info->debugfs_dir, &dev_info->stats.failures);
+	frootspi_debugfs_create_counter(
+		"reinits", dev_info->debugfs_dir, &dev_info->stats.reinits);
+	frootspi_debugfs_create_counter("i2c_write_ns", dev_info->debugfs_dir,
+		&dev_info->stats.i2c_write_ns);
+	frootspi_fault_init(&dev_info->fault, dev_info->debugfs_dir);
 
 	// LCDの初期化
 	aqm0802a_init_device(client);
-	aqm0802a_write_lines(client, "FrootsPi\nﾌﾙｰﾂﾊﾟｲ!");
+	aqm0802a_selftest(client);
+	strscpy(dev_info->screen, "FrootsPi\nﾌﾙｰﾂﾊﾟｲ!",
+		sizeof(dev_info->screen));
+	aqm0802a_write_lines(client, dev_info->screen);
 
 	// キャラクタデバイスの登録
-	return register_lcd_dev(dev_info);
+	// LCDの初期化が終わったらすぐに/dev/frootspi_lcd0が使えるようになる
+	int retval = frootspi_chardev_attach(FROOTSPI_LCD, dev_info, NULL, 0);
+	if (retval) {
+		frootspi_selftest_remove(dev_info->selftest);
+		debugfs_remove_recursive(dev_info->debugfs_dir);
+		kfree(dev_info);
+	} else {
+		// ここからは失敗が続いたらLCDを初期化し直す
+		WRITE_ONCE(dev_info->reinit_enabled, true);
+	}
+	frootspi_report_init_time("aqm0802a_probe", probe_started, retval);
+	return retval;
 }
 
 static int aqm0802a_remove(struct i2c_client *client)
 {
 	struct lcd_device_info *dev_info;
 	dev_info = i2c_get_clientdata(client);
-	unregister_lcd_dev(dev_info);
+	frootspi_chardev_detach(FROOTSPI_LCD);
+	WRITE_ONCE(dev_info->reinit_enabled, false);
+	cancel_work_sync(&dev_info->reinit_work);
+	frootspi_selftest_remove(dev_info->selftest);
+	debugfs_remove_recursive(dev_info->debugfs_dir);
 	kfree(dev_info);
 
 	printk(KERN_INFO "%s %s: i2c device removed.\n", I2C_DRIVER_NAME,
@@ -439,12 +622,17 @@ static struct i2c_driver aqm0802a_driver = {
 		{
 			.name = I2C_DRIVER_NAME,
 			.owner = THIS_MODULE,
+			.of_match_table = of_match_ptr(aqm0802a_of_match),
+			// 電源安定待ち(200ms)の間に他のデバイスのprobeを進める
+			.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 		},
 	.id_table = aqm0802a_id_table,
 	.probe = aqm0802a_probe,
 	.remove = aqm0802a_remove,
 };
 
+// デバイスはデバイスツリー(src/dts/frootspi-overlay.dts)から作られるので、
+// ドライバを登録するだけでprobe()が呼ばれる
 int register_aqm0802a_driver_and_lcd_dev(void)
 {
 	printk(KERN_INFO "%s %s: register.\n", I2C_DRIVER_NAME, __func__);
@@ -457,10 +645,6 @@ int register_aqm0802a_driver_and_lcd_dev(void)
 		return retval;
 	}
 
-	struct i2c_adapter *i2c_adap = i2c_get_adapter(1);
-	aqm0802a_client = i2c_new_device(i2c_adap, &aqm0802a_info);
-	i2c_put_adapter(i2c_adap);
-
 	return 0;
 }
 
@@ -468,6 +652,4 @@ void unregister_aqm0802a_driver_and_lcd_dev(void)
 {
 	printk(KERN_INFO "%s %s: unregister.\n", I2C_DRIVER_NAME, __func__);
 	i2c_del_driver(&aqm0802a_driver);
-	if (aqm0802a_client)
-		i2c_unregister_device(aqm0802a_client);
 }
@@ -1,162 +1,136 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include <linux/cdev.h>	   // cdev_*()
+#include <linux/device.h>  // DEVICE_ATTR_RW()
 #include <linux/fs.h>	   // struct file, open, release
-#include <linux/uaccess.h> // copy_to_user()
+#include <linux/uio.h>	   // struct iov_iter
 
+#include "frootspi_chardev.h"
 #include "mcp23s08_driver.h"
 
-#define LED_BASE_MINOR 0
-#define LED_MAX_MINORS 1
 #define LED_DEVICE_NAME "frootspi_led"
 
-static struct class *led_class;
-static int led_major;
-struct led_device_info {
-	// ここはある程度自由に定義できる
-	struct cdev cdev;
-	unsigned int device_major;
-	unsigned int device_minor;
-};
-static struct led_device_info stored_device_info[LED_MAX_MINORS];
-
-extern int mcp23s08_write_gpio(
-	const unsigned char gpio_num, const unsigned char value);
-
-static int led_open(struct inode *inode, struct file *filep)
+// LEDを点灯・消灯し、値が変わったら/sys/class/frootspi/frootspi_led*/valueを
+// poll()しているプロセスを起こす
+// キューが一杯でnowaitなら-EAGAIN、前の書き込みが失敗していたら-EIOを返す
+static int led_set(struct frootspi_chardev *chardev, const unsigned char value,
+	const bool nowait)
 {
-	struct led_device_info *dev_info;
-	// container_of(メンバーへのポインタ, 構造体の型, 構造体メンバの名前)
-	dev_info = container_of(inode->i_cdev, struct led_device_info, cdev);
-
-	// ここに何かしらのエラー処理がいるかも
-
-	dev_info->device_major = MAJOR(inode->i_rdev);
-	dev_info->device_minor = MINOR(inode->i_rdev);
-
-	filep->private_data = dev_info;
-
-	printk(KERN_DEBUG "%s %s: led device opend.\n", LED_DEVICE_NAME,
-		__func__);
-
-	return 0;
+	const int prev = mcp23s08_read_output(chardev->backend, chardev->pin);
+	int retval = mcp23s08_write_gpio(
+		chardev->backend, chardev->pin, value, nowait);
+	if (retval == 0 && prev != value) {
+		sysfs_notify(&chardev->device->kobj, NULL, "value");
+	}
+	return retval;
 }
 
-static int led_release(struct inode *inode, struct file *filep)
+// 先頭の1文字('0'または'1')でLEDを制御し、残りは読み捨てる
+// "1\n"のような書き込みも1回で受け付ける
+// 書き込みはキューに入れるだけで、SPIの送信完了は待たない
+// キューが一杯なら空くまで待つ (O_NONBLOCK、IOCB_NOWAITなら-EAGAIN)
+static ssize_t led_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	// デバイスによっては何もしなかったりする
-	// kfree(filep->private_data);
-	printk(KERN_DEBUG "%s %s: led device closed.\n", LED_DEVICE_NAME,
-		__func__);
+	struct frootspi_chardev *chardev = iocb->ki_filp->private_data;
+	const size_t count = iov_iter_count(from);
+	char value;
+
+	atomic64_inc(&chardev->stats.writes);
+	pr_debug("%s %s: led_write, minor:%d\n", LED_DEVICE_NAME, __func__,
+		MINOR(chardev->devt));
+
+	if (count == 0) {
+		return 0;
+	}
+	if (copy_from_iter(&value, sizeof(char), from) != sizeof(char)) {
+		printk(KERN_ERR "%s %s: copy_from_iter() failed.\n",
+			LED_DEVICE_NAME, __func__);
+		return -EFAULT;
+	}
+	iov_iter_advance(from, count - sizeof(char));
 
-	return 0;
+	// 書いている間にエキスパンダが取り除かれないようにする
+	const bool nowait = frootspi_chardev_nowait(iocb);
+	int retval = frootspi_chardev_get_backend(chardev, nowait);
+	if (retval) {
+		return retval;
+	}
+	// LEDを制御
+	if (value == '0') {
+		retval = led_set(chardev, 0, nowait);
+	} else if (value == '1') {
+		retval = led_set(chardev, 1, nowait);
+	}
+	frootspi_chardev_put_backend(chardev);
+	return retval ? retval : count;
 }
 
-static ssize_t led_write(
-	struct file *filep, const char __user *buf, size_t count, loff_t *f_pos)
+// write()はLEDの書き込みをキューに入れるだけなので、
+// 実際にLEDが変化したことを確認したいときはfsync()を呼ぶ
+static int led_fsync(struct file *filep, loff_t start, loff_t end, int datasync)
 {
-	struct led_device_info *dev_info = filep->private_data;
-	printk("%s %s: led_write, major:%d, minor:%d\n", LED_DEVICE_NAME,
-		__func__, dev_info->device_major, dev_info->device_minor);
-
-	// 何文字書き込み指定されようが、こちらが勝手に書き込ませていただきます
-	if (count > 0) {
-		char value;
-		if (copy_from_user(&value, buf, sizeof(char)) != 0) {
-			printk(KERN_ERR "%s %s: copy_from_user() failed.\n",
-				LED_DEVICE_NAME, __func__);
-			return -1;
-		}
-
-		// LEDを制御
-		if (value == '0') {
-			mcp23s08_write_gpio(MCP23S08_GPIO_LED, 0);
-		} else if (value == '1') {
-			mcp23s08_write_gpio(MCP23S08_GPIO_LED, 1);
-		}
-		return sizeof(char);
+	struct frootspi_chardev *chardev = filep->private_data;
+	int retval = frootspi_chardev_get_backend(chardev, false);
+	if (retval) {
+		return retval;
 	}
-	return 0;
+	retval = mcp23s08_fence(chardev->backend);
+	frootspi_chardev_put_backend(chardev);
+	return retval;
 }
 
-static struct file_operations led_fops = {
-	.open = led_open,
-	.release = led_release,
-	.write = led_write,
+// frootspi_chardev.cのテーブルから参照される
+struct file_operations led_fops = {
+	.open = frootspi_chardev_open,
+	.release = frootspi_chardev_release,
+	.write_iter = led_write_iter,
+	.fsync = led_fsync,
 };
 
-int register_led_dev(void)
+// /sys/class/frootspi/frootspi_led*/value
+// 出力ラッチのシャドウを返すので、SPI通信はしない
+static ssize_t value_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int retval;
-	dev_t dev;
-
-	// 動的にメジャー番号を確保する
-	retval = alloc_chrdev_region(
-		&dev, LED_BASE_MINOR, LED_MAX_MINORS, LED_DEVICE_NAME);
-	if (retval < 0) {
-		// 確保できなかったらエラーを返して終了
-		printk(KERN_ERR "%s %s: unable to allocate device number\n",
-			LED_DEVICE_NAME, __func__);
-		return retval;
-	}
+	struct frootspi_chardev *chardev = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+		mcp23s08_read_output(chardev->backend, chardev->pin));
+}
 
-	// デバイスのクラスを登録する(/sys/class/***/ を作成)
-	// ドライバが動いてる最中はクラスを保持するため、クラスはグローバル変数である
-	led_class = class_create(THIS_MODULE, LED_DEVICE_NAME);
-	if (IS_ERR(led_class)) {
-		// 登録できなかったらエラー処理に移動する
-		retval = PTR_ERR(led_class);
-		printk(KERN_ERR "%s %s: class creation failed\n",
-			LED_DEVICE_NAME, __func__);
-		goto failed_class_create;
-	}
+static ssize_t value_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	struct frootspi_chardev *chardev = dev_get_drvdata(dev);
+	unsigned int value;
 
-	// マイナー番号ごとに(デバイスの数だけ)、ドライバの登録をする
-	led_major = MAJOR(dev);
-	for (int i = 0; i < LED_MAX_MINORS; i++) {
-		// ドライバの初期化する
-		// file_operationを登録するので、ここでドライバの機能が決まる
-		cdev_init(&stored_device_info[i].cdev, &led_fops);
-		stored_device_info[i].cdev.owner = THIS_MODULE;
-
-		// ドライバをカーネルへ登録する
-		// 同じドライバを複数作成するときは、cdev_add(*,*,
-		// 3)みたいに末尾の数値を増やす
-		// 今回はドライバごとにメモリを確保したいので、cdev_add()自体を複数回実行する
-		retval = cdev_add(&stored_device_info[i].cdev,
-			MKDEV(led_major, LED_BASE_MINOR + i), 1);
-		if (retval < 0) {
-			// 登録できなかったらエラー処理へ移動する
-			printk(KERN_ERR "%s %s: minor=%d: chardev registration "
-					"failed\n",
-				LED_DEVICE_NAME, __func__, LED_BASE_MINOR + i);
-			goto failed_cdev_add;
-		}
-
-		// ドライバによっては、ここでエラー検出してたりしてなかったりする
-		device_create(led_class, NULL,
-			MKDEV(led_major, LED_BASE_MINOR + i), NULL, "%s%u",
-			LED_DEVICE_NAME, i);
+	atomic64_inc(&chardev->stats.writes);
+	if (kstrtouint(buf, 0, &value) || value > 1) {
+		return -EINVAL;
 	}
+	const int retval = led_set(chardev, value, false);
+	return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(value);
 
-	return 0;
+static struct attribute *led_value_attrs[] = {
+	&dev_attr_value.attr,
+	NULL,
+};
 
-failed_cdev_add:
-	class_destroy(led_class);
-failed_class_create:
-	unregister_chrdev_region(
-		MKDEV(led_major, LED_BASE_MINOR), LED_MAX_MINORS);
-	return retval;
+// frootspi_chardev.cのテーブルから参照される
+const struct attribute_group led_value_group = {
+	.attrs = led_value_attrs,
+};
+
+// pinsはMCP23S08のピン番号(アドレス * 8 + GPIO番号)
+// pins[i]が/dev/frootspi_led{i}に対応する
+int register_led_dev(struct mcp23s08_drvdata *expander,
+	const unsigned char *pins, const int num_pins)
+{
+	return frootspi_chardev_attach(FROOTSPI_LED, expander, pins, num_pins);
 }
 
 void unregister_led_dev(void)
 {
-	// 基本的にはregister_led_devの逆の手順でメモリを開放していく
-	for (int i = 0; i < LED_MAX_MINORS; i++) {
-		device_destroy(led_class, MKDEV(led_major, LED_BASE_MINOR + i));
-		cdev_del(&stored_device_info[i].cdev);
-	}
-	class_destroy(led_class);
-	unregister_chrdev_region(
-		MKDEV(led_major, LED_BASE_MINOR), LED_MAX_MINORS);
+	frootspi_chardev_detach(FROOTSPI_LED);
 }
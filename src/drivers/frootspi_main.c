@@ -1,52 +1,193 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#include <linux/async.h>   // async_schedule_domain()
 #include <linux/cdev.h>	   // cdev_*()
 #include <linux/fs.h>	   // struct file, open, release
+#include <linux/ktime.h>   // ktime_get()
 #include <linux/module.h>  // module_*()
+#include <linux/seq_file.h> // seq_*()
 #include <linux/slab.h>	   // kmalloc()
 #include <linux/uaccess.h> // copy_to_user()
 
+#include "frootspi_chardev.h"
+#include "frootspi_debugfs.h"
+
+// トレースポイントの実体はこのファイルで定義する
+#define CREATE_TRACE_POINTS
+#include "frootspi_trace.h"
+
 #define FROOTSPI_VERSION "0.1.0"
 
+// 1つのサブシステムが複数回初期化されることはないので、これで十分
+#define FROOTSPI_MAX_INIT_RECORDS 16
+
 extern int register_hello_dev(void);
 extern void unregister_hello_dev(void);
+extern int register_sdsw_gpio(void);
+extern void unregister_sdsw_gpio(void);
 extern int register_mcp23s08_driver(void);
 extern void unregister_mcp23s08_driver(void);
-extern int register_pushsw_dev(void);
-extern void unregister_pushsw_dev(void);
-extern int register_led_dev(void);
-extern void unregister_led_dev(void);
-extern int register_dipsw_dev(void);
-extern void unregister_dipsw_dev(void);
+extern int register_mcp23s08_mock(void);
+extern void unregister_mcp23s08_mock(void);
 extern int register_aqm0802a_driver_and_lcd_dev(void);
 extern void unregister_aqm0802a_driver_and_lcd_dev(void);
+extern int register_aqm0802a_mock(void);
+extern void unregister_aqm0802a_mock(void);
+extern int register_input_dev(void);
+extern void unregister_input_dev(void);
+
+// 初期化にかかった時間 (/sys/kernel/debug/frootspi/init_times)
+// 起動時間の悪化に気づけるよう、サブシステムやprobe()ごとに記録する
+struct frootspi_init_record {
+	const char *name;
+	int retval;
+	s64 duration_us;
+};
+static struct frootspi_init_record init_records[FROOTSPI_MAX_INIT_RECORDS];
+static int num_init_records;
+static DEFINE_SPINLOCK(init_records_lock);
+
+// startedからの経過時間を初期化時間として記録する
+// 同じ名前が既にあれば上書きする(ドライバの再バインドなど)
+void frootspi_report_init_time(
+	const char *name, const ktime_t started, const int retval)
+{
+	const s64 duration_us = ktime_us_delta(ktime_get(), started);
+	struct frootspi_init_record *record = NULL;
+
+	printk(KERN_INFO "frootspi: %s initialized in %lld us (ret=%d).\n",
+		name, duration_us, retval);
+
+	spin_lock(&init_records_lock);
+	for (int i = 0; i < num_init_records; i++) {
+		if (strcmp(init_records[i].name, name) == 0) {
+			record = &init_records[i];
+			break;
+		}
+	}
+	if (record == NULL && num_init_records < FROOTSPI_MAX_INIT_RECORDS) {
+		record = &init_records[num_init_records++];
+	}
+	if (record) {
+		record->name = name;
+		record->retval = retval;
+		record->duration_us = duration_us;
+	}
+	spin_unlock(&init_records_lock);
+}
+
+static int init_times_show(struct seq_file *s, void *unused)
+{
+	seq_puts(s, "name ret usecs\n");
+	spin_lock(&init_records_lock);
+	for (int i = 0; i < num_init_records; i++) {
+		seq_printf(s, "%s %d %lld\n", init_records[i].name,
+			init_records[i].retval, init_records[i].duration_us);
+	}
+	spin_unlock(&init_records_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(init_times);
+
+// 互いに依存しないサブシステム
+// async_schedule_domain()で並行に初期化し、1つが失敗しても他は止めない
+// 各サブシステムは準備ができたらfrootspi_chardev_attach()でデバイスファイルを作る
+// pushsw, dipsw, led, lcdのデバイスは、それぞれのprobe()で作られる
+struct frootspi_subsys {
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);
+	int retval;
+};
+
+static struct frootspi_subsys subsystems[] = {
+	{
+		.name = "hello",
+		.init = register_hello_dev,
+		.exit = unregister_hello_dev,
+	},
+	{
+		.name = "sdsw_gpio",
+		.init = register_sdsw_gpio,
+		.exit = unregister_sdsw_gpio,
+	},
+	{
+		.name = "mcp23s08",
+		.init = register_mcp23s08_driver,
+		.exit = unregister_mcp23s08_driver,
+	},
+	{
+		// mock_mcp23s08=1のときだけ、ソフトウェアのMCP23S08を作る
+		.name = "mcp23s08_mock",
+		.init = register_mcp23s08_mock,
+		.exit = unregister_mcp23s08_mock,
+	},
+	{
+		.name = "aqm0802a",
+		.init = register_aqm0802a_driver_and_lcd_dev,
+		.exit = unregister_aqm0802a_driver_and_lcd_dev,
+	},
+	{
+		// mock_aqm0802a=1のときだけ、ソフトウェアのAQM0802Aを作る
+		.name = "aqm0802a_mock",
+		.init = register_aqm0802a_mock,
+		.exit = unregister_aqm0802a_mock,
+	},
+	{
+		.name = "input",
+		.init = register_input_dev,
+		.exit = unregister_input_dev,
+	},
+};
+
+static ASYNC_DOMAIN_EXCLUSIVE(frootspi_async_domain);
+
+static void frootspi_subsys_init(void *data, async_cookie_t cookie)
+{
+	struct frootspi_subsys *subsys = data;
+	ktime_t started = ktime_get();
+
+	subsys->retval = subsys->init();
+	if (subsys->retval) {
+		printk(KERN_ERR "%s: %s initialization failed (%d).\n",
+			__func__, subsys->name, subsys->retval);
+	}
+	frootspi_report_init_time(subsys->name, started, subsys->retval);
+}
 
 static int frootspi_init(void)
 {
-	register_hello_dev();
+	frootspi_debugfs_init();
+	debugfs_create_file("init_times", 0444, frootspi_debugfs_root, NULL,
+		&init_times_fops);
 
-	if (register_mcp23s08_driver()) {
-		printk(KERN_ERR "%s: register_mcp23s08_driver() failed.\n",
-			__func__);
-	} else {
-		register_pushsw_dev();
-		register_dipsw_dev();
-		register_led_dev();
+	// 全サブシステムが使うマイナー番号とクラスは先に確保する
+	int retval = frootspi_chardev_init();
+	if (retval) {
+		frootspi_debugfs_exit();
+		return retval;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(subsystems); i++) {
+		async_schedule_domain(frootspi_subsys_init, &subsystems[i],
+			&frootspi_async_domain);
 	}
-	register_aqm0802a_driver_and_lcd_dev();
 	return 0;
 }
 
 static void frootspi_exit(void)
 {
-	unregister_hello_dev();
-
-	unregister_pushsw_dev();
-	unregister_dipsw_dev();
-	unregister_led_dev();
-	unregister_mcp23s08_driver();
+	// 初期化中のサブシステムがあれば終わるまで待つ
+	async_synchronize_full_domain(&frootspi_async_domain);
 
-	unregister_aqm0802a_driver_and_lcd_dev();
+	// 初期化に成功したサブシステムだけを、登録と逆の順番で取り除く
+	for (int i = ARRAY_SIZE(subsystems) - 1; i >= 0; i--) {
+		if (subsystems[i].retval == 0) {
+			subsystems[i].exit();
+		}
+	}
+	frootspi_chardev_exit();
+	frootspi_debugfs_exit();
 }
 
 MODULE_AUTHOR("Shota Akoi <macakasit@gmail.com>");
@@ -1,199 +1,316 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include <linux/cdev.h>	   // cdev_*()
+#include <linux/device.h>  // DEVICE_ATTR_RO()
 #include <linux/fs.h>	   // struct file, open, release
-#include <linux/uaccess.h> // copy_to_user()
-#include <linux/gpio.h>  // gpio_*()
+#include <linux/uio.h>	   // struct iov_iter
+#include <linux/gpio.h>  // gpio_request()
+#include <linux/gpio/consumer.h> // gpiod_*()
+#include <linux/interrupt.h> // request_threaded_irq()
+#include <linux/module.h>    // module_param()
+#include <linux/workqueue.h> // delayed_work
 
+#include "frootspi_chardev.h"
+#include "frootspi_debugfs.h"
+#include "frootspi_input.h"
 #include "mcp23s08_driver.h"
 
-#define PUSHSW_MAX_BUFLEN 64 // copy_to_user用のバッファサイズ
-#define PUSHSW_BASE_MINOR 0
-#define PUSHSW_MAX_MINORS 5
-#define PUSHSW_GPIO_PIN_SDSW 23
 #define PUSHSW_DEVICE_NAME "frootspi_pushsw"
 
-static struct class *pushsw_class;
-static int pushsw_major;
-struct pushsw_device_info {
-	// ここはある程度自由に定義できる
-	struct cdev cdev;
-	unsigned int device_major;
-	unsigned int device_minor;
-	unsigned char target_gpio_num;
+extern void frootspi_input_report_event(const unsigned short type,
+	const unsigned short code, const int value, const ktime_t now);
+extern int frootspi_input_cached_value(
+	const unsigned short type, const unsigned short code);
+extern int frootspi_input_replay_value(
+	const unsigned short type, const unsigned short code);
+
+// SDスイッチのチャタリングが収まるまで待つ時間
+// この時間内に続いたエッジは1回の変化として扱う
+static unsigned int sdsw_debounce_ms = 20;
+module_param(sdsw_debounce_ms, uint, 0444);
+MODULE_PARM_DESC(sdsw_debounce_ms, "SD switch debounce window in ms "
+				   "(default 20)");
+
+// /sys/kernel/debug/frootspi/sdsw/
+struct sdsw_stats {
+	atomic64_t irqs;	// GPIO23の割り込みの回数
+	atomic64_t bounces;	// 値が確定する前に続いたエッジの数
+	atomic64_t transitions; // 確定した値の変化の数
 };
-static struct pushsw_device_info stored_device_info[PUSHSW_MAX_MINORS];
 
-extern int mcp23s08_read_gpio(const unsigned char gpio_num);
+// SDスイッチ(ラズパイのGPIO23)
+// 両エッジの割り込みで変化を検出し、sdsw_debounce_ms待ってから値を確定する
+// 確定した値は/dev/frootspi_input0のイベントとsysfsのvalueで通知する
+// 割り込みが使えなければ、読み出しのたびにGPIOを読む
+static struct gpio_desc *sdsw_desc;
+static int sdsw_irq = -1;
+// sdsw_value, sdsw_edge_time, sdsw_pendingを保護する
+static DEFINE_SPINLOCK(sdsw_lock);
+static int sdsw_value; // 確定した値
+static ktime_t sdsw_edge_time; // 確定待ちの変化の最初のエッジの時刻
+static bool sdsw_pending;
+static struct delayed_work sdsw_debounce_work;
+static struct sdsw_stats sdsw_stats;
+static struct dentry *sdsw_debugfs_dir;
 
-static int pushsw_open(struct inode *inode, struct file *filep)
+// SDスイッチの値を返す
+// 割り込みを使っている場合は、チャタリングが収まって確定した値を返す
+int frootspi_sdsw_get_value(void)
 {
-	struct pushsw_device_info *dev_info;
-	// container_of(メンバーへのポインタ, 構造体の型, 構造体メンバの名前)
-	dev_info = container_of(inode->i_cdev, struct pushsw_device_info, cdev);
-
-	dev_info->device_major = MAJOR(inode->i_rdev);
-	dev_info->device_minor = MINOR(inode->i_rdev);
-
-	switch (dev_info->device_minor) {
-	case 0:
-		dev_info->target_gpio_num = MCP23S08_GPIO_PUSHSW0;
-		break;
-	case 1:
-		dev_info->target_gpio_num = MCP23S08_GPIO_PUSHSW1;
-		break;
-	case 2:
-		dev_info->target_gpio_num = MCP23S08_GPIO_PUSHSW2;
-		break;
-	case 3:
-		dev_info->target_gpio_num = MCP23S08_GPIO_PUSHSW3;
-		break;
-	case 4:
-		gpio_direction_input(PUSHSW_GPIO_PIN_SDSW);  // 入力ピンに設定
-		break;
-	default:
-		dev_info->target_gpio_num = 0;
-	}
-
-	filep->private_data = dev_info;
-
-	printk(KERN_DEBUG "%s %s: pushsw%d device opened.\n",
-		PUSHSW_DEVICE_NAME, __func__, dev_info->device_minor);
-
-	return 0;
+	if (sdsw_irq >= 0) {
+		return READ_ONCE(sdsw_value);
+	}
+	// 物理ピンを読む
+	return gpiod_get_value(sdsw_desc);
 }
 
-static int pushsw_release(struct inode *inode, struct file *filep)
+// MCP23S08のプッシュスイッチか、ラズパイのGPIOのSDスイッチを読む
+// 記録を再生している間は、再生した値を返す
+// 失敗した場合は-1を返す
+static int pushsw_get_value(struct frootspi_chardev *chardev)
 {
-	// デバイスによっては何もしなかったりする
-	// kfree(filep->private_data);
+	const int replayed =
+		frootspi_input_replay_value(FROOTSPI_EV_PUSHSW, chardev->index);
+	if (replayed >= 0) {
+		return replayed;
+	}
+	if (chardev->family == FROOTSPI_PUSHSW) {
+		return mcp23s08_read_gpio(chardev->backend, chardev->pin);
+	}
+	return frootspi_sdsw_get_value();
+}
 
-	printk(KERN_DEBUG "%s %s: device closed.\n", PUSHSW_DEVICE_NAME,
-		__func__);
-	return 0;
+// SPI通信せずに値を返す (わからなければ-EAGAIN)
+// SDスイッチはラズパイのGPIOなので、いつでも眠らずに読める
+static int pushsw_get_value_nowait(struct frootspi_chardev *chardev)
+{
+	const int replayed =
+		frootspi_input_replay_value(FROOTSPI_EV_PUSHSW, chardev->index);
+	if (replayed >= 0) {
+		return replayed;
+	}
+	if (chardev->family != FROOTSPI_PUSHSW) {
+		return frootspi_sdsw_get_value();
+	}
+	const int value =
+		mcp23s08_read_gpio_nowait(chardev->backend, chardev->pin);
+	if (value >= 0) {
+		return value;
+	}
+	return frootspi_input_cached_value(FROOTSPI_EV_PUSHSW, chardev->index);
 }
 
-static ssize_t pushsw_read(
-	struct file *filep, char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t pushsw_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct pushsw_device_info *dev_info = filep->private_data;
-	// オフセットがあったら正常終了する
-	// 短い文字列しかコピーしないので、これで問題なし
-	// 長い文字列をコピーするばあいは、オフセットが重要
-	if (*f_pos > 0) {
+	struct frootspi_chardev *chardev = iocb->ki_filp->private_data;
+	int gpio_value;
+	atomic64_inc(&chardev->stats.reads);
+
+	// 読み切った後はSPI通信せずにEOFを返す
+	if (iocb->ki_pos >= FROOTSPI_VALUE_LEN) {
 		return 0; // EOF
 	}
 
-	int gpio_value = 0;
-	if(dev_info->device_minor < 4){
-		gpio_value = mcp23s08_read_gpio(dev_info->target_gpio_num);
-		if (gpio_value < 0) {
-			printk(KERN_ERR "%s %s: mcp23s08_read_gpio() failed.\n",
-				PUSHSW_DEVICE_NAME, __func__);
-			return 0;
-		}
-	}else{
-		// 物理ピンを読む
-		gpio_value = gpio_get_value(PUSHSW_GPIO_PIN_SDSW);
+	// 読んでいる間にエキスパンダが取り除かれないようにする
+	const bool nowait = frootspi_chardev_nowait(iocb);
+	int retval = frootspi_chardev_get_backend(chardev, nowait);
+	if (retval) {
+		return retval;
+	}
+	if (nowait) {
+		gpio_value = pushsw_get_value_nowait(chardev);
+	} else {
+		gpio_value = pushsw_get_value(chardev);
+	}
+	frootspi_chardev_put_backend(chardev);
+	if (gpio_value == -EAGAIN) {
+		return -EAGAIN;
+	}
+	if (gpio_value < 0) {
+		printk_ratelimited(KERN_ERR "%s %s: mcp23s08_read_gpio() "
+					    "failed.\n",
+			PUSHSW_DEVICE_NAME, __func__);
+		// EOF(0)と区別できるよう、エラーを返す
+		return -EIO;
 	}
 
-	unsigned char buffer[PUSHSW_MAX_BUFLEN];
-	sprintf(buffer, "%d\n", gpio_value);
+	return frootspi_chardev_read_value(iocb, to, gpio_value);
+}
 
-	count = strlen(buffer);
+// frootspi_chardev.cのテーブルから参照される
+// MCP23S08のプッシュスイッチとSDスイッチで共通
+struct file_operations pushsw_fops = {
+	.open = frootspi_chardev_open,
+	.release = frootspi_chardev_release,
+	.read_iter = pushsw_read_iter,
+};
 
-	// pushswドライバがもつテキスト情報をユーザ空間へコピーする
-	// copy_to_userで、buf宛に、dev_info->bufferのデータを、countバイトコピーする
-	// コピーできなかったバイト数が返り値で渡される
-	if (copy_to_user((void *)buf, &buffer, count)) {
-		printk(KERN_ERR "%s %s: copy_to_user() failed.\n",
-			PUSHSW_DEVICE_NAME, __func__);
-		return -1;
+// /sys/class/frootspi/frootspi_pushsw*/value
+// 値の変化はスイッチを読んでいるfrootspi_input.cがsysfs_notify()する
+static ssize_t value_show(
+	struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct frootspi_chardev *chardev = dev_get_drvdata(dev);
+	int gpio_value = pushsw_get_value(chardev);
+	if (gpio_value < 0) {
+		return -EIO;
 	}
-	*f_pos += count;
-
-	return count;
+	return scnprintf(buf, PAGE_SIZE, "%d\n", gpio_value);
 }
+static DEVICE_ATTR_RO(value);
+
+static struct attribute *pushsw_value_attrs[] = {
+	&dev_attr_value.attr,
+	NULL,
+};
 
-static struct file_operations pushsw_fops = {
-	.open = pushsw_open,
-	.release = pushsw_release,
-	.read = pushsw_read,
+// frootspi_chardev.cのテーブルから参照される
+const struct attribute_group pushsw_value_group = {
+	.attrs = pushsw_value_attrs,
 };
 
-int register_pushsw_dev(void)
+// GPIO23のエッジで呼ばれる
+// スレッドが動き出すまでの遅れを含めないよう、ここで時刻を記録する
+static irqreturn_t sdsw_hardirq(int irq, void *dev_id)
+{
+	atomic64_inc(&sdsw_stats.irqs);
+	spin_lock(&sdsw_lock);
+	if (sdsw_pending) {
+		atomic64_inc(&sdsw_stats.bounces);
+	} else {
+		sdsw_edge_time = ktime_get();
+		sdsw_pending = true;
+	}
+	spin_unlock(&sdsw_lock);
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t sdsw_irq_thread(int irq, void *dev_id)
 {
-	int retval;
-	dev_t dev;
+	// エッジが続く間は確定を先に延ばす
+	mod_delayed_work(system_wq, &sdsw_debounce_work,
+		msecs_to_jiffies(sdsw_debounce_ms));
+	return IRQ_HANDLED;
+}
+
+// 最後のエッジからsdsw_debounce_ms経ったので、値を確定する
+static void sdsw_debounce(struct work_struct *work)
+{
+	const int value = gpiod_get_value_cansleep(sdsw_desc);
+
+	spin_lock_irq(&sdsw_lock);
+	const ktime_t edge_time = sdsw_edge_time;
+	const bool changed = value >= 0 && value != sdsw_value;
+	if (changed) {
+		WRITE_ONCE(sdsw_value, value);
+	}
+	sdsw_pending = false;
+	spin_unlock_irq(&sdsw_lock);
+
+	// 元の値に戻っただけなら、チャタリングとして捨てる
+	if (changed) {
+		atomic64_inc(&sdsw_stats.transitions);
+		frootspi_input_report_event(FROOTSPI_EV_PUSHSW,
+			FROOTSPI_SDSW_INDEX, value, edge_time);
+	}
+}
 
-	// 動的にメジャー番号を確保する
-	retval = alloc_chrdev_region(
-		&dev, PUSHSW_BASE_MINOR, PUSHSW_MAX_MINORS, PUSHSW_DEVICE_NAME);
+// 割り込みが使えなければ、これまで通り読み出しのたびにGPIOを読む
+static void sdsw_setup_irq(void)
+{
+	const int irq = gpiod_to_irq(sdsw_desc);
+	if (irq < 0) {
+		printk(KERN_WARNING "%s %s: gpiod_to_irq() failed (%d), "
+				    "falling back to polling.\n",
+			PUSHSW_DEVICE_NAME, __func__, irq);
+		return;
+	}
+
+	int retval = request_threaded_irq(irq, sdsw_hardirq, sdsw_irq_thread,
+		IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+		"frootspi_sdsw", NULL);
+	if (retval) {
+		printk(KERN_WARNING "%s %s: request_threaded_irq() failed "
+				    "(%d), falling back to polling.\n",
+			PUSHSW_DEVICE_NAME, __func__, retval);
+		return;
+	}
+	sdsw_irq = irq;
+}
+
+// SDスイッチのピンを入力に設定して、デバイスファイルを作る
+// open()のたびに設定し直す必要はないので、モジュールのロード時に1回だけ行う
+// デバイスツリーのノードがないので、番号でGPIOを確保してからgpiodを使う
+int register_sdsw_gpio(void)
+{
+	int retval = gpio_request(FROOTSPI_GPIO_PIN_SDSW, "frootspi_sdsw");
 	if (retval < 0) {
-		// 確保できなかったらエラーを返して終了
-		printk(KERN_ERR "%s %s: unable to allocate device number\n",
-			PUSHSW_DEVICE_NAME, __func__);
+		printk(KERN_ERR "%s %s: gpio_request(%d) failed\n",
+			PUSHSW_DEVICE_NAME, __func__, FROOTSPI_GPIO_PIN_SDSW);
 		return retval;
 	}
+	sdsw_desc = gpio_to_desc(FROOTSPI_GPIO_PIN_SDSW);
 
-	// デバイスのクラスを登録する(/sys/class/***/ を作成)
-	// ドライバが動いてる最中はクラスを保持するため、クラスはグローバル変数である
-	pushsw_class = class_create(THIS_MODULE, PUSHSW_DEVICE_NAME);
-	if (IS_ERR(pushsw_class)) {
-		// 登録できなかったらエラー処理に移動する
-		retval = PTR_ERR(pushsw_class);
-		printk(KERN_ERR "%s %s: class creation failed\n",
-			PUSHSW_DEVICE_NAME, __func__);
-		goto failed_class_create;
-	}
-
-	// マイナー番号ごとに(デバイスの数だけ)、ドライバの登録をする
-	pushsw_major = MAJOR(dev);
-	for (int i = 0; i < PUSHSW_MAX_MINORS; i++) {
-		// ドライバの初期化する
-		// file_operationを登録するので、ここでドライバの機能が決まる
-		cdev_init(&stored_device_info[i].cdev, &pushsw_fops);
-		stored_device_info[i].cdev.owner = THIS_MODULE;
-
-		// ドライバをカーネルへ登録する
-		// 同じドライバを複数作成するときは、cdev_add(*,*,
-		// 3)みたいに末尾の数値を増やす
-		// 今回はドライバごとにメモリを確保したいので、cdev_add()自体を複数回実行する
-		retval = cdev_add(&stored_device_info[i].cdev,
-			MKDEV(pushsw_major, PUSHSW_BASE_MINOR + i), 1);
-		if (retval < 0) {
-			// 登録できなかったらエラー処理へ移動する
-			printk(KERN_ERR
-				"%s: minor=%d: chardev registration failed\n",
-				PUSHSW_DEVICE_NAME, PUSHSW_BASE_MINOR + i);
-			goto failed_cdev_add;
-		}
-
-		// ドライバによっては、ここでエラー検出してたりしてなかったりする
-		device_create(pushsw_class, NULL,
-			MKDEV(pushsw_major, PUSHSW_BASE_MINOR + i), NULL,
-			"%s%u", PUSHSW_DEVICE_NAME, i);
+	retval = gpiod_direction_input(sdsw_desc);
+	if (retval < 0) {
+		printk(KERN_ERR "%s %s: gpiod_direction_input(%d) failed\n",
+			PUSHSW_DEVICE_NAME, __func__, FROOTSPI_GPIO_PIN_SDSW);
+		goto failed_gpio_direction;
 	}
 
+	// 割り込みを有効にする前に、現在の値を確定した値にしておく
+	sdsw_value = gpiod_get_value_cansleep(sdsw_desc);
+	INIT_DELAYED_WORK(&sdsw_debounce_work, sdsw_debounce);
+	sdsw_debugfs_dir = debugfs_create_dir("sdsw", frootspi_debugfs_root);
+	frootspi_debugfs_create_counter(
+		"irqs", sdsw_debugfs_dir, &sdsw_stats.irqs);
+	frootspi_debugfs_create_counter(
+		"bounces", sdsw_debugfs_dir, &sdsw_stats.bounces);
+	frootspi_debugfs_create_counter(
+		"transitions", sdsw_debugfs_dir, &sdsw_stats.transitions);
+	sdsw_setup_irq();
+
+	// SDスイッチはエキスパンダを待たずに使えるようになる
+	retval = frootspi_chardev_attach(FROOTSPI_SDSW, NULL, NULL, 0);
+	if (retval < 0) {
+		goto failed_attach;
+	}
 	return 0;
 
-failed_cdev_add:
-	class_destroy(pushsw_class);
-failed_class_create:
-	unregister_chrdev_region(
-		MKDEV(pushsw_major, PUSHSW_BASE_MINOR), PUSHSW_MAX_MINORS);
+failed_attach:
+	if (sdsw_irq >= 0) {
+		free_irq(sdsw_irq, NULL);
+		sdsw_irq = -1;
+	}
+	cancel_delayed_work_sync(&sdsw_debounce_work);
+	debugfs_remove_recursive(sdsw_debugfs_dir);
+failed_gpio_direction:
+	gpio_free(FROOTSPI_GPIO_PIN_SDSW);
 	return retval;
 }
 
+void unregister_sdsw_gpio(void)
+{
+	frootspi_chardev_detach(FROOTSPI_SDSW);
+	if (sdsw_irq >= 0) {
+		free_irq(sdsw_irq, NULL);
+		sdsw_irq = -1;
+	}
+	cancel_delayed_work_sync(&sdsw_debounce_work);
+	debugfs_remove_recursive(sdsw_debugfs_dir);
+	gpio_free(FROOTSPI_GPIO_PIN_SDSW);
+}
+
+// MCP23S08のプッシュスイッチのデバイスファイルを作る
+// pinsはMCP23S08のピン番号(アドレス * 8 + GPIO番号)
+int register_pushsw_dev(struct mcp23s08_drvdata *expander,
+	const unsigned char *pins, const int num_pins)
+{
+	return frootspi_chardev_attach(
+		FROOTSPI_PUSHSW, expander, pins, num_pins);
+}
+
 void unregister_pushsw_dev(void)
 {
-	// 基本的にはregister_pushsw_devの逆の手順でメモリを開放していく
-	for (int i = 0; i < PUSHSW_MAX_MINORS; i++) {
-		device_destroy(pushsw_class,
-			MKDEV(pushsw_major, PUSHSW_BASE_MINOR + i));
-		cdev_del(&stored_device_info[i].cdev);
-	}
-	class_destroy(pushsw_class);
-	unregister_chrdev_region(
-		MKDEV(pushsw_major, PUSHSW_BASE_MINOR), PUSHSW_MAX_MINORS);
-}
\ No newline at end of file
+	frootspi_chardev_detach(FROOTSPI_PUSHSW);
+}
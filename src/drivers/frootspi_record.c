@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/fs.h>	    // struct file_operations
+#include <linux/hrtimer.h>  // schedule_hrtimeout()
+#include <linux/kthread.h>  // kthread_*()
+#include <linux/log2.h>	    // roundup_pow_of_two()
+#include <linux/module.h>   // module_param()
+#include <linux/sched.h>    // set_current_state()
+#include <linux/spinlock.h> // spin_lock()
+#include <linux/string.h>   // memmove()
+#include <linux/uaccess.h>  // copy_from_user()
+#include <linux/vmalloc.h>  // vmalloc()
+
+#include "frootspi_debugfs.h"
+#include "frootspi_input.h"
+
+#define RECORD_NAME "frootspi_record"
+#define RECORD_MIN_LEN 64
+#define RECORD_MAX_LEN 65536
+
+extern void frootspi_input_record_state(void);
+extern void frootspi_input_replay_event(const unsigned short type,
+	const unsigned short code, const int value, const ktime_t now);
+extern void frootspi_input_replay_reset(void);
+extern void frootspi_input_kick(void);
+
+// スイッチの値の変化を記録し、後から同じタイミングで再生する
+// 記録は /sys/kernel/debug/frootspi/input/record/trace から
+// struct frootspi_input_event の列として読み出す
+// 同じ形式の列を replay に書くと、記録した時刻の間隔どおりに
+// /dev/frootspi_input0 と /dev/frootspi_{pushsw,dipsw}* へ値を流す
+static bool input_record;
+module_param(input_record, bool, 0444);
+MODULE_PARM_DESC(input_record, "Record switch changes from load time "
+			       "(default off)");
+
+// 記録するイベントの数 (2のべき乗に切り上げる)
+// 一杯になったら古いものから上書きする
+static unsigned int input_record_len = 4096;
+module_param(input_record_len, uint, 0444);
+MODULE_PARM_DESC(input_record_len, "Switch changes kept in the record ring "
+				   "(default 4096)");
+
+// /sys/kernel/debug/frootspi/input/record/
+struct record_stats {
+	atomic64_t recorded; // 記録したイベントの数 (上書きされたものを含む)
+	atomic64_t replayed; // 再生したイベントの数
+};
+
+// イベントの列 (traceを開いた時点の記録のコピーと、replayに書かれた列)
+// replayに書かれた列は、再生が終わっても次の再生を始めるまで残す
+struct record_events {
+	size_t len; // バイト数
+	size_t max_len;
+	struct frootspi_input_event events[];
+};
+
+// record_ring, record_head, record_firstを保護する
+// 値の変化はinput_lockを取ったまま記録するので、input_lockより後に取る
+static DEFINE_SPINLOCK(record_lock);
+static struct frootspi_input_event *record_ring;
+static u64 record_head; // 記録した数 (折り返さず、記録し直しても戻らない)
+static u64 record_first; // 今の記録の最初のイベントの番号
+static u32 record_mask;
+static bool record_enabled;
+
+// 再生の開始・停止を保護する
+static DEFINE_MUTEX(record_replay_lock);
+static struct task_struct *record_replay_task;
+static struct record_events *record_replay_events;
+static bool record_ready;
+// 再生中はスイッチを読んだ値を配らず、再生した値だけを配る
+static bool record_replaying;
+
+static struct record_stats stats;
+static struct frootspi_hist replay_hist;
+static struct dentry *record_debugfs_dir;
+
+bool frootspi_record_enabled(void)
+{
+	return READ_ONCE(record_enabled);
+}
+
+bool frootspi_record_replaying(void)
+{
+	return READ_ONCE(record_replaying);
+}
+
+// 値の変化を記録する (frootspi_input.cがinput_lockを取ったまま呼ぶ)
+// 止めた後にリングを解放できるよう、record_enabledはロックを取ってから見る
+void frootspi_record_event(const struct frootspi_input_event *ev)
+{
+	if (!READ_ONCE(record_enabled)) {
+		return;
+	}
+	spin_lock(&record_lock);
+	if (record_enabled) {
+		record_ring[record_head & record_mask] = *ev;
+		record_head++;
+		atomic64_inc(&stats.recorded);
+	}
+	spin_unlock(&record_lock);
+}
+
+// 記録を消してから記録し始める
+// 最初にその時点の全スイッチの値を記録するので、
+// 途中から記録しても再生したときに同じ状態から始まる
+static void record_start(void)
+{
+	spin_lock(&record_lock);
+	record_first = record_head;
+	spin_unlock(&record_lock);
+	WRITE_ONCE(record_enabled, true);
+	// 誰も開いていなくてもスイッチを読み始める
+	frootspi_input_record_state();
+}
+
+static int record_enable_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(record_enabled);
+	return 0;
+}
+
+static int record_enable_set(void *data, u64 val)
+{
+	mutex_lock(&record_replay_lock);
+	if (val && !record_enabled) {
+		record_start();
+	} else if (!val) {
+		spin_lock(&record_lock);
+		WRITE_ONCE(record_enabled, false);
+		spin_unlock(&record_lock);
+	}
+	mutex_unlock(&record_replay_lock);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(
+	record_enable_fops, record_enable_get, record_enable_set, "%llu\n");
+
+// 開いた時点の記録を古い順にコピーしておき、readで返す
+// 読んでいる間も記録は続き、記録は消えない
+// record_lockは値の変化を配る途中で取るので、コピーはロックの外で行い、
+// コピーしている間に上書きされたイベントは捨てる
+static int record_trace_open(struct inode *inode, struct file *filep)
+{
+	struct record_events *trace;
+	const u64 len = record_mask + 1;
+	const size_t max_len = sizeof(struct frootspi_input_event) * len;
+	u64 head;
+	u64 tail;
+
+	trace = vmalloc(sizeof(struct record_events) + max_len);
+	if (trace == NULL) {
+		printk(KERN_ERR "%s %s: vmalloc() failed.\n", RECORD_NAME,
+			__func__);
+		return -ENOMEM;
+	}
+
+	spin_lock(&record_lock);
+	head = record_head;
+	tail = max(record_first, head > len ? head - len : 0);
+	spin_unlock(&record_lock);
+	for (u64 i = tail; i < head; i++) {
+		trace->events[i - tail] = record_ring[i & record_mask];
+	}
+
+	// イベントiは、i + lenを記録するときに上書きされる
+	// 上書きはrecord_headを進めるのと同じロックの中で行うので、
+	// コピーを終えてから読んだrecord_headより古いものは壊れているかもしれない
+	// コピーしている間に記録し直していたら、前の記録は返さない
+	spin_lock(&record_lock);
+	const u64 valid =
+		max(record_first, record_head > len ? record_head - len : 0);
+	spin_unlock(&record_lock);
+	const u64 start = min(max(tail, valid), head);
+	memmove(trace->events, &trace->events[start - tail],
+		sizeof(struct frootspi_input_event) * (head - start));
+
+	trace->len = sizeof(struct frootspi_input_event) * (head - start);
+	trace->max_len = max_len;
+	filep->private_data = trace;
+	return nonseekable_open(inode, filep);
+}
+
+static ssize_t record_trace_read(
+	struct file *filep, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct record_events *trace = filep->private_data;
+
+	return simple_read_from_buffer(
+		buf, count, ppos, trace->events, trace->len);
+}
+
+static int record_trace_release(struct inode *inode, struct file *filep)
+{
+	vfree(filep->private_data);
+	return 0;
+}
+
+static const struct file_operations record_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = record_trace_open,
+	.read = record_trace_read,
+	.release = record_trace_release,
+	.llseek = no_llseek,
+};
+
+// 再生した値を消してから、スイッチを読んだ値を配り直す
+static void record_replay_finish(void)
+{
+	frootspi_input_replay_reset();
+	WRITE_ONCE(record_replaying, false);
+	frootspi_input_kick();
+}
+
+// 記録した時刻の間隔どおりに、再生した時刻でイベントを流す
+static int record_replay_thread(void *arg)
+{
+	struct record_events *replay = arg;
+	const size_t num_events =
+		replay->len / sizeof(struct frootspi_input_event);
+	const s64 first_ns = replay->events[0].time_ns;
+	const ktime_t started = ktime_get();
+
+	for (size_t i = 0; i < num_events; i++) {
+		const struct frootspi_input_event *ev = &replay->events[i];
+		// 時刻が戻っているイベントは待たずに流す
+		ktime_t expires = ktime_add_ns(
+			started, max_t(s64, ev->time_ns - first_ns, 0));
+
+		for (;;) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (kthread_should_stop()) {
+				__set_current_state(TASK_RUNNING);
+				goto stopped;
+			}
+			// 時刻になれば0、kthread_stop()で起こされれば-EINTR
+			if (!schedule_hrtimeout(&expires, HRTIMER_MODE_ABS)) {
+				break;
+			}
+		}
+
+		// 取りこぼしの印は再生しない
+		if (ev->type == FROOTSPI_EV_DROPPED) {
+			continue;
+		}
+		const ktime_t now = ktime_get();
+		frootspi_input_replay_event(ev->type, ev->code, ev->value, now);
+		frootspi_hist_add(&replay_hist, ktime_sub(now, expires));
+		atomic64_inc(&stats.replayed);
+	}
+
+stopped:
+	record_replay_finish();
+
+	// kthread_stop()されるまで終わらない (task_structを解放させない)
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			break;
+		}
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+// record_replay_lockを取ってから呼ぶ
+static void record_replay_stop_locked(void)
+{
+	if (record_replay_task == NULL) {
+		return;
+	}
+	// 始まる前に止めるとrecord_replay_thread()は呼ばれず、-EINTRが返る
+	if (kthread_stop(record_replay_task) == -EINTR) {
+		record_replay_finish();
+	}
+	record_replay_task = NULL;
+	vfree(record_replay_events);
+	record_replay_events = NULL;
+}
+
+// record_replay_lockを取ってから呼ぶ
+// 成功したらreplayは次に止めるときに解放する
+static int record_replay_start_locked(struct record_events *replay)
+{
+	struct task_struct *task;
+
+	record_replay_stop_locked();
+	WRITE_ONCE(record_replaying, true);
+	task = kthread_run(record_replay_thread, replay, "frootspi_replay");
+	if (IS_ERR(task)) {
+		printk(KERN_ERR "%s %s: kthread_run() failed.\n", RECORD_NAME,
+			__func__);
+		WRITE_ONCE(record_replaying, false);
+		return PTR_ERR(task);
+	}
+	record_replay_task = task;
+	record_replay_events = replay;
+	return 0;
+}
+
+static int record_replay_open(struct inode *inode, struct file *filep)
+{
+	struct record_events *replay;
+	const size_t max_len =
+		sizeof(struct frootspi_input_event) * (record_mask + 1);
+
+	replay = vmalloc(sizeof(struct record_events) + max_len);
+	if (replay == NULL) {
+		printk(KERN_ERR "%s %s: vmalloc() failed.\n", RECORD_NAME,
+			__func__);
+		return -ENOMEM;
+	}
+	replay->len = 0;
+	replay->max_len = max_len;
+	filep->private_data = replay;
+	return nonseekable_open(inode, filep);
+}
+
+// 閉じるまで溜めておき、record_replay_release()で再生を始める
+static ssize_t record_replay_write(struct file *filep, const char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct record_events *replay = filep->private_data;
+
+	if (count > replay->max_len - replay->len) {
+		return -EFBIG;
+	}
+	if (copy_from_user((char *)replay->events + replay->len, buf, count)) {
+		printk(KERN_ERR "%s %s: copy_from_user() failed.\n",
+			RECORD_NAME, __func__);
+		return -EFAULT;
+	}
+	replay->len += count;
+	return count;
+}
+
+// close()のたびに呼ばれ、エラーはclose()の戻り値になる
+// (release()の戻り値は捨てられるので、ここで書き込んだ長さを確かめる)
+static int record_replay_flush(struct file *filep, fl_owner_t id)
+{
+	struct record_events *replay = filep->private_data;
+
+	if (replay->len % sizeof(struct frootspi_input_event)) {
+		printk(KERN_ERR "%s %s: %zu bytes is not a multiple of "
+				"struct frootspi_input_event.\n",
+			RECORD_NAME, __func__, replay->len);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// 書き終えたら再生を始める (再生中なら止めてから)
+// 何も書かずに閉じたら、再生を止めるだけ
+// 長さが正しくなければ、record_replay_flush()がエラーを返したので捨てる
+static int record_replay_release(struct inode *inode, struct file *filep)
+{
+	struct record_events *replay = filep->private_data;
+	int retval = 0;
+
+	mutex_lock(&record_replay_lock);
+	if (!record_ready) {
+		goto out;
+	}
+	if (replay->len == 0) {
+		record_replay_stop_locked();
+		goto out;
+	}
+	if (replay->len % sizeof(struct frootspi_input_event)) {
+		goto out;
+	}
+	retval = record_replay_start_locked(replay);
+	if (retval == 0) {
+		replay = NULL;
+	}
+out:
+	mutex_unlock(&record_replay_lock);
+	vfree(replay);
+	return retval;
+}
+
+static const struct file_operations record_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = record_replay_open,
+	.write = record_replay_write,
+	.flush = record_replay_flush,
+	.release = record_replay_release,
+	.llseek = no_llseek,
+};
+
+// frootspi_input.cのregister_input_dev()から呼ぶ
+int frootspi_record_init(struct dentry *parent)
+{
+	const unsigned int len = roundup_pow_of_two(
+		clamp_t(unsigned int, input_record_len, RECORD_MIN_LEN,
+			RECORD_MAX_LEN));
+
+	record_ring = vmalloc(sizeof(struct frootspi_input_event) * len);
+	if (record_ring == NULL) {
+		printk(KERN_ERR "%s %s: vmalloc() failed.\n", RECORD_NAME,
+			__func__);
+		return -ENOMEM;
+	}
+	record_mask = len - 1;
+	record_head = 0;
+
+	record_debugfs_dir = debugfs_create_dir("record", parent);
+	debugfs_create_file_unsafe("enable", 0600, record_debugfs_dir, NULL,
+		&record_enable_fops);
+	debugfs_create_file(
+		"trace", 0400, record_debugfs_dir, NULL, &record_trace_fops);
+	debugfs_create_file(
+		"replay", 0200, record_debugfs_dir, NULL, &record_replay_fops);
+	debugfs_create_bool(
+		"replaying", 0444, record_debugfs_dir, &record_replaying);
+	frootspi_debugfs_create_counter(
+		"recorded", record_debugfs_dir, &stats.recorded);
+	frootspi_debugfs_create_counter(
+		"replayed", record_debugfs_dir, &stats.replayed);
+	frootspi_debugfs_create_hist(
+		"replay_latency", record_debugfs_dir, &replay_hist);
+
+	mutex_lock(&record_replay_lock);
+	record_ready = true;
+	if (input_record) {
+		record_start();
+	}
+	mutex_unlock(&record_replay_lock);
+	return 0;
+}
+
+void frootspi_record_exit(void)
+{
+	// 開いたままのreplayを閉じても、再生を始めないようにする
+	mutex_lock(&record_replay_lock);
+	record_ready = false;
+	record_replay_stop_locked();
+	spin_lock(&record_lock);
+	WRITE_ONCE(record_enabled, false);
+	spin_unlock(&record_lock);
+	mutex_unlock(&record_replay_lock);
+
+	debugfs_remove_recursive(record_debugfs_dir);
+	vfree(record_ring);
+	record_ring = NULL;
+}
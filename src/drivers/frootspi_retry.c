@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/delay.h> // udelay(), usleep_range()
+
+#include "frootspi_retry.h"
+
+// これより短い待ち時間はタイマーを使わずにビジーウェイトする
+// (Documentation/timers/timers-howto.rst)
+#define RETRY_UDELAY_MAX_US 10
+
+void frootspi_retry_start(struct frootspi_retry *retry,
+	const unsigned int deadline_us, const unsigned int backoff_us,
+	const unsigned int backoff_max_us)
+{
+	retry->deadline = ktime_add_us(ktime_get(), deadline_us);
+	retry->backoff_us = max(backoff_us, 1U);
+	retry->backoff_max_us = max(backoff_max_us, retry->backoff_us);
+}
+
+bool frootspi_retry_backoff(struct frootspi_retry *retry)
+{
+	const unsigned int delay_us = retry->backoff_us;
+	// usleep_range()は最大で1/4だけ長く眠る
+	const unsigned int slack_us = delay_us / 4;
+
+	if (ktime_after(ktime_add_us(ktime_get(), delay_us + slack_us),
+		    retry->deadline)) {
+		return false;
+	}
+	if (delay_us <= RETRY_UDELAY_MAX_US) {
+		udelay(delay_us);
+	} else {
+		usleep_range(delay_us, delay_us + slack_us);
+	}
+	retry->backoff_us = min(delay_us * 2, retry->backoff_max_us);
+	return true;
+}
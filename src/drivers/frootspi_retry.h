@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef FROOTSPI_RETRY_H
+#define FROOTSPI_RETRY_H
+
+#include <linux/ktime.h> // ktime_t
+
+// SPI、I2Cの1回の操作のリトライ
+// 最初の試行から締め切りまでの間だけ、待ち時間を倍にしながら再試行する
+// バスの調子が悪くても、1回の操作にかかる時間は締め切りを超えない
+struct frootspi_retry {
+	ktime_t deadline;
+	unsigned int backoff_us; // 次の再試行までの待ち時間
+	unsigned int backoff_max_us;
+};
+
+// deadline_usが0ならリトライしない
+void frootspi_retry_start(struct frootspi_retry *retry,
+	const unsigned int deadline_us, const unsigned int backoff_us,
+	const unsigned int backoff_max_us);
+// 次の試行まで待ってtrueを返す
+// 待つと締め切りを過ぎてしまうなら、待たずにfalseを返す
+bool frootspi_retry_backoff(struct frootspi_retry *retry);
+
+#endif
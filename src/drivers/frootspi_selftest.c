@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/math64.h> // div64_u64()
+#include <linux/slab.h>	  // kzalloc()
+#include <linux/sort.h>	  // sort()
+
+#include "frootspi_selftest.h"
+
+#define SELFTEST_KOBJ_NAME "selftest"
+
+static int selftest_compare_u64(const void *a, const void *b)
+{
+	const u64 x = *(const u64 *)a;
+	const u64 y = *(const u64 *)b;
+	return (x > y) - (x < y);
+}
+
+// 並べ替えたsamplesのper_mille/1000の位置の値
+static u64 selftest_percentile(
+	const u64 *sorted, const u32 n, const u32 per_mille)
+{
+	const u32 index = (u64)n * per_mille / 1000;
+	return sorted[min(index, n - 1)];
+}
+
+#define SELFTEST_SHOW(_name, _format)                                          \
+	static ssize_t _name##_show(                                           \
+		struct kobject *kobj, struct kobj_attribute *attr, char *buf)  \
+	{                                                                      \
+		struct frootspi_selftest *selftest = container_of(             \
+			kobj, struct frootspi_selftest, kobj);                 \
+		return scnprintf(buf, PAGE_SIZE, _format "\n",                 \
+			selftest->_name);                                      \
+	}                                                                      \
+	static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+
+SELFTEST_SHOW(rounds, "%u");
+SELFTEST_SHOW(errors, "%u");
+SELFTEST_SHOW(min_ns, "%llu");
+SELFTEST_SHOW(median_ns, "%llu");
+SELFTEST_SHOW(p99_ns, "%llu");
+SELFTEST_SHOW(max_ns, "%llu");
+SELFTEST_SHOW(clock_hz, "%u");
+SELFTEST_SHOW(effective_hz, "%u");
+
+static struct attribute *selftest_attrs[] = {
+	&rounds_attr.attr,
+	&errors_attr.attr,
+	&min_ns_attr.attr,
+	&median_ns_attr.attr,
+	&p99_ns_attr.attr,
+	&max_ns_attr.attr,
+	&clock_hz_attr.attr,
+	&effective_hz_attr.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(selftest);
+
+// 最後のkobject_put()で呼ばれる
+// sysfsのファイルを開いたまま削除されても、閉じるまで結果は解放されない
+static void selftest_release(struct kobject *kobj)
+{
+	kfree(container_of(kobj, struct frootspi_selftest, kobj));
+}
+
+static struct kobj_type selftest_ktype = {
+	.release = selftest_release,
+	.sysfs_ops = &kobj_sysfs_ops,
+	.default_groups = selftest_groups,
+};
+
+struct frootspi_selftest *frootspi_selftest_publish(struct device *dev,
+	const char *name, u64 *samples, const u32 rounds, const u32 errors,
+	const u32 clock_hz, const u64 bits, const u64 bus_ns)
+{
+	struct frootspi_selftest *selftest;
+
+	if (rounds == 0) {
+		return NULL;
+	}
+	selftest = kzalloc(sizeof(struct frootspi_selftest), GFP_KERNEL);
+	if (selftest == NULL) {
+		printk(KERN_ERR "%s %s: kzalloc() failed.\n", name, __func__);
+		return NULL;
+	}
+
+	sort(samples, rounds, sizeof(u64), selftest_compare_u64, NULL);
+	selftest->rounds = rounds;
+	selftest->errors = errors;
+	selftest->min_ns = samples[0];
+	selftest->median_ns = selftest_percentile(samples, rounds, 500);
+	selftest->p99_ns = selftest_percentile(samples, rounds, 990);
+	selftest->max_ns = samples[rounds - 1];
+	selftest->clock_hz = clock_hz;
+	if (bus_ns > 0) {
+		selftest->effective_hz = div64_u64(bits * NSEC_PER_SEC, bus_ns);
+	}
+
+	printk(KERN_INFO "%s %s: %u rounds, %u errors, min %llu ns, "
+			 "median %llu ns, p99 %llu ns, %u Hz (clock %u Hz).\n",
+		name, __func__, rounds, errors, selftest->min_ns,
+		selftest->median_ns, selftest->p99_ns, selftest->effective_hz,
+		clock_hz);
+
+	if (kobject_init_and_add(&selftest->kobj, &selftest_ktype, &dev->kobj,
+		    SELFTEST_KOBJ_NAME)) {
+		printk(KERN_ERR "%s %s: kobject_init_and_add() failed.\n",
+			name, __func__);
+		// 初期化済みなので、kfree()ではなくkobject_put()で解放する
+		kobject_put(&selftest->kobj);
+		return NULL;
+	}
+	return selftest;
+}
+
+void frootspi_selftest_remove(struct frootspi_selftest *selftest)
+{
+	if (selftest == NULL) {
+		return;
+	}
+	kobject_del(&selftest->kobj);
+	kobject_put(&selftest->kobj);
+}
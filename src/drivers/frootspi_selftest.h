@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef FROOTSPI_SELFTEST_H
+#define FROOTSPI_SELFTEST_H
+
+#include <linux/device.h>  // struct device
+#include <linux/kobject.h> // struct kobject
+
+// probe()時のレイテンシ自己診断の回数の上限 (サンプルを全て保持するため)
+#define FROOTSPI_SELFTEST_MAX_ROUNDS 100000
+
+// 自己診断の結果 (<デバイスのsysfs>/selftest/)
+struct frootspi_selftest {
+	struct kobject kobj;
+	u32 rounds;
+	u32 errors; // 通信の失敗と、読み戻した値の不一致
+	u64 min_ns;
+	u64 median_ns;
+	u64 p99_ns;
+	u64 max_ns;
+	u32 clock_hz;	  // 設定されているバスのクロック
+	u32 effective_hz; // 転送したビット数 / バスの時間
+};
+
+// samplesを並べ替えて集計し、devのsysfsにselftest/として公開する
+// bitsとbus_nsは自己診断の間に転送したビット数とバスの時間の合計
+// 公開できなければNULLを返す (自己診断の失敗でprobe()を止めないこと)
+struct frootspi_selftest *frootspi_selftest_publish(struct device *dev,
+	const char *name, u64 *samples, const u32 rounds, const u32 errors,
+	const u32 clock_hz, const u64 bits, const u64 bus_ns);
+// NULLでも良い
+void frootspi_selftest_remove(struct frootspi_selftest *selftest);
+
+#endif
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM frootspi
+
+#if !defined(_FROOTSPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FROOTSPI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// MCP23S08のレジスタ1回分の読み書き
+// len: 連続して転送したレジスタ数, tx/rx: 先頭レジスタのデータ
+// wait_ns: mutexの待ち時間, xfer_ns: spi_sync()にかかった時間
+TRACE_EVENT(frootspi_mcp23s08_xfer,
+	TP_PROTO(u8 addr, u8 reg, u8 rw, u8 len, u8 tx, u8 rx, int ret,
+		u64 wait_ns, u64 xfer_ns),
+	TP_ARGS(addr, reg, rw, len, tx, rx, ret, wait_ns, xfer_ns),
+	TP_STRUCT__entry(
+		__field(u8, addr)
+		__field(u8, reg)
+		__field(u8, rw)
+		__field(u8, len)
+		__field(u8, tx)
+		__field(u8, rx)
+		__field(int, ret)
+		__field(u64, wait_ns)
+		__field(u64, xfer_ns)
+	),
+	TP_fast_assign(
+		__entry->addr = addr;
+		__entry->reg = reg;
+		__entry->rw = rw;
+		__entry->len = len;
+		__entry->tx = tx;
+		__entry->rx = rx;
+		__entry->ret = ret;
+		__entry->wait_ns = wait_ns;
+		__entry->xfer_ns = xfer_ns;
+	),
+	TP_printk("addr=%u reg=0x%02x %s len=%u tx=0x%02x rx=0x%02x ret=%d "
+		  "wait_ns=%llu xfer_ns=%llu",
+		__entry->addr, __entry->reg, __entry->rw ? "read" : "write",
+		__entry->len, __entry->tx, __entry->rx, __entry->ret,
+		__entry->wait_ns, __entry->xfer_ns)
+);
+
+// AQM0802Aへの1バイト書き込み
+// xfer_ns: i2c_smbus_write_byte_data()にかかった時間
+DECLARE_EVENT_CLASS(frootspi_aqm0802a_byte,
+	TP_PROTO(u8 data, int ret, u64 xfer_ns),
+	TP_ARGS(data, ret, xfer_ns),
+	TP_STRUCT__entry(
+		__field(u8, data)
+		__field(int, ret)
+		__field(u64, xfer_ns)
+	),
+	TP_fast_assign(
+		__entry->data = data;
+		__entry->ret = ret;
+		__entry->xfer_ns = xfer_ns;
+	),
+	TP_printk("data=0x%02x ret=%d xfer_ns=%llu", __entry->data,
+		__entry->ret, __entry->xfer_ns)
+);
+
+DEFINE_EVENT(frootspi_aqm0802a_byte, frootspi_aqm0802a_command,
+	TP_PROTO(u8 data, int ret, u64 xfer_ns),
+	TP_ARGS(data, ret, xfer_ns)
+);
+
+DEFINE_EVENT(frootspi_aqm0802a_byte, frootspi_aqm0802a_data,
+	TP_PROTO(u8 data, int ret, u64 xfer_ns),
+	TP_ARGS(data, ret, xfer_ns)
+);
+
+#endif /* _FROOTSPI_TRACE_H */
+
+// モジュールのソースと同じディレクトリにあるヘッダを読ませる
+// KbuildでCFLAGSに-I$(src)を追加している
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE frootspi_trace
+#include <trace/define_trace.h>
@@ -1,127 +1,906 @@
 // SPDX-License-Identifier: GPL-2.0
 
-#include <linux/module.h>  // MODULE_DEVICE_TABLE()
-#include <linux/spi/spi.h> // spi_*()
+#include <linux/interrupt.h> // request_threaded_irq()
+#include <linux/ktime.h>    // ktime_get()
+#include <linux/mod_devicetable.h> // struct of_device_id
+#include <linux/module.h>   // MODULE_DEVICE_TABLE()
+#include <linux/property.h> // device_property_*()
+#include <linux/seq_file.h> // seq_*()
+#include <linux/spi/spi.h>  // spi_*()
+#include <linux/workqueue.h> // delayed_work
 
+#include "frootspi_chardev.h"
+#include "frootspi_debugfs.h"
+#include "frootspi_fault.h"
+#include "frootspi_retry.h"
+#include "frootspi_selftest.h"
+#include "frootspi_trace.h"
 #include "mcp23s08_driver.h"
 
 // ---------- SPI driver ----------
 #define SPI_DRIVER_NAME "frootspi_mcp23s08_driver"
-#define SPI_BUS_NUM 1
-#define SPI_CHIP_SELECT 0
-#define MCP23S08_PACKET_SIZE 3
+#define SPI_MODE SPI_MODE_0
+#define MCP23S08_HEADER_SIZE 2 // Opcode + レジスタアドレス
+#define MCP23S08_PACKET_SIZE (MCP23S08_HEADER_SIZE + 1)
+// 全レジスタを1回の転送で読み書きするときのパケットサイズ
+#define MCP23S08_BURST_SIZE (MCP23S08_HEADER_SIZE + MCP23S08_REG_SIZE)
 #define MCP23S08_WORD_SIZE 8
-#define MCP23S08_PIN_A0 0 // A0ピンの値（電位）(1/0)
-#define MCP23S08_PIN_A1 0 // A1ピンの値（電位）(1/0)
-#define MCP23S08_READ 1
-#define MCP23S08_WRITE 0
-#define MCP23S08_REG_IODIR 0x00 // 入出力設定
-#define MCP23S08_REG_IPOL 0x01 // 入力極性設定（GPIOの論理反転できる）
-#define MCP23S08_REG_GPINTEN 0x02 // 割り込みON/OFF設定
-#define MCP23S08_REG_DEFVAL 0x03  // 割り込みのデフォルト値設定
-#define MCP23S08_REG_INTCON 0x04  // 割り込み制御設定
-#define MCP23S08_REG_IOCON 0x05	  // エキスパンダ全体の設定
-#define MCP23S08_REG_GPPU 0x06	  // プルアップ設定
-#define MCP23S08_REG_INTF 0x07	  // 割り込みフラグ
-#define MCP23S08_REG_INTCAP 0x08  // 割り込み時の論理レベル
-#define MCP23S08_REG_GPIO 0x09	  // GPIO
-#define MCP23S08_REG_OLAT 0x0a	  // 出力ラッチレジスタ
-#define MCP23S08_REG_SIZE 0x0b
+#define MCP23S08_DEFAULT_CHIP_MASK 0x01 // アドレス0のMCP23S08だけが存在する
+#define MCP23S08_MAX_SPEED_HZ 10000000 // データシート上の最大クロック
+#define MCP23S08_SAFE_SPEED_HZ 1000000 // 動作実績のあるクロック
+#define MCP23S08_MIN_SPEED_HZ 100000
+#define MCP23S08_VALIDATE_ROUNDS 32 // クロック検証の書き込み/読み出し回数
+#define MCP23S08_ASYNC_SLOTS 8 // 非同期書き込みキューの長さ
+#define MCP23S08_FENCE_TIMEOUT_MS 1000
+
+// SPIクロック周波数
+// 基板のリビジョンに合わせて insmod frootspi.ko spi_speed_hz=4000000
+// のように指定する。通信できなかったら自動的に周波数を下げる
+static unsigned int spi_speed_hz = MCP23S08_SAFE_SPEED_HZ;
+module_param(spi_speed_hz, uint, 0444);
+MODULE_PARM_DESC(spi_speed_hz, "MCP23S08 SPI clock in Hz (default 1MHz, "
+			       "max 10MHz)");
+
+// プッシュスイッチの押下をMCP23S08の割り込み(INTCON比較モード)で検出する
+// 押されていない間はSPI通信をしない。デバイスツリーでinterruptsの指定が必要
+static bool pushsw_wake_on_press;
+module_param(pushsw_wake_on_press, bool, 0444);
+MODULE_PARM_DESC(pushsw_wake_on_press, "Detect push switch presses with the "
+				       "MCP23S08 interrupt (default off)");
+
+// 押されているスイッチが離されたかを確認する間隔
+static unsigned int pushsw_release_poll_ms = 20;
+module_param(pushsw_release_poll_ms, uint, 0444);
+MODULE_PARM_DESC(pushsw_release_poll_ms, "Release polling interval in ms "
+					 "while a switch is pressed");
+
+// spi_sync()が失敗したときのリトライ
+// 最初の試行からspi_retry_deadline_usまでの間、spi_retry_backoff_usから
+// 倍にしながらspi_retry_backoff_max_usまで待って再試行する
+static unsigned int spi_retry_deadline_us = 1000;
+module_param(spi_retry_deadline_us, uint, 0644);
+MODULE_PARM_DESC(spi_retry_deadline_us, "Give up retrying an MCP23S08 transfer "
+					"after this many us (default 1000, "
+					"0 = no retry)");
+
+static unsigned int spi_retry_backoff_us = 20;
+module_param(spi_retry_backoff_us, uint, 0644);
+MODULE_PARM_DESC(spi_retry_backoff_us, "First MCP23S08 retry backoff in us "
+				       "(default 20)");
+
+static unsigned int spi_retry_backoff_max_us = 200;
+module_param(spi_retry_backoff_max_us, uint, 0644);
+MODULE_PARM_DESC(spi_retry_backoff_max_us, "MCP23S08 retry backoff cap in us "
+					   "(default 200)");
+
+// リトライしても失敗した操作がこの回数続いたら、レジスタを設定し直す
+// 電源の瞬断などでMCP23S08がリセットされても、出力とHAENを復旧できる
+static unsigned int spi_reinit_threshold = 3;
+module_param(spi_reinit_threshold, uint, 0644);
+MODULE_PARM_DESC(spi_reinit_threshold, "Re-initialize the MCP23S08 after this "
+				       "many failed operations in a row "
+				       "(default 3, 0 = never)");
+
+// probe()時にDEFVALの書き込みと読み戻しを繰り返し、レイテンシを計測する回数
+// 結果は/sys/bus/spi/devices/<デバイス>/selftest/に公開する (0なら計測しない)
+static unsigned int selftest_rounds;
+module_param(selftest_rounds, uint, 0444);
+MODULE_PARM_DESC(selftest_rounds, "MCP23S08 DEFVAL round-trips timed at probe "
+				  "(default 0 = off)");
+
+// デバイスツリーのcompatibleと対応するデバイスドライバを探すテーブル
+// カーネルにはMCP23S08のGPIOドライバ(pinctrl-mcp23s08)があり、
+// "microchip,mcp23s08"や"mcp23s08"だとそちらと取り合いになるので、
+// FrootsPi専用の名前を使う
+static const struct of_device_id mcp23s08_of_match[] = {
+	{.compatible = "frootspi,mcp23s08-io"},
+	{},
+};
+MODULE_DEVICE_TABLE(of, mcp23s08_of_match);
 
 // デバイスを識別するテーブル { "name", "好きなデータ"}を追加する
-// カーネルはこの"name"をもとに対応するデバイスドライバを探す
-// もしmcp23s08用のデバイスドライバが存在したら、それが使われる
-//  → mcp23s08ドライバが存在するっぽい
+// デバイスツリーから作られたSPIデバイスのmodaliasは、
+// compatibleからベンダー名を取り除いたもの("mcp23s08-io")になる
+// モジュールの自動ロードに使われる
 static struct spi_device_id mcp23s08_id_table[] = {
-	{"mcp23s08", 0},
+	{"mcp23s08-io", 0},
 	{},
 };
 MODULE_DEVICE_TABLE(spi, mcp23s08_id_table);
 
-// SPIドライバの設定に使われる構造体
-static struct spi_board_info mcp23s08_info = {
-	.modalias = "mcp23s08",		// デバイス名
-	.max_speed_hz = 1000000,	// SCLKの最大周波数
-	.bus_num = SPI_BUS_NUM,		// SPIバス番号。0 or 1
-	.chip_select = SPI_CHIP_SELECT, // チップセレクト番号。0~2
-	.mode = SPI_MODE_0,		// SPIモード
+// ピンと機能(LED, プッシュスイッチ, DIPスイッチ)の対応表
+struct mcp23s08_pinmap {
+	unsigned char led[MCP23S08_MAX_LEDS];
+	unsigned char pushsw[MCP23S08_MAX_PUSHSW];
+	unsigned char dipsw[MCP23S08_MAX_DIPSW];
+	int num_leds;
+	int num_pushsw;
+	int num_dipsw;
+};
+
+// キャラクタデバイスはエキスパンダのprobe時に登録する
+extern int register_pushsw_dev(struct mcp23s08_drvdata *expander,
+	const unsigned char *pins, const int num_pins);
+extern void unregister_pushsw_dev(void);
+extern int register_dipsw_dev(struct mcp23s08_drvdata *expander,
+	const unsigned char *pins, const int num_pins);
+extern void unregister_dipsw_dev(void);
+extern int register_led_dev(struct mcp23s08_drvdata *expander,
+	const unsigned char *pins, const int num_pins);
+extern void unregister_led_dev(void);
+extern void frootspi_input_kick(void);
+extern void frootspi_report_init_time(
+	const char *name, const ktime_t started, const int retval);
+
+// 通信の統計 (/sys/kernel/debug/frootspi/mcp23s08/)
+struct mcp23s08_stats {
+	atomic64_t transactions;
+	atomic64_t bytes;
+	atomic64_t errors; // spi_sync()、spi_async()の失敗 (リトライを含む)
+	atomic64_t retries;
+	atomic64_t failures; // リトライしても失敗した操作
+	atomic64_t reinits;  // レジスタを設定し直した回数
+	atomic64_t spi_sync_ns; // spi_sync()にかかった時間の累計
+	atomic64_t async_merges; // 送信前の書き込みに統合された非同期書き込み
+	atomic64_t wake_irqs; // プッシュスイッチの押下で発生した割り込み
+};
+
+// spi_async()で送るレジスタ書き込み1回分
+// 送信中のメッセージを書き換えないよう、スロットごとにバッファを持つ
+struct mcp23s08_async_slot {
+	struct mcp23s08_drvdata *data;
+	unsigned char addr;
+	unsigned char reg;
+	ktime_t queued; // キューに入れた時刻
+	struct spi_transfer xfer;
+	struct spi_message msg;
+	unsigned char tx[MCP23S08_PACKET_SIZE] ____cacheline_aligned;
 };
 
 // SPI通信に使うデータをまとめた構造体
 struct mcp23s08_drvdata {
 	struct spi_device *spi;
 	struct mutex my_mutex;
+	// 同じCSを共有するMCP23S08のアドレス (bit n = アドレスnが存在する)
+	unsigned char chip_mask;
+	struct mcp23s08_pinmap pinmap;
+	// レイテンシ計測用 (/sys/kernel/debug/frootspi/mcp23s08/)
+	struct dentry *debugfs_dir;
+	struct frootspi_hist xfer_hist;
+	struct frootspi_hist mutex_wait_hist;
+	struct frootspi_hist mutex_hold_hist;
+	struct frootspi_hist async_hist; // キューに入れてから送信完了まで
+	struct mcp23s08_stats stats;
+	// /sys/kernel/debug/frootspi/mcp23s08/fail_*/
+	struct frootspi_fault fault;
+	u32 speed_hz; // 検証済みのSPIクロック周波数
+	struct frootspi_selftest *selftest; // 自己診断しなければNULL
+	// リトライしても失敗した操作が続いた数
+	// spi_reinit_thresholdに達したらreinit_workでレジスタを設定し直す
+	atomic_t consecutive_failures;
+	bool reinit_enabled; // probe()が終わってから、remove()まで
+	bool reinit_running;
+	struct work_struct reinit_work;
+	// 非同期書き込みキュー (async_lockで保護)
+	// 先頭のスロットだけを送信し、完了したら次のスロットを送信する
+	spinlock_t async_lock;
+	wait_queue_head_t async_wait;
+	int async_head;	 // 送信中または次に送信するスロット
+	int async_count; // キューに入っているスロットの数
+	bool async_busy; // 先頭のスロットを送信中
+	int async_error; // 前回のフェンス以降に発生したエラー
+	unsigned char olat[MCP23S08_MAX_CHIPS]; // 出力ラッチのシャドウ
+	struct mcp23s08_async_slot slots[MCP23S08_ASYNC_SLOTS];
+	// 押下検出モード (wake_mutexで保護)
+	// プッシュスイッチのピンだけGPINTENを有効にし、DEFVAL(= 1)と比較する
+	// 押されたピンは離されるまで割り込みを止め、タイマーで離されたかを確認する
+	bool wake_enabled;
+	struct mutex wake_mutex;
+	unsigned char wake_mask[MCP23S08_MAX_CHIPS];  // プッシュスイッチのピン
+	unsigned char wake_armed[MCP23S08_MAX_CHIPS]; // GPINTENの値
+	unsigned char wake_state[MCP23S08_MAX_CHIPS]; // 最後に見たGPIOの値
+	struct delayed_work release_work;
 	// DMAに怒られないために送受信バッファのアラインメントを整える
-	unsigned char tx[MCP23S08_PACKET_SIZE] ____cacheline_aligned;
-	unsigned char rx[MCP23S08_PACKET_SIZE] ____cacheline_aligned;
+	unsigned char tx[MCP23S08_BURST_SIZE] ____cacheline_aligned;
+	unsigned char rx[MCP23S08_BURST_SIZE] ____cacheline_aligned;
 	struct spi_transfer xfer ____cacheline_aligned;
 	struct spi_message msg ____cacheline_aligned;
 };
 
-static unsigned int mcp23s08_control_reg(const unsigned char reg,
-	const unsigned char rw, const unsigned char write_data,
-	unsigned char *read_data)
+// 連続したレジスタをまとめて読み書きする
+// IOCON.SEQOP = 0 の間はアドレスポインタが自動でインクリメントされるので、
+// reg から len 個のレジスタを1回のspi_sync()で転送できる
+// 書き込みのときはbufの内容を送り、読み出しのときはbufに受信データを格納する
+static int mcp23s08_transfer_once(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char reg,
+	const unsigned char rw, unsigned char *buf, const int len)
 {
-	char str[128];
-
-	// SPIバス番号に紐付いたマスターを取得
-	struct spi_master *master = spi_busnum_to_master(mcp23s08_info.bus_num);
-	// SPIマスターが使用しているバスとCSを文字列に変換
-	snprintf(str, sizeof(str), "%s.%u", dev_name(&master->dev),
-		mcp23s08_info.chip_select);
-
-	// 文字列"{bus}.{cs}"をもとに、デバイスを取得
-	struct device *dev = bus_find_device_by_name(&spi_bus_type, NULL, str);
-	// struct deviceを struct spi_deviceに変換
-	struct spi_device *spi = to_spi_device(dev);
-	struct mcp23s08_drvdata *data =
-		(struct mcp23s08_drvdata *)spi_get_drvdata(spi);
-
 	// 排他制御開始！
+	ktime_t lock_requested = ktime_get();
 	mutex_lock(&data->my_mutex);
+	ktime_t lock_acquired = ktime_get();
 	// tx[0] = Opcode = 0b0100_0{A1}{A0}{R/W}
-	data->tx[0] = 0x40;
-	data->tx[0] |= MCP23S08_PIN_A1 << 2;
-	data->tx[0] |= MCP23S08_PIN_A0 << 1;
+	data->tx[0] = MCP23S08_OPCODE;
+	data->tx[0] |= (addr & 0x03) << 1;
 	data->tx[0] |= rw << 0;
 	data->tx[1] = reg;
-	data->tx[2] = write_data;
-	int retval = spi_sync(data->spi, &data->msg);
+	if (rw == MCP23S08_WRITE) {
+		memcpy(&data->tx[MCP23S08_HEADER_SIZE], buf, len);
+	} else {
+		memset(&data->tx[MCP23S08_HEADER_SIZE], 0, len);
+	}
+	data->xfer.len = MCP23S08_HEADER_SIZE + len;
+	ktime_t xfer_started = ktime_get();
+	// 注入した遅延は通信にかかった時間として数える
+	int retval = frootspi_fault_inject(&data->fault, data->xfer.len);
+	if (retval == 0) {
+		retval = spi_sync(data->spi, &data->msg);
+	}
+	ktime_t xfer_finished = ktime_get();
+	if (retval == 0 && rw == MCP23S08_READ) {
+		frootspi_fault_corrupt(
+			&data->fault, &data->rx[MCP23S08_HEADER_SIZE], len);
+	}
+	const unsigned char tx = data->tx[MCP23S08_HEADER_SIZE];
+	const unsigned char rx = data->rx[MCP23S08_HEADER_SIZE];
+	if (retval == 0 && rw == MCP23S08_READ) {
+		memcpy(buf, &data->rx[MCP23S08_HEADER_SIZE], len);
+	}
 	// 排他制御終了
 	mutex_unlock(&data->my_mutex);
 
+	ktime_t wait = ktime_sub(lock_acquired, lock_requested);
+	ktime_t xfer = ktime_sub(xfer_finished, xfer_started);
+	frootspi_hist_add(&data->mutex_wait_hist, wait);
+	frootspi_hist_add(&data->mutex_hold_hist,
+		ktime_sub(xfer_finished, lock_acquired));
+	frootspi_hist_add(&data->xfer_hist, xfer);
+	atomic64_inc(&data->stats.transactions);
+	atomic64_add(MCP23S08_HEADER_SIZE + len, &data->stats.bytes);
+	atomic64_add(ktime_to_ns(xfer), &data->stats.spi_sync_ns);
+	trace_frootspi_mcp23s08_xfer(addr, reg, rw, len, tx, rx, retval,
+		ktime_to_ns(wait), ktime_to_ns(xfer));
+
 	if (retval) {
-		printk(KERN_WARNING "%s %s: spi_sync() failed.\n",
-			SPI_DRIVER_NAME, __func__);
-	} else {
-		*read_data = data->rx[2];
+		atomic64_inc(&data->stats.errors);
+		printk_ratelimited(KERN_WARNING "%s %s: spi_sync() failed "
+						"(%d).\n",
+			SPI_DRIVER_NAME, __func__, retval);
+	}
+
+	return retval;
+}
+
+// 操作の結果を数え、失敗が続いたらレジスタの設定し直しを予約する
+// spi_async()の完了コールバックからも呼ばれるので、スリープしない
+static void mcp23s08_count_result(
+	struct mcp23s08_drvdata *data, const int retval)
+{
+	if (retval == 0) {
+		atomic_set(&data->consecutive_failures, 0);
+		return;
+	}
+	atomic64_inc(&data->stats.failures);
+	// 設定し直している最中の失敗で、もう一度予約しない
+	if (!READ_ONCE(data->reinit_enabled) ||
+		READ_ONCE(data->reinit_running)) {
+		return;
+	}
+	const unsigned int threshold = READ_ONCE(spi_reinit_threshold);
+	if (threshold > 0 &&
+		atomic_inc_return(&data->consecutive_failures) >= threshold) {
+		atomic_set(&data->consecutive_failures, 0);
+		schedule_work(&data->reinit_work);
 	}
+}
+
+// 連続したレジスタをまとめて読み書きする
+// spi_sync()が失敗したら、spi_retry_deadline_usまでリトライする
+// リトライの間はmutexを離すので、他の通信を止めない
+static int mcp23s08_transfer(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char reg,
+	const unsigned char rw, unsigned char *buf, const int len)
+{
+	struct frootspi_retry retry;
+	int retval;
 
+	if (len < 1 || reg + len > MCP23S08_REG_SIZE) {
+		printk(KERN_ERR "%s %s: invalid register range 0x%02x+%d.\n",
+			SPI_DRIVER_NAME, __func__, reg, len);
+		return -EINVAL;
+	}
+
+	frootspi_retry_start(&retry, READ_ONCE(spi_retry_deadline_us),
+		READ_ONCE(spi_retry_backoff_us),
+		READ_ONCE(spi_retry_backoff_max_us));
+	for (;;) {
+		retval = mcp23s08_transfer_once(data, addr, reg, rw, buf, len);
+		if (retval == 0 || !frootspi_retry_backoff(&retry)) {
+			break;
+		}
+		atomic64_inc(&data->stats.retries);
+	}
+	mcp23s08_count_result(data, retval);
 	return retval;
 }
 
+static unsigned int mcp23s08_control_reg(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char reg,
+	const unsigned char rw, const unsigned char write_data,
+	unsigned char *read_data)
+{
+	unsigned char buf = write_data;
+	int retval = mcp23s08_transfer(data, addr, reg, rw, &buf, 1);
+	if (retval == 0) {
+		*read_data = buf;
+	}
+	return retval;
+}
+
+// regからlen個のレジスタを1回の転送で読み出す
+int mcp23s08_read_regs(struct mcp23s08_drvdata *data, const unsigned char addr,
+	const unsigned char reg, unsigned char *buf, const int len)
+{
+	return mcp23s08_transfer(data, addr, reg, MCP23S08_READ, buf, len);
+}
+
+// regからlen個のレジスタに1回の転送で書き込む
+int mcp23s08_write_regs(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char reg,
+	const unsigned char *buf, const int len)
+{
+	return mcp23s08_transfer(
+		data, addr, reg, MCP23S08_WRITE, (unsigned char *)buf, len);
+}
+
+static void mcp23s08_async_complete(void *context);
+
+static void mcp23s08_init_async(struct mcp23s08_drvdata *data)
+{
+	spin_lock_init(&data->async_lock);
+	init_waitqueue_head(&data->async_wait);
+	for (int i = 0; i < MCP23S08_ASYNC_SLOTS; i++) {
+		struct mcp23s08_async_slot *slot = &data->slots[i];
+		slot->data = data;
+		slot->xfer.tx_buf = slot->tx;
+		slot->xfer.bits_per_word = MCP23S08_WORD_SIZE;
+		slot->xfer.len = MCP23S08_PACKET_SIZE;
+		spi_message_init_with_transfers(&slot->msg, &slot->xfer, 1);
+		slot->msg.complete = mcp23s08_async_complete;
+		slot->msg.context = slot;
+	}
+}
+
+// キューの先頭のスロットを送信する
+// async_lockを取得した状態で呼ぶこと
+static void mcp23s08_async_kick(struct mcp23s08_drvdata *data)
+{
+	while (data->async_count > 0 && !data->async_busy) {
+		struct mcp23s08_async_slot *slot =
+			&data->slots[data->async_head];
+		int retval = spi_async(data->spi, &slot->msg);
+		if (retval == 0) {
+			data->async_busy = true;
+			break;
+		}
+		// 送信できなかった書き込みは捨てて、次のスロットへ進む
+		atomic64_inc(&data->stats.errors);
+		data->async_error = retval;
+		data->async_head =
+			(data->async_head + 1) % MCP23S08_ASYNC_SLOTS;
+		data->async_count--;
+		// 完了コールバックが呼ばれないので、ここで待っている人を起こす
+		wake_up_all(&data->async_wait);
+	}
+}
+
+// spi_async()の完了コールバック
+// 割り込みコンテキストから呼ばれることがあるので、スリープしてはいけない
+static void mcp23s08_async_complete(void *context)
+{
+	struct mcp23s08_async_slot *slot = context;
+	struct mcp23s08_drvdata *data = slot->data;
+	const int status = slot->msg.status;
+	const ktime_t latency = ktime_sub(ktime_get(), slot->queued);
+	unsigned long flags;
+
+	frootspi_hist_add(&data->async_hist, latency);
+	atomic64_inc(&data->stats.transactions);
+	atomic64_add(MCP23S08_PACKET_SIZE, &data->stats.bytes);
+	// 非同期書き込みはmutexを使わないので、wait_nsは0とする
+	trace_frootspi_mcp23s08_xfer(slot->addr, slot->reg, MCP23S08_WRITE, 1,
+		slot->tx[MCP23S08_HEADER_SIZE], 0, status, 0,
+		ktime_to_ns(latency));
+	if (status) {
+		atomic64_inc(&data->stats.errors);
+	}
+	// 完了コールバックではリトライできないので、失敗はフェンスで返す
+	mcp23s08_count_result(data, status);
+
+	spin_lock_irqsave(&data->async_lock, flags);
+	if (status) {
+		data->async_error = status;
+	}
+	data->async_busy = false;
+	data->async_head = (data->async_head + 1) % MCP23S08_ASYNC_SLOTS;
+	data->async_count--;
+	mcp23s08_async_kick(data);
+	// フェンスを抜けたremove()がプライベートデータを開放しないよう、
+	// async_lockを保持したまま起こす。フェンスは待った後にasync_lockを取るので、
+	// ここでロックを離すまではフェンスから戻らない
+	wake_up_all(&data->async_wait);
+	spin_unlock_irqrestore(&data->async_lock, flags);
+}
+
+// レジスタへの書き込みをキューに入れる
+// 末尾のスロットがまだ送信されておらず、同じレジスタへの書き込みであれば、
+// 新しいスロットを使わずにその書き込みの値を上書きする
+// async_lockを取得した状態で呼ぶこと。キューが一杯なら-EBUSYを返す
+static int mcp23s08_async_queue_locked(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char reg,
+	const unsigned char value)
+{
+	struct mcp23s08_async_slot *slot;
+
+	// 先頭のスロットは送信中なので、統合できるのは2つ目以降
+	if (data->async_count >= 2) {
+		slot = &data->slots[(data->async_head + data->async_count - 1) %
+				    MCP23S08_ASYNC_SLOTS];
+		if (slot->addr == addr && slot->reg == reg) {
+			slot->tx[MCP23S08_HEADER_SIZE] = value;
+			atomic64_inc(&data->stats.async_merges);
+			return 0;
+		}
+	}
+	if (data->async_count == MCP23S08_ASYNC_SLOTS) {
+		return -EBUSY;
+	}
+
+	slot = &data->slots[(data->async_head + data->async_count) %
+			    MCP23S08_ASYNC_SLOTS];
+	slot->addr = addr;
+	slot->reg = reg;
+	slot->queued = ktime_get();
+	// tx[0] = Opcode = 0b0100_0{A1}{A0}{R/W}
+	slot->tx[0] = MCP23S08_OPCODE | (addr & 0x03) << 1 | MCP23S08_WRITE;
+	slot->tx[1] = reg;
+	slot->tx[MCP23S08_HEADER_SIZE] = value;
+	data->async_count++;
+	mcp23s08_async_kick(data);
+	return 0;
+}
+
+// それまでにキューに入れた非同期書き込みが全て完了するまで待つ
+// 前回のフェンス以降に失敗した書き込みがあれば、そのエラーを返す
+int mcp23s08_fence(struct mcp23s08_drvdata *data)
+{
+	unsigned long flags;
+	int retval;
+
+	if (!wait_event_timeout(data->async_wait,
+		    READ_ONCE(data->async_count) == 0,
+		    msecs_to_jiffies(MCP23S08_FENCE_TIMEOUT_MS))) {
+		printk(KERN_ERR "%s %s: timed out.\n", SPI_DRIVER_NAME,
+			__func__);
+		return -ETIMEDOUT;
+	}
+
+	spin_lock_irqsave(&data->async_lock, flags);
+	retval = data->async_error;
+	data->async_error = 0;
+	spin_unlock_irqrestore(&data->async_lock, flags);
+	return retval;
+}
+
+// IOCON.HAENを有効にして、同じCSの複数のMCP23S08をアドレスで区別する
+// HAENが無効な間は全てのMCP23S08がアドレスに関係なく応答するため、
+// 最初の書き込みで全てのMCP23S08のHAENが同時に有効になる
+static int mcp23s08_enable_haen(struct mcp23s08_drvdata *data)
+{
+	unsigned char rxdata = 0;
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!(data->chip_mask & (1 << addr))) {
+			continue;
+		}
+		if (mcp23s08_control_reg(data, addr, MCP23S08_REG_IOCON,
+			    MCP23S08_WRITE, MCP23S08_IOCON_HAEN, &rxdata)) {
+			printk(KERN_ERR "%s %s: failed to write IOCON of "
+					"chip %d.\n",
+				SPI_DRIVER_NAME, __func__, addr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// 入出力設定と割り込み設定を書き込む
+// リセットされたMCP23S08を設定し直すときにも使う
+static int mcp23s08_write_config(struct mcp23s08_drvdata *data)
+{
+	unsigned char iodir[MCP23S08_MAX_CHIPS];
+
+	// LEDに割り当てられたピンだけを出力にする
+	memset(iodir, 0xFF, sizeof(iodir));
+	for (int i = 0; i < data->pinmap.num_leds; i++) {
+		const unsigned char pin = data->pinmap.led[i];
+		iodir[MCP23S08_PIN_TO_ADDR(pin)] &=
+			~(1 << MCP23S08_PIN_TO_GPIO(pin));
+	}
+
+	// IODIRからIOCONまでをチップごとに1回の転送で設定する
+	// 極性反転と割り込みは使わないので0、IOCONはHAENのみ(SEQOP = 0)
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!(data->chip_mask & (1 << addr))) {
+			continue;
+		}
+		const unsigned char regs[] = {
+			[MCP23S08_REG_IODIR] = iodir[addr],
+			[MCP23S08_REG_IPOL] = 0x00,
+			[MCP23S08_REG_GPINTEN] = 0x00,
+			[MCP23S08_REG_DEFVAL] = 0x00,
+			[MCP23S08_REG_INTCON] = 0x00,
+			[MCP23S08_REG_IOCON] = MCP23S08_IOCON_HAEN,
+		};
+		if (mcp23s08_write_regs(data, addr, MCP23S08_REG_IODIR, regs,
+			    ARRAY_SIZE(regs))) {
+			printk(KERN_ERR "%s %s: failed to initialize chip "
+					"%d.\n",
+				SPI_DRIVER_NAME, __func__, addr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 // MCP23S08のレジスタ設定
 // GPIOの入出力設定や割り込み設定等をここで行う
-static int mcp23s08_initialize_reg(void)
+static int mcp23s08_initialize_reg(struct mcp23s08_drvdata *data)
 {
-	unsigned char txdata = 0;
-	unsigned char rxdata = 0;
-	// 入出力ピンの設定
-	txdata = 0xFF ^ (1 << MCP23S08_GPIO_LED);
-	if (mcp23s08_control_reg(
-		    MCP23S08_REG_IODIR, MCP23S08_WRITE, txdata, &rxdata)) {
-		printk(KERN_ERR "%s %s: failed to initialize IODIR.\n",
+	if (mcp23s08_write_config(data)) {
+		return -1;
+	}
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!(data->chip_mask & (1 << addr))) {
+			continue;
+		}
+		// 非同期書き込みは出力ラッチのシャドウから値を作るので、
+		// 現在の出力状態を読み込んでおく
+		if (mcp23s08_read_regs(data, addr, MCP23S08_REG_OLAT,
+			    &data->olat[addr], 1)) {
+			printk(KERN_ERR "%s %s: failed to read OLAT of chip "
+					"%d.\n",
+				SPI_DRIVER_NAME, __func__, addr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// 押下検出モードで、読み出したGPIOの値をキャッシュに反映する
+// 押されたピンは割り込みを止め(比較モードでは離すまで割り込みが続くため)、
+// 離されたピンは割り込みを再開する
+// 再開した時点で押されていれば、比較モードなのですぐに割り込みが入る
+static void mcp23s08_wake_update(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char gpio)
+{
+	bool pressed_any = false;
+
+	mutex_lock(&data->wake_mutex);
+	const unsigned char mask = data->wake_mask[addr];
+	const unsigned char armed = mask & gpio;
+	data->wake_state[addr] = gpio;
+	if (armed != data->wake_armed[addr] &&
+		mcp23s08_write_regs(
+			data, addr, MCP23S08_REG_GPINTEN, &armed, 1) == 0) {
+		data->wake_armed[addr] = armed;
+	}
+	for (int i = 0; i < MCP23S08_MAX_CHIPS; i++) {
+		if (data->wake_mask[i] & ~data->wake_state[i]) {
+			pressed_any = true;
+		}
+	}
+	mutex_unlock(&data->wake_mutex);
+
+	// 押されているスイッチがある間だけ、離されたかをポーリングする
+	if (pressed_any) {
+		schedule_delayed_work(&data->release_work,
+			msecs_to_jiffies(pushsw_release_poll_ms));
+	}
+}
+
+static void mcp23s08_release_work(struct work_struct *work)
+{
+	struct mcp23s08_drvdata *data = container_of(
+		to_delayed_work(work), struct mcp23s08_drvdata, release_work);
+	unsigned char gpio;
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		const unsigned char state = READ_ONCE(data->wake_state[addr]);
+		if (!(data->wake_mask[addr] & ~state)) {
+			continue;
+		}
+		if (mcp23s08_read_regs(
+			    data, addr, MCP23S08_REG_GPIO, &gpio, 1)) {
+			// 読めなかったら押されたままとして、次の周期で再確認する
+			schedule_delayed_work(&data->release_work,
+				msecs_to_jiffies(pushsw_release_poll_ms));
+			continue;
+		}
+		mcp23s08_wake_update(data, addr, gpio);
+	}
+}
+
+// MCP23S08のINTピンの割り込み
+// SPI通信はスリープするので、スレッド化された割り込みハンドラで処理する
+static irqreturn_t mcp23s08_irq(int irq, void *dev_id)
+{
+	struct mcp23s08_drvdata *data = dev_id;
+	irqreturn_t retval = IRQ_NONE;
+	// INTF, INTCAP, GPIOの順に並んでいる
+	unsigned char regs[3];
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!data->wake_mask[addr]) {
+			continue;
+		}
+		// INTCAPを読むと割り込みが解除される
+		if (mcp23s08_read_regs(data, addr, MCP23S08_REG_INTF, regs,
+			    sizeof(regs)) ||
+			regs[0] == 0) {
+			continue;
+		}
+		// 割り込み時の値(INTCAP)と現在の値(GPIO)のどちらかで押されていれば、
+		// 押されたとみなす(短い押下を取りこぼさないため)
+		mcp23s08_wake_update(data, addr, regs[1] & regs[2]);
+		atomic64_inc(&data->stats.wake_irqs);
+		retval = IRQ_HANDLED;
+	}
+	// /dev/frootspi_input0 に次の周期を待たずに押下を届ける
+	if (retval == IRQ_HANDLED) {
+		frootspi_input_kick();
+	}
+	return retval;
+}
+
+// 押下検出モードの割り込み設定をaddrのMCP23S08に書き込む
+// 離されている状態(= 1)をDEFVALにして、INTCONで比較する
+// GPINTENからIOCONまでを1回の転送で書き込む
+static int mcp23s08_write_wake_regs(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char armed)
+{
+	const unsigned char mask = data->wake_mask[addr];
+	// 複数のMCP23S08があれば、INTピンをワイヤードORで共有する
+	const unsigned char iocon = hweight8(data->chip_mask) > 1 ?
+		MCP23S08_IOCON_HAEN | MCP23S08_IOCON_ODR :
+		MCP23S08_IOCON_HAEN;
+	const unsigned char regs[] = {
+		armed, // GPINTEN
+		mask,  // DEFVAL
+		mask,  // INTCON
+		iocon, // IOCON
+	};
+	return mcp23s08_write_regs(
+		data, addr, MCP23S08_REG_GPINTEN, regs, ARRAY_SIZE(regs));
+}
+
+// 押下検出モードを有効にする
+// 割り込みが使えない場合は、これまで通り読み出しのたびにSPI通信する
+static void mcp23s08_setup_wake(struct mcp23s08_drvdata *data)
+{
+	struct spi_device *spi = data->spi;
+	int retval;
+
+	if (!pushsw_wake_on_press) {
+		return;
+	}
+	if (spi->irq <= 0) {
+		printk(KERN_WARNING "%s %s: no interrupt in device tree, "
+				    "falling back to polling.\n",
 			SPI_DRIVER_NAME, __func__);
+		return;
+	}
+
+	mutex_init(&data->wake_mutex);
+	INIT_DELAYED_WORK(&data->release_work, mcp23s08_release_work);
+	for (int i = 0; i < data->pinmap.num_pushsw; i++) {
+		const unsigned char pin = data->pinmap.pushsw[i];
+		data->wake_mask[MCP23S08_PIN_TO_ADDR(pin)] |=
+			1 << MCP23S08_PIN_TO_GPIO(pin);
+	}
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!(data->chip_mask & (1 << addr))) {
+			continue;
+		}
+		const unsigned char mask = data->wake_mask[addr];
+		unsigned char intcap;
+		if (mcp23s08_write_wake_regs(data, addr, mask) ||
+			mcp23s08_read_regs(
+				data, addr, MCP23S08_REG_INTCAP, &intcap, 1)) {
+			printk(KERN_ERR "%s %s: failed to set up interrupt of "
+					"chip %d.\n",
+				SPI_DRIVER_NAME, __func__, addr);
+			goto failed_setup;
+		}
+		data->wake_armed[addr] = mask;
+		data->wake_state[addr] = 0xff;
+	}
+
+	// 割り込みのトリガ(レベル、エッジ)はデバイスツリーの指定に従う
+	retval = request_threaded_irq(spi->irq, NULL, mcp23s08_irq,
+		IRQF_ONESHOT, SPI_DRIVER_NAME, data);
+	if (retval) {
+		printk(KERN_ERR "%s %s: request_threaded_irq() failed (%d).\n",
+			SPI_DRIVER_NAME, __func__, retval);
+		goto failed_setup;
+	}
+	data->wake_enabled = true;
+	printk(KERN_INFO "%s %s: wake on press enabled (irq %d).\n",
+		SPI_DRIVER_NAME, __func__, spi->irq);
+	return;
+
+failed_setup:
+	printk(KERN_WARNING "%s %s: falling back to polling.\n",
+		SPI_DRIVER_NAME, __func__);
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (data->wake_mask[addr]) {
+			const unsigned char zero = 0;
+			mcp23s08_write_regs(
+				data, addr, MCP23S08_REG_GPINTEN, &zero, 1);
+		}
+	}
+	memset(data->wake_mask, 0, sizeof(data->wake_mask));
+}
+
+static void mcp23s08_teardown_wake(struct mcp23s08_drvdata *data)
+{
+	const unsigned char zero = 0;
+
+	if (!data->wake_enabled) {
+		return;
+	}
+	free_irq(data->spi->irq, data);
+	cancel_delayed_work_sync(&data->release_work);
+	data->wake_enabled = false;
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (data->wake_mask[addr]) {
+			mcp23s08_write_regs(
+				data, addr, MCP23S08_REG_GPINTEN, &zero, 1);
+		}
+	}
+}
+
+// リトライしても失敗する操作が続いたときに、レジスタを設定し直す
+// 電源の瞬断などでリセットされていると、HAEN、入出力設定、出力、割り込みが
+// 全て電源投入時の値に戻っているので、probe()と同じ順に書き込む
+static void mcp23s08_reinit_work(struct work_struct *work)
+{
+	struct mcp23s08_drvdata *data =
+		container_of(work, struct mcp23s08_drvdata, reinit_work);
+	unsigned long flags;
+	int retval;
+
+	atomic64_inc(&data->stats.reinits);
+	printk_ratelimited(KERN_WARNING "%s %s: re-initializing after "
+					"repeated failures.\n",
+		SPI_DRIVER_NAME, __func__);
+	WRITE_ONCE(data->reinit_running, true);
+
+	retval = mcp23s08_enable_haen(data);
+	if (retval == 0) {
+		retval = mcp23s08_write_config(data);
+	}
+	// 出力ラッチはシャドウ(最後にキューに入れた値)に戻す
+	for (int addr = 0; retval == 0 && addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!(data->chip_mask & (1 << addr))) {
+			continue;
+		}
+		spin_lock_irqsave(&data->async_lock, flags);
+		const unsigned char olat = data->olat[addr];
+		spin_unlock_irqrestore(&data->async_lock, flags);
+		retval = mcp23s08_write_regs(
+			data, addr, MCP23S08_REG_OLAT, &olat, 1);
+	}
+	if (retval == 0 && data->wake_enabled) {
+		mutex_lock(&data->wake_mutex);
+		for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+			if (data->wake_mask[addr] &&
+				mcp23s08_write_wake_regs(data, addr,
+					data->wake_armed[addr])) {
+				retval = -EIO;
+				break;
+			}
+		}
+		mutex_unlock(&data->wake_mutex);
+	}
+
+	WRITE_ONCE(data->reinit_running, false);
+	if (retval) {
+		printk_ratelimited(KERN_ERR "%s %s: re-initialization "
+					    "failed.\n",
+			SPI_DRIVER_NAME, __func__);
+	}
+}
+
+// デバイスツリーからピン割当を読み込む
+// プロパティがなければデバイスファイルのテーブルのデフォルトの割当を使う
+static int mcp23s08_read_pins(struct mcp23s08_drvdata *data,
+	const char *propname, enum frootspi_family family, unsigned char *pins,
+	const int max_pins)
+{
+	struct device *dev = &data->spi->dev;
+	u32 values[MCP23S08_MAX_CHIPS * MCP23S08_NUM_GPIOS];
+
+	// 配列にNULLを渡すと要素数が返る
+	int num_pins = device_property_read_u32_array(dev, propname, NULL, 0);
+	if (num_pins < 0) {
+		return frootspi_chardev_default_pins(family, pins, max_pins);
+	}
+	if (num_pins > max_pins) {
+		printk(KERN_ERR "%s %s: too many pins in %s (max %d).\n",
+			SPI_DRIVER_NAME, __func__, propname, max_pins);
+		return -1;
+	}
+	if (device_property_read_u32_array(dev, propname, values, num_pins)) {
+		printk(KERN_ERR "%s %s: failed to read %s.\n",
+			SPI_DRIVER_NAME, __func__, propname);
+		return -1;
+	}
+
+	for (int i = 0; i < num_pins; i++) {
+		if (values[i] >= MCP23S08_MAX_CHIPS * MCP23S08_NUM_GPIOS ||
+			!(data->chip_mask &
+				(1 << MCP23S08_PIN_TO_ADDR(values[i])))) {
+			printk(KERN_ERR "%s %s: %s: pin %u is not on a present "
+					"chip.\n",
+				SPI_DRIVER_NAME, __func__, propname, values[i]);
+			return -1;
+		}
+		pins[i] = values[i];
+	}
+	return num_pins;
+}
+
+// デバイスツリーから接続されているMCP23S08とピン割当を読み込む
+//   microchip,spi-present-mask: 存在するアドレスのビットマスク
+//   frootspi,led-pins, frootspi,pushsw-pins, frootspi,dipsw-pins:
+//     各機能に割り当てるピン番号 (アドレス * 8 + GPIO番号) の配列
+static int mcp23s08_read_properties(struct mcp23s08_drvdata *data)
+{
+	struct mcp23s08_pinmap *map = &data->pinmap;
+	u32 chip_mask = MCP23S08_DEFAULT_CHIP_MASK;
+
+	device_property_read_u32(
+		&data->spi->dev, "microchip,spi-present-mask", &chip_mask);
+	if (chip_mask == 0 || chip_mask >= (1 << MCP23S08_MAX_CHIPS)) {
+		printk(KERN_ERR "%s %s: invalid spi-present-mask 0x%x.\n",
+			SPI_DRIVER_NAME, __func__, chip_mask);
+		return -1;
+	}
+	data->chip_mask = chip_mask;
+
+	map->num_leds = mcp23s08_read_pins(data, "frootspi,led-pins",
+		FROOTSPI_LED, map->led, MCP23S08_MAX_LEDS);
+	map->num_pushsw = mcp23s08_read_pins(data, "frootspi,pushsw-pins",
+		FROOTSPI_PUSHSW, map->pushsw, MCP23S08_MAX_PUSHSW);
+	map->num_dipsw = mcp23s08_read_pins(data, "frootspi,dipsw-pins",
+		FROOTSPI_DIPSW, map->dipsw, MCP23S08_MAX_DIPSW);
+	if (map->num_leds < 0 || map->num_pushsw < 0 || map->num_dipsw < 0) {
 		return -1;
 	}
 
 	return 0;
 }
 
-static int mcp23s08_probe(struct spi_device *spi)
+// SPIクロック周波数を変更する
+static int mcp23s08_set_speed(struct mcp23s08_drvdata *data, const u32 speed_hz)
 {
-	spi->max_speed_hz = mcp23s08_info.max_speed_hz;
-	spi->mode = mcp23s08_info.mode;
+	struct spi_device *spi = data->spi;
+
+	spi->max_speed_hz = speed_hz;
+	spi->mode = SPI_MODE;
 	spi->bits_per_word = MCP23S08_WORD_SIZE;
 	// SPI モード、クロックレート、ワードサイズを設定
 	// 異常な値が設定される場合はspi_setup()が失敗する
@@ -131,16 +910,218 @@ static int mcp23s08_probe(struct spi_device *spi)
 		return -1;
 	}
 
+	data->xfer.speed_hz = speed_hz;
+	for (int i = 0; i < MCP23S08_ASYNC_SLOTS; i++) {
+		data->slots[i].xfer.speed_hz = speed_hz;
+	}
+	data->speed_hz = speed_hz;
+	return 0;
+}
+
+// 現在のクロック周波数で正しく通信できるか確認する
+// 割り込みを有効にしていなければ動作に影響しないDEFVALをスクラッチに使い、
+// 書き込んだ値がそのまま読み出せるかを繰り返し確かめる
+static int mcp23s08_validate_speed(struct mcp23s08_drvdata *data)
+{
+	static const unsigned char patterns[] = {
+		0x55, 0xaa, 0x00, 0xff, 0x5a, 0xa5, 0x0f, 0xf0};
+	unsigned char rxdata = 0;
+	int retval = 0;
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!(data->chip_mask & (1 << addr))) {
+			continue;
+		}
+		for (int i = 0; i < MCP23S08_VALIDATE_ROUNDS; i++) {
+			const unsigned char txdata =
+				patterns[i % ARRAY_SIZE(patterns)];
+			if (mcp23s08_control_reg(data, addr,
+				    MCP23S08_REG_DEFVAL, MCP23S08_WRITE, txdata,
+				    &rxdata) ||
+				mcp23s08_control_reg(data, addr,
+					MCP23S08_REG_DEFVAL, MCP23S08_READ, 0,
+					&rxdata) ||
+				rxdata != txdata) {
+				retval = -1;
+				break;
+			}
+		}
+
+		// DEFVALを電源投入時の値に戻す
+		mcp23s08_control_reg(data, addr, MCP23S08_REG_DEFVAL,
+			MCP23S08_WRITE, 0, &rxdata);
+	}
+	return retval;
+}
+
+// 指定されたクロック周波数から始めて、通信できる周波数を探す
+// 失敗したら周波数を半分にして、動作実績のある周波数まで下げていく
+static int mcp23s08_select_speed(struct mcp23s08_drvdata *data)
+{
+	u32 speed_hz = clamp_t(u32, spi_speed_hz, MCP23S08_MIN_SPEED_HZ,
+		MCP23S08_MAX_SPEED_HZ);
+
+	for (;;) {
+		if (mcp23s08_set_speed(data, speed_hz) == 0 &&
+			mcp23s08_validate_speed(data) == 0) {
+			break;
+		}
+		// 最後は必ず動作実績のあるクロックで1回試す
+		if (speed_hz == MCP23S08_SAFE_SPEED_HZ) {
+			printk(KERN_ERR "%s %s: no working SPI clock found.\n",
+				SPI_DRIVER_NAME, __func__);
+			return -1;
+		}
+		printk(KERN_WARNING "%s %s: readback failed at %u Hz.\n",
+			SPI_DRIVER_NAME, __func__, speed_hz);
+		// 指定が安全なクロック以下なら、安全なクロックに上げて試す
+		if (speed_hz < MCP23S08_SAFE_SPEED_HZ) {
+			speed_hz = MCP23S08_SAFE_SPEED_HZ;
+		} else {
+			speed_hz = max_t(
+				u32, speed_hz / 2, MCP23S08_SAFE_SPEED_HZ);
+		}
+	}
+
+	printk(KERN_INFO "%s %s: SPI clock %u Hz (requested %u Hz).\n",
+		SPI_DRIVER_NAME, __func__, speed_hz, spi_speed_hz);
+	return 0;
+}
+
+// 選ばれたクロックで、最初のMCP23S08のDEFVALへの書き込みと読み戻しを
+// selftest_rounds回繰り返し、1往復ごとのレイテンシをsysfsに公開する
+// 結果が悪くてもprobe()は続ける (デプロイの判断はユーザ空間で行う)
+static void mcp23s08_selftest(struct mcp23s08_drvdata *data)
+{
+	const u32 rounds = min_t(
+		u32, selftest_rounds, FROOTSPI_SELFTEST_MAX_ROUNDS);
+	const unsigned char addr = __ffs(data->chip_mask);
+	unsigned char rxdata = 0;
+	u32 errors = 0;
+
+	if (rounds == 0) {
+		return;
+	}
+	u64 *samples = kmalloc_array(rounds, sizeof(u64), GFP_KERNEL);
+	if (samples == NULL) {
+		printk(KERN_ERR "%s %s: kmalloc_array() failed.\n",
+			SPI_DRIVER_NAME, __func__);
+		return;
+	}
+
+	// probe()中で他に通信する人はいないので、統計の差分が自己診断の分になる
+	const s64 bytes = atomic64_read(&data->stats.bytes);
+	const s64 spi_sync_ns = atomic64_read(&data->stats.spi_sync_ns);
+	for (u32 i = 0; i < rounds; i++) {
+		const unsigned char txdata = i;
+		const ktime_t started = ktime_get();
+		if (mcp23s08_control_reg(data, addr, MCP23S08_REG_DEFVAL,
+			    MCP23S08_WRITE, txdata, &rxdata) ||
+			mcp23s08_control_reg(data, addr, MCP23S08_REG_DEFVAL,
+				MCP23S08_READ, 0, &rxdata) ||
+			rxdata != txdata) {
+			errors++;
+		}
+		samples[i] = ktime_to_ns(ktime_sub(ktime_get(), started));
+	}
+	// DEFVALはmcp23s08_initialize_reg()で電源投入時の値に戻す
+
+	data->selftest = frootspi_selftest_publish(&data->spi->dev,
+		SPI_DRIVER_NAME, samples, rounds, errors, data->speed_hz,
+		(atomic64_read(&data->stats.bytes) - bytes) * BITS_PER_BYTE,
+		atomic64_read(&data->stats.spi_sync_ns) - spi_sync_ns);
+	kfree(samples);
+}
+
+// 全レジスタのダンプ (/sys/kernel/debug/frootspi/mcp23s08/registers)
+// チップごとに1回の転送で全レジスタを読み出す
+static int mcp23s08_registers_show(struct seq_file *s, void *unused)
+{
+	static const char *const names[MCP23S08_REG_SIZE] = {"IODIR", "IPOL",
+		"GPINTEN", "DEFVAL", "INTCON", "IOCON", "GPPU", "INTF",
+		"INTCAP", "GPIO", "OLAT"};
+	struct mcp23s08_drvdata *data = s->private;
+	unsigned char regs[MCP23S08_REG_SIZE];
+
+	seq_puts(s, "addr");
+	for (int i = 0; i < MCP23S08_REG_SIZE; i++) {
+		seq_printf(s, " %7s", names[i]);
+	}
+	seq_putc(s, '\n');
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if (!(data->chip_mask & (1 << addr))) {
+			continue;
+		}
+		int retval = mcp23s08_read_regs(
+			data, addr, MCP23S08_REG_IODIR, regs, sizeof(regs));
+		if (retval) {
+			return retval;
+		}
+		seq_printf(s, "%4d", addr);
+		for (int i = 0; i < MCP23S08_REG_SIZE; i++) {
+			seq_printf(s, "    0x%02x", regs[i]);
+		}
+		seq_putc(s, '\n');
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mcp23s08_registers);
+
+// probe()済みのSPIデバイス
+// デバイスファイルのテーブル、入力のサンプラー、debugfsはエキスパンダを
+// 1つのSPIデバイスとして扱うので、2つ目のSPIデバイスは断る
+// 1つのCSに最大4つのMCP23S08を、HAENのアドレスで区別してつなげる
+static DEFINE_MUTEX(mcp23s08_instance_lock);
+static struct spi_device *mcp23s08_instance;
+
+static int mcp23s08_claim_instance(struct spi_device *spi)
+{
+	int retval = 0;
+
+	mutex_lock(&mcp23s08_instance_lock);
+	if (mcp23s08_instance) {
+		retval = -EBUSY;
+	} else {
+		mcp23s08_instance = spi;
+	}
+	mutex_unlock(&mcp23s08_instance_lock);
+	return retval;
+}
+
+static void mcp23s08_release_instance(struct spi_device *spi)
+{
+	mutex_lock(&mcp23s08_instance_lock);
+	if (mcp23s08_instance == spi) {
+		mcp23s08_instance = NULL;
+	}
+	mutex_unlock(&mcp23s08_instance_lock);
+}
+
+static int mcp23s08_probe(struct spi_device *spi)
+{
 	// kzalloc: mallocのカーネル空間版のメモリーゼロクリア版
 	// カーネル空間に指定サイズのメモリを確保し、ゼロクリアする
 	// GFP_KERNEL: スリープ可、標準的なメモリ確保
 	// 他にはGFP_USERや、GFP_DMA、GFP_ATOMICなどがある
 	// コメント：drvdataはグローバル変数で静的に確保して良い気がするけどどうなんだろ？
+	ktime_t probe_started = ktime_get();
 	struct mcp23s08_drvdata *data;
+
+	// 2つ目のSPIデバイスは、通信する前に断る
+	if (mcp23s08_claim_instance(spi)) {
+		printk(KERN_ERR "%s %s: only one mcp23s08 SPI device is "
+				"supported, use microchip,spi-present-mask for "
+				"more expanders.\n",
+			SPI_DRIVER_NAME, __func__);
+		return -EBUSY;
+	}
+
 	data = kzalloc(sizeof(struct mcp23s08_drvdata), GFP_KERNEL);
 	if (data == NULL) {
 		printk(KERN_ERR "%s %s: kszalloc() failed\n", SPI_DRIVER_NAME,
 			__func__);
+		mcp23s08_release_instance(spi);
 		return -1;
 	}
 
@@ -154,28 +1135,120 @@ static int mcp23s08_probe(struct spi_device *spi)
 	data->xfer.tx_buf = data->tx;
 	data->xfer.rx_buf = data->rx;
 	data->xfer.bits_per_word = MCP23S08_WORD_SIZE;
-	data->xfer.len = MCP23S08_PACKET_SIZE;
+	data->xfer.len = MCP23S08_PACKET_SIZE; // 転送ごとに変わる
 	data->xfer.cs_change = 0; // 送信完了後のCSの状態
 	data->xfer.delay_usecs = 0; // 送信からCS状態変更までの遅延時間
-	data->xfer.speed_hz = 1000000; // 1MHz
+	// xfer.speed_hz はmcp23s08_select_speed()で設定する
 
 	// spi_transfer 構造体からspi_message構造体を作成する
 	// 変更先spi_message, 変更元spi_transfer, transferの数
 	spi_message_init_with_transfers(&data->msg, &data->xfer, 1);
+	mcp23s08_init_async(data);
+	INIT_WORK(&data->reinit_work, mcp23s08_reinit_work);
 
 	// ドライバ(spi)にプライベートデータ(data)を紐付けて保存する
 	// プライベートデータはspi_get_drvdata() or
 	// dev_get_drvdata()で取得できる
 	spi_set_drvdata(spi, data);
 
-	if (mcp23s08_initialize_reg()) {
+	// レイテンシのヒストグラムをdebugfsに公開する
+	data->debugfs_dir =
+		debugfs_create_dir("mcp23s08", frootspi_debugfs_root);
+	frootspi_debugfs_create_hist(
+		"xfer_latency", data->debugfs_dir, &data->xfer_hist);
+	frootspi_debugfs_create_hist(
+		"mutex_wait", data->debugfs_dir, &data->mutex_wait_hist);
+	frootspi_debugfs_create_hist(
+		"mutex_hold", data->debugfs_dir, &data->mutex_hold_hist);
+	frootspi_debugfs_create_hist(
+		"async_latency", data->debugfs_dir, &data->async_hist);
+	frootspi_debugfs_create_counter("transactions", data->debugfs_dir,
+		&data->stats.transactions);
+	frootspi_debugfs_create_counter(
+		"bytes", data->debugfs_dir, &data->stats.bytes);
+	frootspi_debugfs_create_counter(
+		"errors", data->debugfs_dir, &data->stats.errors);
+	frootspi_debugfs_create_counter(
+		"retries", data->debugfs_dir, &data->stats.retries);
+	frootspi_debugfs_create_counter(
+		"failures", data->debugfs_dir, &data->stats.failures);
+	frootspi_debugfs_create_counter(
+		"reinits", data->debugfs_dir, &data->stats.reinits);
+	frootspi_debugfs_create_counter(
+		"spi_sync_ns", data->debugfs_dir, &data->stats.spi_sync_ns);
+	frootspi_debugfs_create_counter("async_merges", data->debugfs_dir,
+		&data->stats.async_merges);
+	frootspi_debugfs_create_counter(
+		"wake_irqs", data->debugfs_dir, &data->stats.wake_irqs);
+	debugfs_create_u32(
+		"speed_hz", 0444, data->debugfs_dir, &data->speed_hz);
+	debugfs_create_x8(
+		"chip_mask", 0444, data->debugfs_dir, &data->chip_mask);
+	debugfs_create_file("registers", 0444, data->debugfs_dir, data,
+		&mcp23s08_registers_fops);
+	frootspi_fault_init(&data->fault, data->debugfs_dir);
+
+	if (mcp23s08_read_properties(data)) {
+		printk(KERN_ERR "%s %s: mcp23s08_read_properties() failed\n",
+			SPI_DRIVER_NAME, __func__);
+		goto failed_init;
+	}
+
+	// HAENが有効になるまでは複数のMCP23S08が同時に応答してしまうので、
+	// 読み出しを伴うクロックの検証より先に、安全なクロックでHAENを有効にする
+	if (mcp23s08_set_speed(data, MCP23S08_SAFE_SPEED_HZ) ||
+		mcp23s08_enable_haen(data)) {
+		printk(KERN_ERR "%s %s: mcp23s08_enable_haen() failed\n",
+			SPI_DRIVER_NAME, __func__);
+		goto failed_init;
+	}
+
+	if (mcp23s08_select_speed(data)) {
+		printk(KERN_ERR "%s %s: mcp23s08_select_speed() failed\n",
+			SPI_DRIVER_NAME, __func__);
+		goto failed_init;
+	}
+	mcp23s08_selftest(data);
+
+	if (mcp23s08_initialize_reg(data)) {
 		printk(KERN_ERR "%s %s: mcp23s08_initialzie_reg() failed\n",
 			SPI_DRIVER_NAME, __func__);
-		return -1;
+		goto failed_init;
+	}
+	mcp23s08_setup_wake(data);
+
+	// エキスパンダの準備ができたので、キャラクタデバイスを登録する
+	if (register_pushsw_dev(
+		    data, data->pinmap.pushsw, data->pinmap.num_pushsw)) {
+		goto failed_register_pushsw;
+	}
+	if (register_dipsw_dev(
+		    data, data->pinmap.dipsw, data->pinmap.num_dipsw)) {
+		goto failed_register_dipsw;
+	}
+	if (register_led_dev(data, data->pinmap.led, data->pinmap.num_leds)) {
+		goto failed_register_led;
 	}
+	// ここからは失敗が続いたらレジスタを設定し直す
+	WRITE_ONCE(data->reinit_enabled, true);
 	printk(KERN_DEBUG "%s %s: mcp23s08 probed.\n", SPI_DRIVER_NAME, __func__);
+	frootspi_report_init_time("mcp23s08_probe", probe_started, 0);
 
 	return 0;
+
+failed_register_led:
+	unregister_dipsw_dev();
+failed_register_dipsw:
+	unregister_pushsw_dev();
+failed_register_pushsw:
+	mcp23s08_teardown_wake(data);
+failed_init:
+	frootspi_selftest_remove(data->selftest);
+	debugfs_remove_recursive(data->debugfs_dir);
+	kfree(data);
+	mcp23s08_release_instance(spi);
+	frootspi_report_init_time("mcp23s08_probe", probe_started, -1);
+	return -1;
 }
 
 static int mcp23s08_remove(struct spi_device *spi)
@@ -183,8 +1256,28 @@ static int mcp23s08_remove(struct spi_device *spi)
 	// ドライバに紐付いたプライベートデータを取得
 	struct mcp23s08_drvdata *data;
 	data = (struct mcp23s08_drvdata *)spi_get_drvdata(spi);
+	unregister_pushsw_dev();
+	unregister_dipsw_dev();
+	unregister_led_dev();
+	// 設定し直している最中なら、wake_mutexを使い終わるまで待つ
+	WRITE_ONCE(data->reinit_enabled, false);
+	cancel_work_sync(&data->reinit_work);
+	mcp23s08_teardown_wake(data);
+	// 送信中の非同期書き込みがプライベートデータを参照しているので、完了を待つ
+	// SPIメッセージがスロットを指している間は開放できないので、
+	// タイムアウトしてもSPIコントローラが完了を返すまで待ち続ける
+	while (mcp23s08_fence(data) == -ETIMEDOUT) {
+		printk(KERN_ERR "%s %s: waiting for %d queued writes.\n",
+			SPI_DRIVER_NAME, __func__,
+			READ_ONCE(data->async_count));
+	}
+	// 完了コールバックが予約した分も取り消す
+	cancel_work_sync(&data->reinit_work);
+	frootspi_selftest_remove(data->selftest);
+	debugfs_remove_recursive(data->debugfs_dir);
 	// プライベートデータを開放
 	kfree(data);
+	mcp23s08_release_instance(spi);
 
 	printk(KERN_DEBUG "%s %s: mcp23s08 removed.\n", SPI_DRIVER_NAME, __func__);
 
@@ -196,124 +1289,203 @@ static struct spi_driver mcp23s08_driver = {
 		{
 			.name = SPI_DRIVER_NAME,
 			.owner = THIS_MODULE,
+			.of_match_table = of_match_ptr(mcp23s08_of_match),
+			// probe()中のクロック検証やレジスタ初期化を待たずに、
+			// LCDなど他のデバイスのprobeと並行して進める
+			.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 		},
 	.id_table = mcp23s08_id_table,
 	.probe = mcp23s08_probe,
 	.remove = mcp23s08_remove,
 };
 
-static void spi_remove_device(struct spi_master *master, unsigned int cs)
-{
-	struct device *dev;
-	char str[128];
-
-	// SPIマスターが使用しているバスと指定したChip Selectを文字列に変換
-	snprintf(str, sizeof(str), "%s.%u", dev_name(&master->dev), cs);
-
-	// 文字列"{bus}.{cs}"をもとに、デバイスを取得
-	dev = bus_find_device_by_name(&spi_bus_type, NULL, str);
-	if (dev) { // デバイスが存在していたら削除
-		device_del(dev);
-	}
-}
-
+// デバイスはデバイスツリー(src/dts/frootspi-overlay.dts)から作られるので、
+// ドライバを登録するだけでprobe()が呼ばれる
 int register_mcp23s08_driver(void)
 {
-	// SPIドライバをカーネルに登録
-	spi_register_driver(&mcp23s08_driver);
-
-	mcp23s08_info.bus_num = SPI_BUS_NUM;
-	mcp23s08_info.chip_select = SPI_CHIP_SELECT;
-
-	// SPIバス番号に紐付いたマスターを取得
-	struct spi_master *master = spi_busnum_to_master(mcp23s08_info.bus_num);
-	if (!master) {
-		printk(KERN_ERR "%s %s: spi_busnum_to_master returned NULL\n",
-			SPI_DRIVER_NAME, __func__);
-		spi_unregister_driver(&mcp23s08_driver);
-		return -1;
-	}
-
-	// なんでremoveするの？
-	// すでに/dev/spidev0.0や0.1などがSPIバスを使ってるかもしれないので取り除く
-	spi_remove_device(master, mcp23s08_info.chip_select);
-
-	// 新しいSPIデバイスをインスタンス化する
-	// 成功した直後、mcp23s08_driverのprobeが実行される
-	struct spi_device *spi_device = spi_new_device(master, &mcp23s08_info);
-	if (!spi_device) {
-		printk(KERN_ERR "%s %s: spi_new_device returned NULL\n",
+	int retval = spi_register_driver(&mcp23s08_driver);
+	if (retval) {
+		printk(KERN_ERR "%s %s: spi_register_driver() failed.\n",
 			SPI_DRIVER_NAME, __func__);
-		spi_unregister_driver(&mcp23s08_driver);
-		return -1;
 	}
-
-	return 0;
+	return retval;
 }
 
 void unregister_mcp23s08_driver(void)
 {
-	// SPIバス番号に紐付いたマスターを取得
-	struct spi_master *master = spi_busnum_to_master(mcp23s08_info.bus_num);
-	if (master) {
-		spi_remove_device(master, mcp23s08_info.chip_select);
-	} else {
-		printk(KERN_ERR "%s %s: mcp23s08 remove error\n",
-			SPI_DRIVER_NAME, __func__);
-	}
-
 	// カーネルからドライバを取り除く
+	// デバイスはデバイスツリーのものなので残り、remove()だけが呼ばれる
 	spi_unregister_driver(&mcp23s08_driver);
 }
 
+// SPI通信せずにわかるGPIOの値を返す
+// 押下検出モードでは、離されているスイッチは割り込みが来ていないので1を返す
+// SPI通信が必要なら-EAGAINを返す
+int mcp23s08_read_gpio_nowait(
+	struct mcp23s08_drvdata *data, const unsigned char pin)
+{
+	const unsigned char addr = MCP23S08_PIN_TO_ADDR(pin);
+	const unsigned char bit = 1 << MCP23S08_PIN_TO_GPIO(pin);
+
+	if (data->wake_enabled && (data->wake_mask[addr] & bit) &&
+		(READ_ONCE(data->wake_state[addr]) & bit)) {
+		return 1;
+	}
+	return -EAGAIN;
+}
+
 // MCP23S08のGPIOの値を取得
+// pinはアドレス * 8 + GPIO番号
 // 失敗した場合は-1を返す
-int mcp23s08_read_gpio(const unsigned char gpio_num)
+int mcp23s08_read_gpio(struct mcp23s08_drvdata *data, const unsigned char pin)
 {
+	const unsigned char addr = MCP23S08_PIN_TO_ADDR(pin);
+	const unsigned char bit = 1 << MCP23S08_PIN_TO_GPIO(pin);
 	unsigned char txdata = 0;
 	unsigned char rxdata = 0;
-	if (mcp23s08_control_reg(
-		    MCP23S08_REG_GPIO, MCP23S08_READ, txdata, &rxdata)) {
-		printk(KERN_ERR "%s %s: failed to read GPIO.\n",
+
+	const int cached = mcp23s08_read_gpio_nowait(data, pin);
+	if (cached >= 0) {
+		return cached;
+	}
+
+	if (mcp23s08_control_reg(data, addr, MCP23S08_REG_GPIO, MCP23S08_READ,
+		    txdata, &rxdata)) {
+		printk_ratelimited(KERN_ERR "%s %s: failed to read GPIO.\n",
 			SPI_DRIVER_NAME, __func__);
 		return -1;
 	}
+	// 押されていたスイッチが離されていれば、ここで割り込みを再開する
+	if (data->wake_enabled && (data->wake_mask[addr] & bit)) {
+		mcp23s08_wake_update(data, addr, rxdata);
+	}
 
-	return (rxdata >> gpio_num) & 1;
+	return (rxdata >> MCP23S08_PIN_TO_GPIO(pin)) & 1;
 }
 
 // MCP23S08のGPIOに値をセット
-// 失敗した場合は-1を返す
-int mcp23s08_write_gpio(const unsigned char gpio_num, const unsigned char value)
+// pinはアドレス * 8 + GPIO番号
+// 書き込みはキューに入れるだけで、送信完了を待たずに戻る
+// 送信完了を待つ必要があればmcp23s08_fence()を呼ぶ
+// キューが一杯なら空くまで待つ (nowaitなら待たずに-EAGAIN)
+// 前に入れた書き込みの送信が失敗していれば、キューに入れずに-EIOを返す
+// (エラーは1回だけ返すので、呼び出し元は書き直せる)
+int mcp23s08_write_gpio(struct mcp23s08_drvdata *data,
+	const unsigned char pin, const unsigned char value, const bool nowait)
 {
-	unsigned char txdata = 0;
-	unsigned char rxdata = 0;
+	const unsigned char addr = MCP23S08_PIN_TO_ADDR(pin);
+	const unsigned char gpio_num = MCP23S08_PIN_TO_GPIO(pin);
+	unsigned long flags;
+	int retval;
 
-	// 現在のGPIOの状態を取得
-	if (mcp23s08_control_reg(
-		    MCP23S08_REG_GPIO, MCP23S08_READ, txdata, &rxdata)) {
-		printk(KERN_ERR "%s %s: failed to read from GPIO.\n",
-			SPI_DRIVER_NAME, __func__);
-		return -1;
-	}
-
-	// 指定されたGPIOビットだけ変更する
-	if (value == 0) {
-		txdata = rxdata & ~(1 << gpio_num);
-	} else if (value == 1) {
-		txdata = rxdata | (1 << gpio_num);
-	} else {
+	if (value != 0 && value != 1) {
 		printk(KERN_ERR "%s %s: Invalid value: %d.\n", SPI_DRIVER_NAME,
 			__func__, value);
-		return -1;
+		return -EINVAL;
 	}
 
-	if (mcp23s08_control_reg(
-		    MCP23S08_REG_GPIO, MCP23S08_WRITE, txdata, &rxdata)) {
+	for (;;) {
+		// 出力ラッチのシャドウから、指定されたGPIOビットだけ変更する
+		// GPIOを読み直さないので、SPI通信は書き込みの1回だけになる
+		spin_lock_irqsave(&data->async_lock, flags);
+		if (data->async_error) {
+			data->async_error = 0;
+			spin_unlock_irqrestore(&data->async_lock, flags);
+			printk_ratelimited(KERN_ERR "%s %s: previous write to "
+						    "GPIO failed.\n",
+				SPI_DRIVER_NAME, __func__);
+			return -EIO;
+		}
+		unsigned char olat = data->olat[addr];
+		if (value == 0) {
+			olat &= ~(1 << gpio_num);
+		} else {
+			olat |= 1 << gpio_num;
+		}
+		retval = mcp23s08_async_queue_locked(
+			data, addr, MCP23S08_REG_OLAT, olat);
+		if (retval == 0) {
+			data->olat[addr] = olat;
+		}
+		spin_unlock_irqrestore(&data->async_lock, flags);
+
+		if (retval != -EBUSY) {
+			break;
+		}
+		if (nowait) {
+			return -EAGAIN;
+		}
+		// キューが一杯なので、空きができるまで待つ
+		if (wait_event_interruptible(data->async_wait,
+			    READ_ONCE(data->async_count) <
+				    MCP23S08_ASYNC_SLOTS)) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	if (retval) {
 		printk(KERN_ERR "%s %s: failed to write to GPIO.\n",
 			SPI_DRIVER_NAME, __func__);
-		return -1;
+		return retval;
+	}
+	return 0;
+}
+
+// 複数のピンの値をまとめて取得する
+// チップごとにGPIOレジスタを1回だけ読むので、ピンが増えても通信回数は増えない
+// 押下検出モードで、読むピンが全て離されているチップとは通信しない
+// 失敗した場合は-1を返す
+int mcp23s08_read_gpios(struct mcp23s08_drvdata *data,
+	const unsigned char *pins, const int num_pins, int *values)
+{
+	unsigned char ports[MCP23S08_MAX_CHIPS];
+	unsigned char read_mask = 0; // bit n = アドレスnのGPIOを読む
+
+	for (int i = 0; i < num_pins; i++) {
+		const unsigned char addr = MCP23S08_PIN_TO_ADDR(pins[i]);
+		const unsigned char bit = 1 << MCP23S08_PIN_TO_GPIO(pins[i]);
+		if (data->wake_enabled && (data->wake_mask[addr] & bit) &&
+			(READ_ONCE(data->wake_state[addr]) & bit)) {
+			continue;
+		}
+		read_mask |= 1 << addr;
+	}
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		// 読まないチップは、押下検出モードのキャッシュ(全て離されている)
+		ports[addr] = 0xff;
+		if (!(read_mask & (1 << addr))) {
+			continue;
+		}
+		if (mcp23s08_read_regs(
+			    data, addr, MCP23S08_REG_GPIO, &ports[addr], 1)) {
+			printk_ratelimited(KERN_ERR "%s %s: failed to read "
+						    "GPIO.\n",
+				SPI_DRIVER_NAME, __func__);
+			return -1;
+		}
+		if (data->wake_enabled && data->wake_mask[addr]) {
+			mcp23s08_wake_update(data, addr, ports[addr]);
+		}
 	}
 
+	for (int i = 0; i < num_pins; i++) {
+		values[i] = (ports[MCP23S08_PIN_TO_ADDR(pins[i])] >>
+				    MCP23S08_PIN_TO_GPIO(pins[i])) &
+			    1;
+	}
 	return 0;
 }
+
+// 出力ピンに最後に書き込んだ値を返す
+// 出力ラッチのシャドウを読むので、SPI通信はしない
+int mcp23s08_read_output(struct mcp23s08_drvdata *data, const unsigned char pin)
+{
+	unsigned long flags;
+	unsigned char olat;
+
+	spin_lock_irqsave(&data->async_lock, flags);
+	olat = data->olat[MCP23S08_PIN_TO_ADDR(pin)];
+	spin_unlock_irqrestore(&data->async_lock, flags);
+	return (olat >> MCP23S08_PIN_TO_GPIO(pin)) & 1;
+}
@@ -1,5 +1,49 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#ifndef MCP23S08_DRIVER_H
+#define MCP23S08_DRIVER_H
+
+// 1つのCSに接続できるMCP23S08の最大数
+// IOCON.HAENを有効にすると、A1/A0ピンで4つのアドレスを区別できる
+#define MCP23S08_MAX_CHIPS 4
+#define MCP23S08_NUM_GPIOS 8
+
+// レジスタマップ (ドライバとmcp23s08_mock.cで共有する)
+#define MCP23S08_OPCODE 0x40 // 0b0100_0{A1}{A0}{R/W}
+#define MCP23S08_READ 1
+#define MCP23S08_WRITE 0
+#define MCP23S08_REG_IODIR 0x00 // 入出力設定
+#define MCP23S08_REG_IPOL 0x01 // 入力極性設定（GPIOの論理反転できる）
+#define MCP23S08_REG_GPINTEN 0x02 // 割り込みON/OFF設定
+#define MCP23S08_REG_DEFVAL 0x03  // 割り込みのデフォルト値設定
+#define MCP23S08_REG_INTCON 0x04  // 割り込み制御設定
+#define MCP23S08_REG_IOCON 0x05	  // エキスパンダ全体の設定
+#define MCP23S08_REG_GPPU 0x06	  // プルアップ設定
+#define MCP23S08_REG_INTF 0x07	  // 割り込みフラグ
+#define MCP23S08_REG_INTCAP 0x08  // 割り込み時の論理レベル
+#define MCP23S08_REG_GPIO 0x09	  // GPIO
+#define MCP23S08_REG_OLAT 0x0a	  // 出力ラッチレジスタ
+#define MCP23S08_REG_SIZE 0x0b
+#define MCP23S08_IOCON_HAEN (1 << 3) // ハードウェアアドレスを有効にする
+// 1にするとアドレスポインタの自動インクリメントが無効になる
+// バースト転送を使うため、このドライバでは常に0(連続動作モード)にしておく
+#define MCP23S08_IOCON_SEQOP (1 << 5)
+// INTピンをオープンドレインにする (複数のMCP23S08でINTを共有するため)
+#define MCP23S08_IOCON_ODR (1 << 2)
+
+// ピン番号 = ハードウェアアドレス * 8 + MCP23S08のGPIO番号
+// デバイスツリーのfrootspi,*-pinsプロパティもこの番号で指定する
+#define MCP23S08_PIN(addr, gpio) ((addr)*MCP23S08_NUM_GPIOS + (gpio))
+#define MCP23S08_PIN_TO_ADDR(pin) ((pin) / MCP23S08_NUM_GPIOS)
+#define MCP23S08_PIN_TO_GPIO(pin) ((pin) % MCP23S08_NUM_GPIOS)
+
+// 機能ごとに割り当てられるピンの最大数
+#define MCP23S08_MAX_LEDS 8
+#define MCP23S08_MAX_PUSHSW 8
+#define MCP23S08_MAX_DIPSW 8
+
+// デバイスツリーでピン割当が指定されなかったときのデフォルト値
+// (アドレス0のMCP23S08だけが接続されたFrootsPi基板)
 #define MCP23S08_GPIO_LED 0
 #define MCP23S08_GPIO_PUSHSW0 1
 #define MCP23S08_GPIO_PUSHSW1 2
@@ -7,3 +51,26 @@
 #define MCP23S08_GPIO_PUSHSW3 4
 #define MCP23S08_GPIO_DIPSW0 6
 #define MCP23S08_GPIO_DIPSW1 5
+
+struct mcp23s08_drvdata;
+
+int mcp23s08_read_gpio(
+	struct mcp23s08_drvdata *data, const unsigned char pin);
+int mcp23s08_read_gpio_nowait(
+	struct mcp23s08_drvdata *data, const unsigned char pin);
+int mcp23s08_write_gpio(struct mcp23s08_drvdata *data,
+	const unsigned char pin, const unsigned char value, const bool nowait);
+int mcp23s08_read_output(
+	struct mcp23s08_drvdata *data, const unsigned char pin);
+int mcp23s08_read_gpios(struct mcp23s08_drvdata *data,
+	const unsigned char *pins, const int num_pins, int *values);
+// mcp23s08_write_gpio()でキューに入れた書き込みが完了するまで待つ
+int mcp23s08_fence(struct mcp23s08_drvdata *data);
+// 連続したレジスタを1回の転送で読み書きする(IOCON.SEQOP = 0)
+int mcp23s08_read_regs(struct mcp23s08_drvdata *data, const unsigned char addr,
+	const unsigned char reg, unsigned char *buf, const int len);
+int mcp23s08_write_regs(struct mcp23s08_drvdata *data,
+	const unsigned char addr, const unsigned char reg,
+	const unsigned char *buf, const int len);
+
+#endif
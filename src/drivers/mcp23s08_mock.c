@@ -0,0 +1,562 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/delay.h>	   // usleep_range()
+#include <linux/irq_sim.h>	   // irq_sim_*()
+#include <linux/module.h>	   // module_param()
+#include <linux/platform_device.h> // platform_device_register_simple()
+#include <linux/property.h>	   // PROPERTY_ENTRY_U32()
+#include <linux/spi/spi.h>	   // spi_*()
+#include <linux/spinlock.h>	   // spin_lock()
+
+#include "frootspi_debugfs.h"
+#include "mcp23s08_driver.h"
+
+#define MOCK_DRIVER_NAME "frootspi_mcp23s08_mock"
+#define MOCK_MAX_SPEED_HZ 10000000 // 実機のMCP23S08の上限
+
+// ソフトウェアで作ったSPIコントローラの先にMCP23S08のモデルをつなぎ、
+// Raspberry Piがなくても(x86のQEMUやUMLでも)mcp23s08_driver.cを動かせるようにする
+// insmod frootspi.ko mock_mcp23s08=1
+// 実機のデバイスツリーと同時に使うと、デバイスファイルの取り合いになるので注意
+static bool mock_mcp23s08;
+module_param(mock_mcp23s08, bool, 0444);
+MODULE_PARM_DESC(mock_mcp23s08, "Emulate MCP23S08s behind a software SPI "
+				"controller (default off)");
+
+static unsigned int mock_chip_mask = 0x01;
+module_param(mock_chip_mask, uint, 0444);
+MODULE_PARM_DESC(mock_chip_mask, "Hardware addresses of the emulated "
+				 "MCP23S08s (default 0x01)");
+
+// 転送1回ごとに足す待ち時間 (SPIコントローラのオーバーヘッドの代わり)
+// クロックに応じたビット時間はこれとは別に待つ
+static unsigned int mock_latency_us;
+module_param(mock_latency_us, uint, 0644);
+MODULE_PARM_DESC(mock_latency_us, "Extra latency in us added to every "
+				  "emulated SPI transfer (default 0)");
+
+// MCP23S08 1つ分のレジスタとピンの状態
+struct mock_chip {
+	unsigned char regs[MCP23S08_REG_SIZE];
+	unsigned char inputs; // 外部からピンに加えられている論理レベル
+};
+
+struct mock_stats {
+	atomic64_t transfers; // transfer_one()の回数
+	atomic64_t bytes;
+	atomic64_t reads;  // 読み出したレジスタの数
+	atomic64_t writes; // 書き込んだレジスタの数
+	atomic64_t irqs;   // INTピンをアサートした回数
+	atomic64_t bus_ns; // クロックから求めたバスの占有時間の合計
+};
+
+static struct mock_controller {
+	struct platform_device *pdev;
+	struct spi_controller *ctlr;
+	struct spi_device *spi;
+	spinlock_t lock; // chipsとint_activeを保護する
+	struct mock_chip chips[MCP23S08_MAX_CHIPS];
+	bool int_active; // INTピンの状態 (どれかのチップのINTFが0以外)
+	int irq;	 // 0ならINTピンをつながず、ドライバはポーリングする
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+	struct irq_sim irq_sim;
+	bool irq_sim_ready;
+#endif
+	struct mock_stats stats;
+	struct dentry *debugfs_dir;
+} mock;
+
+// ---------- MCP23S08のモデル (mock.lockを取ってから呼ぶ) ----------
+
+// GPIOレジスタの値 (入力ピンは外部の値をIPOLで反転したもの、出力ピンは出力ラッチ)
+static unsigned char mock_gpio_locked(const struct mock_chip *chip)
+{
+	const unsigned char iodir = chip->regs[MCP23S08_REG_IODIR];
+	const unsigned char in =
+		chip->inputs ^ chip->regs[MCP23S08_REG_IPOL];
+
+	return (in & iodir) | (chip->regs[MCP23S08_REG_OLAT] & ~iodir);
+}
+
+// 割り込みの条件を評価してINTFとINTCAPを更新する
+// prevは変化前のGPIOレジスタの値
+static void mock_eval_int_locked(
+	struct mock_chip *chip, const unsigned char prev)
+{
+	unsigned char *regs = chip->regs;
+	const unsigned char gpio = mock_gpio_locked(chip);
+	const unsigned char enabled =
+		regs[MCP23S08_REG_GPINTEN] & regs[MCP23S08_REG_IODIR];
+	// INTCONが0のピンは前の値からの変化、1のピンはDEFVALとの不一致で割り込む
+	const unsigned char fired =
+		enabled & ((~regs[MCP23S08_REG_INTCON] & (gpio ^ prev)) |
+				  (regs[MCP23S08_REG_INTCON] &
+					  (gpio ^ regs[MCP23S08_REG_DEFVAL])));
+
+	if (fired == 0) {
+		return;
+	}
+	// INTCAPは割り込みが発生した時点の値を、クリアされるまで保持する
+	if (regs[MCP23S08_REG_INTF] == 0) {
+		regs[MCP23S08_REG_INTCAP] = gpio;
+	}
+	regs[MCP23S08_REG_INTF] |= fired;
+}
+
+// INTピンを更新し、新たにアサートされたらtrueを返す
+static bool mock_update_int_line_locked(void)
+{
+	bool active = false;
+
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		if ((mock_chip_mask & (1 << addr)) &&
+			mock.chips[addr].regs[MCP23S08_REG_INTF]) {
+			active = true;
+		}
+	}
+	const bool asserted = active && !mock.int_active;
+	mock.int_active = active;
+	return asserted;
+}
+
+static unsigned char mock_read_reg_locked(
+	struct mock_chip *chip, const unsigned char reg, bool *fire)
+{
+	if (reg >= MCP23S08_REG_SIZE) {
+		return 0;
+	}
+	const unsigned char value = reg == MCP23S08_REG_GPIO
+					    ? mock_gpio_locked(chip)
+					    : chip->regs[reg];
+
+	// GPIOかINTCAPを読むと割り込みがクリアされる
+	// DEFVALと比較するピンは、条件が続いていればすぐに再び割り込む
+	if (reg == MCP23S08_REG_GPIO || reg == MCP23S08_REG_INTCAP) {
+		chip->regs[MCP23S08_REG_INTF] = 0;
+		mock_update_int_line_locked();
+		mock_eval_int_locked(chip, mock_gpio_locked(chip));
+		*fire |= mock_update_int_line_locked();
+	}
+	return value;
+}
+
+static void mock_write_reg_locked(struct mock_chip *chip,
+	const unsigned char reg, const unsigned char value, bool *fire)
+{
+	const unsigned char prev = mock_gpio_locked(chip);
+
+	switch (reg) {
+	case MCP23S08_REG_INTF:
+	case MCP23S08_REG_INTCAP:
+		// 読み出し専用
+		return;
+	case MCP23S08_REG_GPIO:
+		// GPIOへの書き込みは出力ラッチに入る
+		chip->regs[MCP23S08_REG_OLAT] = value;
+		break;
+	default:
+		if (reg >= MCP23S08_REG_SIZE) {
+			return;
+		}
+		chip->regs[reg] = value;
+		break;
+	}
+	mock_eval_int_locked(chip, prev);
+	*fire |= mock_update_int_line_locked();
+}
+
+// オペコードのアドレスに応答するか
+// IOCON.HAENが0のチップはA1/A0を無視して全てのアドレスに応答する
+static bool mock_chip_selected(const int addr, const int opcode_addr)
+{
+	if (!(mock_chip_mask & (1 << addr))) {
+		return false;
+	}
+	return !(mock.chips[addr].regs[MCP23S08_REG_IOCON] &
+		       MCP23S08_IOCON_HAEN) ||
+	       addr == opcode_addr;
+}
+
+// ---------- SPIコントローラ ----------
+
+static void mock_fire_irq(void)
+{
+	atomic64_inc(&mock.stats.irqs);
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+	if (mock.irq > 0) {
+		irq_sim_fire(&mock.irq_sim, 0);
+	}
+#endif
+}
+
+// 転送にかかる時間だけ待つ
+static void mock_delay(struct spi_device *spi, struct spi_transfer *xfer)
+{
+	const u32 speed_hz =
+		xfer->speed_hz ? xfer->speed_hz : spi->max_speed_hz;
+	const u64 bus_ns = div_u64((u64)xfer->len * 8 * NSEC_PER_SEC,
+		speed_hz ? speed_hz : MOCK_MAX_SPEED_HZ);
+	const u64 total_ns = bus_ns + (u64)mock_latency_us * NSEC_PER_USEC;
+
+	atomic64_add(bus_ns, &mock.stats.bus_ns);
+	if (total_ns >= 10 * NSEC_PER_USEC) {
+		const unsigned long us = div_u64(total_ns, NSEC_PER_USEC);
+		usleep_range(us, us + us / 8 + 1);
+	} else {
+		ndelay(total_ns);
+	}
+}
+
+// 1回の転送を処理する
+// 先頭2バイト(オペコードとレジスタアドレス)の後は、
+// IOCON.SEQOPが0ならレジスタアドレスを自動インクリメントする
+static int mock_transfer_one(struct spi_controller *ctlr,
+	struct spi_device *spi, struct spi_transfer *xfer)
+{
+	const unsigned char *tx = xfer->tx_buf;
+	unsigned char *rx = xfer->rx_buf;
+	bool fire = false;
+
+	if (rx) {
+		// 応答するチップがなければMISOはLowのまま
+		memset(rx, 0, xfer->len);
+	}
+	atomic64_inc(&mock.stats.transfers);
+	atomic64_add(xfer->len, &mock.stats.bytes);
+
+	if (tx && xfer->len > 2 && (tx[0] & ~0x07) == MCP23S08_OPCODE) {
+		const int opcode_addr = (tx[0] >> 1) & 0x03;
+		const bool read = tx[0] & MCP23S08_READ;
+		bool first = true;
+
+		spin_lock(&mock.lock);
+		for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+			struct mock_chip *chip = &mock.chips[addr];
+			unsigned char reg = tx[1];
+
+			if (!mock_chip_selected(addr, opcode_addr)) {
+				continue;
+			}
+			for (int i = 2; i < xfer->len; i++) {
+				if (read) {
+					const unsigned char value =
+						mock_read_reg_locked(
+							chip, reg, &fire);
+					// 複数のチップが応答したらワイヤードAND
+					if (rx) {
+						rx[i] = first ? value
+							      : rx[i] & value;
+					}
+				} else {
+					mock_write_reg_locked(
+						chip, reg, tx[i], &fire);
+				}
+				if (!(chip->regs[MCP23S08_REG_IOCON] &
+					    MCP23S08_IOCON_SEQOP)) {
+					reg = (reg + 1) % MCP23S08_REG_SIZE;
+				}
+			}
+			first = false;
+		}
+		spin_unlock(&mock.lock);
+
+		atomic64_add(xfer->len - 2,
+			read ? &mock.stats.reads : &mock.stats.writes);
+	}
+
+	if (fire) {
+		mock_fire_irq();
+	}
+	mock_delay(spi, xfer);
+	// 0を返すと転送が完了したことになる
+	return 0;
+}
+
+// 外部からピンに加える論理レベルを変える (ボタンを押す、DIPスイッチを切り替えるなど)
+static int mock_set_inputs(const int addr, const unsigned char inputs)
+{
+	bool fire;
+
+	if (addr < 0 || addr >= MCP23S08_MAX_CHIPS ||
+		!(mock_chip_mask & (1 << addr))) {
+		return -EINVAL;
+	}
+
+	struct mock_chip *chip = &mock.chips[addr];
+	spin_lock(&mock.lock);
+	const unsigned char prev = mock_gpio_locked(chip);
+	chip->inputs = inputs;
+	mock_eval_int_locked(chip, prev);
+	fire = mock_update_int_line_locked();
+	spin_unlock(&mock.lock);
+
+	if (fire) {
+		mock_fire_irq();
+	}
+	return 0;
+}
+
+#if IS_ENABLED(CONFIG_KUNIT)
+// ---------- KUnitのテスト(frootspi_kunit.c)から使う ----------
+
+// モックにつながったMCP23S08のプライベートデータ (モックが無効ならNULL)
+struct mcp23s08_drvdata *mcp23s08_mock_drvdata(void)
+{
+	if (!mock_mcp23s08 || mock.spi == NULL) {
+		return NULL;
+	}
+	return spi_get_drvdata(mock.spi);
+}
+
+u64 mcp23s08_mock_transfers(void)
+{
+	return atomic64_read(&mock.stats.transfers);
+}
+
+int mcp23s08_mock_set_inputs(const int addr, const unsigned char inputs)
+{
+	return mock_set_inputs(addr, inputs);
+}
+
+// 出力ラッチ(OLAT)の値
+int mcp23s08_mock_olat(const int addr)
+{
+	int olat;
+
+	if (addr < 0 || addr >= MCP23S08_MAX_CHIPS ||
+		!(mock_chip_mask & (1 << addr))) {
+		return -EINVAL;
+	}
+	spin_lock(&mock.lock);
+	olat = mock.chips[addr].regs[MCP23S08_REG_OLAT];
+	spin_unlock(&mock.lock);
+	return olat;
+}
+#endif
+
+// ---------- debugfs (/sys/kernel/debug/frootspi/mock_mcp23s08/) ----------
+
+// 読むと各チップの状態、"<addr> <value>"を書くと入力の論理レベルを変える
+static int mock_inputs_show(struct seq_file *s, void *unused)
+{
+	spin_lock(&mock.lock);
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		const struct mock_chip *chip = &mock.chips[addr];
+		if (!(mock_chip_mask & (1 << addr))) {
+			continue;
+		}
+		seq_printf(s,
+			"%d inputs=0x%02x gpio=0x%02x olat=0x%02x "
+			"iodir=0x%02x gpinten=0x%02x intf=0x%02x\n",
+			addr, chip->inputs, mock_gpio_locked(chip),
+			chip->regs[MCP23S08_REG_OLAT],
+			chip->regs[MCP23S08_REG_IODIR],
+			chip->regs[MCP23S08_REG_GPINTEN],
+			chip->regs[MCP23S08_REG_INTF]);
+	}
+	spin_unlock(&mock.lock);
+	return 0;
+}
+
+static int mock_inputs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mock_inputs_show, inode->i_private);
+}
+
+static ssize_t mock_inputs_write(struct file *file, const char __user *buf,
+	size_t count, loff_t *f_pos)
+{
+	char kbuf[32];
+	int addr;
+	int inputs;
+
+	if (count >= sizeof(kbuf)) {
+		return -EINVAL;
+	}
+	if (copy_from_user(kbuf, buf, count)) {
+		return -EFAULT;
+	}
+	kbuf[count] = '\0';
+	if (sscanf(kbuf, "%d %i", &addr, &inputs) != 2 || inputs < 0 ||
+		inputs > 0xff) {
+		return -EINVAL;
+	}
+
+	const int retval = mock_set_inputs(addr, inputs);
+	return retval ? retval : count;
+}
+
+static const struct file_operations mock_inputs_fops = {
+	.owner = THIS_MODULE,
+	.open = mock_inputs_open,
+	.read = seq_read,
+	.write = mock_inputs_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void mock_create_debugfs(void)
+{
+	mock.debugfs_dir =
+		debugfs_create_dir("mock_mcp23s08", frootspi_debugfs_root);
+	debugfs_create_file(
+		"inputs", 0600, mock.debugfs_dir, NULL, &mock_inputs_fops);
+	debugfs_create_u32(
+		"latency_us", 0600, mock.debugfs_dir, &mock_latency_us);
+	frootspi_debugfs_create_counter(
+		"transfers", mock.debugfs_dir, &mock.stats.transfers);
+	frootspi_debugfs_create_counter(
+		"bytes", mock.debugfs_dir, &mock.stats.bytes);
+	frootspi_debugfs_create_counter(
+		"reads", mock.debugfs_dir, &mock.stats.reads);
+	frootspi_debugfs_create_counter(
+		"writes", mock.debugfs_dir, &mock.stats.writes);
+	frootspi_debugfs_create_counter(
+		"irqs", mock.debugfs_dir, &mock.stats.irqs);
+	frootspi_debugfs_create_counter(
+		"bus_ns", mock.debugfs_dir, &mock.stats.bus_ns);
+}
+
+// ---------- 登録と削除 ----------
+
+// 電源投入直後の状態にする
+static void mock_reset_chips(void)
+{
+	for (int addr = 0; addr < MCP23S08_MAX_CHIPS; addr++) {
+		memset(&mock.chips[addr], 0, sizeof(mock.chips[addr]));
+		mock.chips[addr].regs[MCP23S08_REG_IODIR] = 0xff;
+		// スイッチは負論理なので、何も押されていない状態はHigh
+		mock.chips[addr].inputs = 0xff;
+	}
+	mock.int_active = false;
+}
+
+// INTピンの代わりにirq_simの割り込みを用意する
+// irq_simがないカーネルでは0を返し、ドライバはポーリングで動く
+static int mock_setup_irq(void)
+{
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+	if (irq_sim_init(&mock.irq_sim, 1) < 0) {
+		printk(KERN_ERR "%s %s: irq_sim_init() failed, "
+				"falling back to polling.\n",
+			MOCK_DRIVER_NAME, __func__);
+		return 0;
+	}
+	mock.irq_sim_ready = true;
+	return irq_sim_irqnum(&mock.irq_sim, 0);
+#else
+	return 0;
+#endif
+}
+
+static void mock_teardown_irq(void)
+{
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+	if (mock.irq_sim_ready) {
+		irq_sim_fini(&mock.irq_sim);
+		mock.irq_sim_ready = false;
+	}
+#endif
+	mock.irq = 0;
+}
+
+int register_mcp23s08_mock(void)
+{
+	int retval = -ENOMEM;
+
+	if (!mock_mcp23s08) {
+		return 0;
+	}
+	if (mock_chip_mask == 0 ||
+		mock_chip_mask >= (1 << MCP23S08_MAX_CHIPS)) {
+		printk(KERN_ERR "%s %s: invalid mock_chip_mask 0x%x.\n",
+			MOCK_DRIVER_NAME, __func__, mock_chip_mask);
+		return -EINVAL;
+	}
+
+	spin_lock_init(&mock.lock);
+	mock_reset_chips();
+
+	// SPIコントローラの親になるデバイス
+	mock.pdev = platform_device_register_simple(
+		MOCK_DRIVER_NAME, -1, NULL, 0);
+	if (IS_ERR(mock.pdev)) {
+		retval = PTR_ERR(mock.pdev);
+		printk(KERN_ERR "%s %s: platform_device_register_simple() "
+				"failed.\n",
+			MOCK_DRIVER_NAME, __func__);
+		goto failed_register_pdev;
+	}
+
+	mock.ctlr = spi_alloc_master(&mock.pdev->dev, 0);
+	if (mock.ctlr == NULL) {
+		printk(KERN_ERR "%s %s: spi_alloc_master() failed.\n",
+			MOCK_DRIVER_NAME, __func__);
+		goto failed_alloc_ctlr;
+	}
+	mock.ctlr->bus_num = -1; // 空いているバス番号を使う
+	mock.ctlr->num_chipselect = 1;
+	mock.ctlr->mode_bits = SPI_CPHA | SPI_CPOL;
+	mock.ctlr->max_speed_hz = MOCK_MAX_SPEED_HZ;
+	mock.ctlr->transfer_one = mock_transfer_one;
+
+	retval = spi_register_controller(mock.ctlr);
+	if (retval) {
+		printk(KERN_ERR "%s %s: spi_register_controller() failed.\n",
+			MOCK_DRIVER_NAME, __func__);
+		spi_controller_put(mock.ctlr);
+		goto failed_alloc_ctlr;
+	}
+
+	mock.irq = mock_setup_irq();
+
+	// デバイスツリーの代わりにプロパティで接続されているチップを伝える
+	struct property_entry properties[] = {
+		PROPERTY_ENTRY_U32(
+			"microchip,spi-present-mask", mock_chip_mask),
+		{},
+	};
+	struct spi_board_info info = {
+		.modalias = "mcp23s08-io",
+		.max_speed_hz = MOCK_MAX_SPEED_HZ,
+		.chip_select = 0,
+		.mode = SPI_MODE_0,
+		.irq = mock.irq,
+		.properties = properties,
+	};
+	// probe()もこの中で呼ばれる
+	mock.spi = spi_new_device(mock.ctlr, &info);
+	if (mock.spi == NULL) {
+		printk(KERN_ERR "%s %s: spi_new_device() failed.\n",
+			MOCK_DRIVER_NAME, __func__);
+		retval = -ENODEV;
+		goto failed_new_device;
+	}
+
+	mock_create_debugfs();
+	printk(KERN_INFO "%s: emulating MCP23S08 (mask 0x%x, irq %d) on %s.\n",
+		MOCK_DRIVER_NAME, mock_chip_mask, mock.irq,
+		dev_name(&mock.ctlr->dev));
+	return 0;
+
+failed_new_device:
+	mock_teardown_irq();
+	spi_unregister_controller(mock.ctlr);
+failed_alloc_ctlr:
+	platform_device_unregister(mock.pdev);
+failed_register_pdev:
+	return retval;
+}
+
+void unregister_mcp23s08_mock(void)
+{
+	if (!mock_mcp23s08) {
+		return;
+	}
+	debugfs_remove_recursive(mock.debugfs_dir);
+	// 子のSPIデバイスも削除され、ドライバのremove()が呼ばれる
+	spi_unregister_controller(mock.ctlr);
+	mock_teardown_irq();
+	platform_device_unregister(mock.pdev);
+	printk(KERN_INFO "%s: removed.\n", MOCK_DRIVER_NAME);
+}
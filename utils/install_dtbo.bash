@@ -4,6 +4,8 @@ dir=$(dirname $0)/../
 
 cd $dir/src/dts/
 dtc -@ -I dts -O dtb -o mygpio.dtbo mygpio-overlay.dts
+dtc -@ -I dts -O dtb -o frootspi.dtbo frootspi-overlay.dts
 sudo cp mygpio.dtbo /boot/firmware/overlays/
+sudo cp frootspi.dtbo /boot/firmware/overlays/
 
 echo "dtboを反映するため再起動してください"
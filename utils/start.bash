@@ -2,7 +2,7 @@
 
 dir=$(dirname $0)/../
 
-if [ -e "/sys/class/frootspi_hello" ]; then
+if [ -e "/sys/class/frootspi" ]; then
     sudo rmmod frootspi
 fi
 